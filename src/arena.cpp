@@ -0,0 +1,85 @@
+#include "arena.h"
+
+#include <cstddef>
+#include <stdlib.h>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+// Rounds the value up to the next multiple of the arena alignment.
+static size_t align_up(size_t value) {
+    return (value + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+//--------------------------------------------------------------------------------------
+
+Arena::Arena(size_t capacity) {
+    m_capacity = align_up(capacity > 0 ? capacity : ARENA_ALIGNMENT);
+    m_head = NULL;
+    m_size = 0;
+}
+
+Arena::~Arena() {
+    release();
+}
+
+//--------------------------------------------------------------------------------------
+
+Arena::Block* Arena::createBlock(size_t capacity) {
+    Block* block = new Block();
+
+    // The data region is aligned to a cache line, so every aligned offset within it is too
+    void* data = NULL;
+    if (posix_memalign(&data, ARENA_ALIGNMENT, capacity) != 0) {
+        delete block;
+        return NULL;
+    }
+
+    block->data = (char*) data;
+    block->capacity = capacity;
+    block->used = 0;
+    block->next = m_head;
+    return block;
+}
+
+void* Arena::allocate(size_t size) {
+    size_t required = align_up(size > 0 ? size : 1);
+
+    // The first block is created lazily, so an arena that is never used costs nothing
+    // If the current block cannot fit the request, we chain a new block in front of it.
+    // This only happens when the initial capacity was underestimated.
+    if (m_head == NULL || m_head->capacity - m_head->used < required) {
+        size_t capacity = m_head == NULL ? m_capacity : m_head->capacity * 2;
+        if (capacity < required) {
+            capacity = required;
+        }
+
+        Block* block = createBlock(capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        m_head = block;
+    }
+
+    // Bump the pointer
+    void* pointer = m_head->data + m_head->used;
+    m_head->used += required;
+    m_size += required;
+    return pointer;
+}
+
+void Arena::release() {
+    // Walk the chain of blocks freeing each of them
+    while (m_head != NULL) {
+        Block* next = m_head->next;
+        free(m_head->data);
+        delete m_head;
+        m_head = next;
+    }
+    m_size = 0;
+}
+
+size_t Arena::size() {
+    return m_size;
+}
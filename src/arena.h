@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+arena.h
+
+A bump allocator used to hold all of the storage associated with a single request.
+
+Rather than allocating each argument individually (and having to track each allocation to free it),
+the arena hands out slices of a single block and releases them all at once when the request is finished.
+Every slice is aligned to a cache line so that skeletons are free to use SIMD instructions on array arguments.
+*/
+
+#include <cstddef>
+
+// Alignment (in bytes) of every allocation made by the arena.
+#define ARENA_ALIGNMENT 64
+
+// Provides a bump allocator whose allocations are released together.
+class Arena {
+  public:
+    // Initializes a new instance of the Arena class with an initial block of the specified capacity.
+    Arena(size_t capacity);
+
+    // Releases all of the memory held by the arena.
+    ~Arena();
+
+    // Allocates a cache line aligned region of the specified size.  Returns NULL if memory is exhausted.
+    void* allocate(size_t size);
+
+    // Releases every allocation made by the arena in one step.
+    void release();
+
+    // Gets the number of bytes handed out by the arena.
+    size_t size();
+
+  private:
+    // A contiguous region of memory that allocations are carved from.
+    struct Block {
+        char* data;
+        size_t capacity;
+        size_t used;
+        Block* next;
+    };
+
+    // Allocates a new block capable of holding at least the specified number of bytes.
+    Block* createBlock(size_t capacity);
+
+    // The initial capacity requested by the owner
+    size_t m_capacity;
+
+    // The block currently being allocated from (the most recent block)
+    Block* m_head;
+
+    // The number of bytes handed out
+    size_t m_size;
+
+    // Arenas own their memory, so copying is not permitted
+    Arena(const Arena&);
+    Arena& operator =(const Arena&);
+};
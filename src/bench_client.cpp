@@ -0,0 +1,163 @@
+/*
+ * bench_client.cpp
+ *
+ * Measures the throughput of the client library as the threads making calls grow, against a binder
+ * and a server started by the benchmark itself (the binder is run from ./binder):
+ *
+ *   rpcCall       every call asks the binder for a server first, over the connection shared by the threads
+ *   rpcCacheCall  calls go straight to the servers kept in the service cache
+ *
+ * Every call is checked for its result, and the calls per second are reported for 1, 2, 4, ... threads,
+ * which share the same number of calls.  Each call connects to the server anew (and the server to the
+ * binder, on every request it wakes up to), leaving sockets in TIME_WAIT, so the calls are kept well
+ * below the ephemeral ports of the host.
+ *
+ * Usage: bench_client [max threads] [calls]
+ */
+#include "rpc.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The function called by the benchmark: returns its input times three.
+static int m_argTypes[] = { (1 << ARG_OUTPUT) | (ARG_INT << 16), (1 << ARG_INPUT) | (ARG_INT << 16), 0 };
+
+static int triple(int* argTypes, void** args) {
+    *(int*) args[0] = *(int*) args[1] * 3;
+    return 0;
+}
+
+// The calls made at every number of threads, the share of each thread, and the calls that failed or
+// returned the wrong result.
+static unsigned int m_calls = 0;
+static unsigned int m_threadCalls = 0;
+static atomic<unsigned long> m_failures(0);
+
+// Makes the calls of a thread with the call function (rpcCall or rpcCacheCall).
+static void* callThread(void* call) {
+    int (*function)(char*, int*, void**) = (int (*)(char*, int*, void**)) call;
+    for (unsigned int i = 0; i < m_threadCalls; i++) {
+        int input = i;
+        int output = 0;
+        void* args[] = { &output, &input };
+        if (function((char*) "triple", m_argTypes, args) != 0 || output != input * 3) {
+            m_failures++;
+        }
+    }
+    return NULL;
+}
+
+// Returns the calls per second made by the specified number of threads with the call function.
+static double measure(unsigned int threads, int (*function)(char*, int*, void**)) {
+    vector<pthread_t> workers(threads);
+    m_threadCalls = m_calls / threads;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, callThread, (void*) function);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+    return threads * m_threadCalls / chrono::duration<double>(end - start).count();
+}
+
+// Starts ./binder, pointing the environment at the address and port it prints.  Returns its process id (or -1).
+static pid_t startBinder() {
+    int output[2];
+    if (pipe(output) != 0) {
+        return -1;
+    }
+
+    pid_t binder = fork();
+    if (binder == 0) {
+        dup2(output[1], STDOUT_FILENO);
+        close(output[0]);
+        execl("./binder", "binder", (char*) NULL);
+        _exit(1);
+    }
+    close(output[1]);
+
+    FILE* lines = fdopen(output[0], "r");
+    char key[64], value[256];
+    bool address = false, port = false;
+    while (!(address && port) && fscanf(lines, "%63s %255s", key, value) == 2) {
+        if (strcmp(key, "BINDER_ADDRESS") == 0) {
+            setenv("BINDER_ADDRESS", value, 1);
+            address = true;
+        }
+        else if (strcmp(key, "BINDER_PORT") == 0) {
+            setenv("BINDER_PORT", value, 1);
+            port = true;
+        }
+    }
+
+    if (!(address && port)) {
+        kill(binder, SIGTERM);
+        return -1;
+    }
+    return binder;
+}
+
+// Starts a server of the function.  Returns its process id.
+static pid_t startServer() {
+    pid_t server = fork();
+    if (server == 0) {
+        if (rpcInit() != 0 || rpcRegister((char*) "triple", m_argTypes, triple) != 0) {
+            _exit(1);
+        }
+        rpcExecute();
+        _exit(0);
+    }
+    return server;
+}
+
+int main(int argc, char** argv) {
+    unsigned int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    m_calls = argc > 2 ? atoi(argv[2]) : 1000;
+
+    pid_t binder = startBinder();
+    if (binder < 0) {
+        fprintf(stderr, "bench_client: could not start ./binder\n");
+        return 1;
+    }
+    pid_t server = startServer();
+
+    // Wait for the server to register the function
+    int probe = 0, result = 0;
+    void* args[] = { &result, &probe };
+    for (unsigned int i = 0; i < 50 && rpcCall((char*) "triple", m_argTypes, args) != 0; i++) {
+        usleep(100000);
+    }
+
+    printf("%-8s %14s %14s\n", "threads", "rpcCall/s", "rpcCacheCall/s");
+    for (unsigned int threads = 1; threads <= maxThreads; threads *= 2) {
+        double located = measure(threads, rpcCall);
+        double cached = measure(threads, rpcCacheCall);
+        printf("%-8u %14.0f %14.0f\n", threads, located, cached);
+    }
+
+    unsigned long failures = m_failures;
+    if (failures > 0) {
+        printf("%lu calls failed\n", failures);
+    }
+
+    rpcTerminate();
+    waitpid(server, NULL, 0);
+    waitpid(binder, NULL, 0);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * bench_marshal.cpp
+ *
+ * Compares the throughput of the generic (argument type driven) marshalling with the marshallers
+ * generated by rpcgen from server_functions.idl, and on the server with the plans compiled at
+ * registration (see plan.h), for every phase of a call:
+ *
+ *   request write   the client writing the inputs (writeRequestArguments)
+ *   request read    the server reading them into argument storage (readArguments)
+ *   response write  the server writing the outputs (writeResponseArguments)
+ *   response read   the client reading them back (readResponseArguments)
+ *
+ * Both must produce the same bytes (for the current version and PROTOCOL_V1), which is checked before measuring.
+ *
+ * Usage: bench_marshal [iterations]
+ */
+#include "server_functions_rpc.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "arena.h"
+#include "plan.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+// Reads the argument values of a request into storage allocated from the arena (rpcserver.cpp).
+int readArguments(BinaryStream& stream, int argTypes[], void* args[], Arena& arena, unsigned int version, Protocol& connection);
+
+// The version the requests are marshalled with
+static const unsigned int m_version = PROTOCOL_CURRENT;
+
+// Returns the average nanoseconds taken by the phase over the specified number of iterations.
+template <typename Phase>
+static double measure(unsigned int iterations, Phase phase) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+        phase();
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(end - start).count() / iterations;
+}
+
+// Determines if the streams hold the same bytes.
+static bool sameBytes(BinaryStream& first, BinaryStream& second) {
+    return first.size() == second.size() && memcmp(first.buffer(), second.buffer(), first.size()) == 0;
+}
+
+// Prints the times of a phase, generic against generated (and planned, on the server).
+static void report(const char* name, const char* phase, double generic, double generated, double planned = 0) {
+    printf("%-4s %-15s %10.1f %10.1f %8.2fx", name, phase, generic, generated, generic / generated);
+    if (planned > 0) {
+        printf(" %10.1f %8.2fx", planned, generic / planned);
+    }
+    printf("\n");
+}
+
+// Benchmarks every phase of a call of the signature with the arguments (as filled by the client).
+// Returns false if the generated marshaller does not produce the bytes of the generic one.
+static bool benchmark(const char* name, const int* signature, void** args, const rpc_marshaller* marshaller, unsigned int iterations) {
+    int* argTypes = const_cast<int*>(signature);
+    unsigned int argLen = getArgTypesLength(argTypes);
+    Protocol connection(-1);
+
+    marshalling_plan plan;
+    if (!plan_compile(argTypes, plan)) {
+        printf("%-4s the signature cannot be planned\n", name);
+        return false;
+    }
+
+    // The request and response as each would put them on the wire
+    unsigned int versions[] = { PROTOCOL_V1, m_version };
+    for (unsigned int i = 0; i < 2; i++) {
+        BinaryStream request, typedRequest, response, typedResponse, plannedResponse;
+        writeRequestArguments(request, argTypes, args, versions[i], NULL);
+        writeRequestArguments(typedRequest, argTypes, args, versions[i], marshaller);
+        writeResponseArguments(response, argTypes, args, versions[i], NULL);
+        writeResponseArguments(typedResponse, argTypes, args, versions[i], marshaller);
+        writeResponseArguments(plannedResponse, argTypes, args, versions[i], NULL, &plan);
+        if (!sameBytes(request, typedRequest) || !sameBytes(response, typedResponse) || !sameBytes(response, plannedResponse)) {
+            printf("%-4s the generated marshaller or plan does not match the generic one (version %u)\n", name, versions[i]);
+            return false;
+        }
+    }
+
+    BinaryStream request, response;
+    writeRequestArguments(request, argTypes, args, m_version, NULL);
+    writeResponseArguments(response, argTypes, args, m_version, NULL);
+
+    // Both sides read into separate storage, as the server would
+    void* serverArgs[argLen];
+    size_t capacity = request.size() + argLen * ARENA_ALIGNMENT + marshaller->storage;
+
+    double generic = measure(iterations, [&]() {
+        BinaryStream stream;
+        writeRequestArguments(stream, argTypes, args, m_version, NULL);
+    });
+    double generated = measure(iterations, [&]() {
+        BinaryStream stream;
+        writeRequestArguments(stream, argTypes, args, m_version, marshaller);
+    });
+    report(name, "request write", generic, generated);
+
+    generic = measure(iterations, [&]() {
+        Arena arena(capacity);
+        request.seek(0);
+        readArguments(request, argTypes, serverArgs, arena, m_version, connection);
+    });
+    generated = measure(iterations, [&]() {
+        Arena arena(capacity);
+        request.seek(0);
+        marshaller->readRequest(request, serverArgs, (char*) arena.allocate(marshaller->storage), m_version);
+    });
+    double planned = measure(iterations, [&]() {
+        Arena arena(capacity);
+        request.seek(0);
+        plan_readRequest(plan, request, serverArgs, (char*) arena.allocate(plan.storage), m_version);
+    });
+    report(name, "request read", generic, generated, planned);
+
+    generic = measure(iterations, [&]() {
+        BinaryStream stream;
+        writeResponseArguments(stream, argTypes, args, m_version, NULL);
+    });
+    generated = measure(iterations, [&]() {
+        BinaryStream stream;
+        writeResponseArguments(stream, argTypes, args, m_version, marshaller);
+    });
+    planned = measure(iterations, [&]() {
+        BinaryStream stream;
+        writeResponseArguments(stream, argTypes, args, m_version, NULL, &plan);
+    });
+    report(name, "response write", generic, generated, planned);
+
+    generic = measure(iterations, [&]() {
+        response.seek(0);
+        readResponseArguments(response, argTypes, args, m_version, NULL);
+    });
+    generated = measure(iterations, [&]() {
+        response.seek(0);
+        readResponseArguments(response, argTypes, args, m_version, marshaller);
+    });
+    report(name, "response read", generic, generated);
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int iterations = argc > 1 ? (unsigned int) atoi(argv[1]) : 200000;
+    if (iterations == 0) {
+        fprintf(stderr, "usage: bench_marshal [iterations]\n");
+        return 1;
+    }
+
+    using namespace server_functions;
+
+    int result0 = 15, a0 = 5, b0 = 10;
+    void* args0[] = { &result0, &a0, &b0, NULL };
+
+    long result1 = 11111;
+    char a1 = 'a';
+    short b1 = 100;
+    int c1 = 1000;
+    long d1 = 10000;
+    void* args1[] = { &result1, &a1, &b1, &c1, &d1, NULL };
+
+    char result2[100] = "31234";
+    float a2 = 3.14159f;
+    double b2 = 1234.1001;
+    void* args2[] = { result2, &a2, &b2, NULL };
+
+    long values3[11] = { 11, 109, 107, 105, 103, 101, 102, 104, 106, 108, 110 };
+    void* args3[] = { values3, NULL };
+
+    char path4[28] = "/root/repo/src/server.c";
+    void* args4[] = { path4, NULL };
+
+    printf("%u iterations, ns per call\n", iterations);
+    printf("%-4s %-15s %10s %10s %9s %10s %9s\n", "", "phase", "generic", "generated", "speedup", "planned", "speedup");
+
+    bool matched = benchmark("f0", f0_argTypes, args0, &f0_marshaller, iterations);
+    matched = benchmark("f1", f1_argTypes, args1, &f1_marshaller, iterations) && matched;
+    matched = benchmark("f2", f2_argTypes, args2, &f2_marshaller, iterations) && matched;
+    matched = benchmark("f3", f3_argTypes, args3, &f3_marshaller, iterations) && matched;
+    matched = benchmark("f4", f4_argTypes, args4, &f4_marshaller, iterations) && matched;
+
+    return matched ? 0 : 1;
+}
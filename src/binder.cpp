@@ -14,8 +14,13 @@
 #include <sstream>
 #include <signal.h>
 #include <map>
+#include <set>
 #include <unistd.h>
 #include <cstdint>
+#include <climits>
+#include <ctime>
+#include <vector>
+#include <stdexcept>
 
 #include "protocol.h"
 #include "helpers.h"
@@ -24,14 +29,33 @@
 #include "rpc.h"
 #include "conversion.h"
 #include "bstream.h"
+#include "routing.h"
 
 using namespace std;
 
 // Determines if binder is running
 static bool m_running;
 
+// The generation the lists of servers start at.  It is taken from the clock when the binder starts, so clients
+// revalidating a list with a binder that restarted since do not mistake a new list for theirs.
+static unsigned int m_firstGeneration = 1;
+
+// The servers supporting a remote procedure command, the generation of the list (bumped on every change of it),
+// and the client connections subscribed to its changes (with the id each of them gave the subscription).
+struct function_servers {
+    list<function_info*> servers;
+    unsigned int generation;
+    set<pair<int, unsigned int>> subscribers;
+
+    function_servers() : generation(m_firstGeneration) {}
+};
+
 // The map of rpc_functions to known server functions
-static map<rpc_info, list<function_info*>*> m_serverFunctionMap;
+static map<rpc_info, function_servers*> m_serverFunctionMap;
+
+// The routing table published for the clients on this host (see routing.h), and whether it changed since.
+static RoutingPublisher m_routing;
+static bool m_routingChanged = false;
 
 // The server priority queue
 static list<server_info*> m_priorityQueue;
@@ -41,8 +65,8 @@ static map<int, server_info *> m_socketServerMap;
 static map<int, unsigned int> m_messageBlocks;
 static map<int, MessageType> m_messageInfo;
 
-// Gets the command supported server with the highest priority for the command.
-server_info *getPriorityServer(const rpc_info& command) {
+// Gets the command supported server with the highest priority for the command, along with the function it registered.
+server_info *getPriorityServer(const rpc_info& command, function_info** function) {
     // We need to get the server that is msot recent in the queue
     // that supports the current RPC, so we iterate through
     // priority queue looking for a match and pushing encountered
@@ -54,7 +78,7 @@ server_info *getPriorityServer(const rpc_info& command) {
     }
 
     // Get the servers that support this remote procedure command
-    list<function_info*> *supported_servers = m_serverFunctionMap[command];
+    list<function_info*> *supported_servers = &m_serverFunctionMap[command]->servers;
     server_info *rpc_server = NULL;
 
     // Iterate through the priority queue
@@ -67,6 +91,7 @@ server_info *getPriorityServer(const rpc_info& command) {
             // If they have same server, then ok good
             if (*server == *supportingServer) {
                 rpc_server = server;
+                *function = supportingServer;
                 break;
             }
         }
@@ -83,8 +108,20 @@ server_info *getPriorityServer(const rpc_info& command) {
     return rpc_server;
 }
 
+// Bumps the generation of the servers of a command once a server was added or removed, telling its subscribers.
+void function_changed(function_servers* functionServers, bool added, function_info& service) {
+    functionServers->generation++;
+    m_routingChanged = true;
+
+    // Subscribers that went away are forgotten once their connection is closed
+    for (auto const& subscriber : functionServers->subscribers) {
+        Protocol handler(subscriber.first);
+        handler.sendServicesChanged(subscriber.second, functionServers->generation, added, service);
+    }
+}
+
 // Adds a supported remote procedure command for the specified server
-ReasonCode function_add(string name, int argTypes[], string server_identifier, unsigned short port) {
+ReasonCode function_add(string name, int argTypes[], string server_identifier, unsigned short port, unsigned int version, unsigned int ttl) {
     // Constructs the server and command
     server_info location(server_identifier, port);
     rpc_info command(name, argTypes);
@@ -96,20 +133,21 @@ ReasonCode function_add(string name, int argTypes[], string server_identifier, u
     for (unsigned int i = 0; i < length; i++) { arguments[i] = argTypes[i]; }
     arguments[length - 1] = 0;
 
-    // Determine if the command exists or not.  If it does, it is the first time seeing it
-    // Therefore we need to add the definition the mapping object
-    if (m_serverFunctionMap.find(command) == m_serverFunctionMap.end()) {
+    // Determine if the command exists or not.  If it does not, it is the first time seeing it
+    // Therefore we need to add the definition the mapping object (at the position we looked it up at)
+    map<rpc_info, function_servers*>::iterator position = m_serverFunctionMap.lower_bound(command);
+    if (position == m_serverFunctionMap.end() || command < position->first) {
         // Recreate command with new arguments and create server-function map entry
-        command = rpc_info(name, arguments);
-        m_serverFunctionMap[command] = new list<function_info*>();
+        position = m_serverFunctionMap.insert(position, make_pair(rpc_info(name, arguments), new function_servers()));
     }
 
     // Get the list of servers associated with this command
-    list<function_info*> *supportedServers = m_serverFunctionMap[command];
+    function_servers *functionServers = position->second;
+    list<function_info*> *supportedServers = &functionServers->servers;
 
     // Create the server-function entry for the command
     rpc_info *sfnc_command = new rpc_info(name, arguments);
-    function_info *server_func = new function_info(server_identifier, port, sfnc_command);
+    function_info *server_func = new function_info(server_identifier, port, sfnc_command, version, ttl);
 
     // Iterate through the list of servers that currently support this command
     // If any of them match the current server, then kick them out
@@ -130,12 +168,13 @@ ReasonCode function_add(string name, int argTypes[], string server_identifier, u
 
     // Add the new/updated server_func
     supportedServers->push_back(server_func);
+    function_changed(functionServers, true, *server_func);
     return result;
 }
 
 // Registers a server with the binder based on the socket address information.
-void server_register(string server_identifier, unsigned short port, int serverfd) {
-    server_info* server = new server_info(server_identifier, port);
+void server_register(string server_identifier, unsigned short port, unsigned int version, int serverfd) {
+    server_info* server = new server_info(server_identifier, port, version);
     bool server_known = false;
 
     // Determine if we already know this server or not
@@ -177,12 +216,13 @@ void server_remove(int serverfd) {
 
     // Iterate over map and erase from any of the supporting
     for (auto const &rpc_map : m_serverFunctionMap) {
-        list<function_info*>* server_list = rpc_map.second;
+        list<function_info*>* server_list = &rpc_map.second->servers;
         for (list<function_info*>::iterator it = server_list->begin(); it != server_list->end(); it++) {
 
             function_info* info = *it;
             if (*server == *info) {
                 server_list->erase(it);
+                function_changed(rpc_map.second, false, *info);
                 break;
             }
         }
@@ -196,6 +236,14 @@ void server_remove(int serverfd) {
     m_messageInfo[serverfd] = FAILURE;
 }
 
+// Forgets the subscriptions made over a connection.
+void subscriber_remove(int socketfd) {
+    for (auto const &rpc_map : m_serverFunctionMap) {
+        set<pair<int, unsigned int>>& subscribers = rpc_map.second->subscribers;
+        subscribers.erase(subscribers.lower_bound(make_pair(socketfd, 0u)), subscribers.upper_bound(make_pair(socketfd, UINT_MAX)));
+    }
+}
+
 // Handles an registration request by a server.
 void handleRegisterRequest(Protocol& handler, BinaryStream& stream, int serverfd) {
     try {
@@ -209,9 +257,21 @@ void handleRegisterRequest(Protocol& handler, BinaryStream& stream, int serverfd
         int argTypes[argTypesLength];
         stream.readInt32(argTypes, argTypesLength);
 
+        // Servers that predate protocol versions do not send one
+        unsigned int version = PROTOCOL_V1;
+        if (stream.position() < stream.size()) {
+            version = stream.readUInt32();
+        }
+
+        // Followed by the time to live of pure functions
+        unsigned int ttl = 0;
+        if (stream.position() < stream.size()) {
+            ttl = stream.readUInt32();
+        }
+
         // Register the server and add the function to the support list
-        server_register(server_identifier, port, serverfd);
-        ReasonCode result = function_add(name, argTypes, server_identifier, port);
+        server_register(server_identifier, port, version, serverfd);
+        ReasonCode result = function_add(name, argTypes, server_identifier, port, version, ttl);
 
         // send success
         handler.sendRegisterResponse(result);
@@ -226,8 +286,68 @@ void handleRegisterRequest(Protocol& handler, BinaryStream& stream, int serverfd
     }
 }
 
-// Handles an incoming cache request for a server locations.
-void handleLocationCacheRequest(Protocol& handler, BinaryStream& stream) {
+// Handles a registration request by a server for many functions at once (REGISTER_BATCH).  The whole request is
+// read before any of the functions is added, so a malformed one registers none of them.
+void handleRegisterBatchRequest(Protocol& handler, BinaryStream& stream, int serverfd) {
+    try {
+        // Get name of the server, port, protocol version and the number of functions
+        string server_identifier = stream.readString();
+        unsigned short port = stream.readUInt16();
+        unsigned int version = stream.readUInt32();
+        unsigned int count = stream.readUInt32();
+
+        // Followed by the name, arguments and time to live of each function (the length of the name, the number of
+        // arguments, the terminating zero and the time to live take at least four integers, so that bounds the count)
+        if (count > (unsigned int) (stream.size() - stream.position()) / (4 * SIZEOF_INTEGER)) {
+            throw (int) RECEIVE_INVALID_MESSAGE;
+        }
+        vector<string> names(count);
+        vector<vector<int>> argTypes(count);
+        vector<unsigned int> ttls(count);
+        for (unsigned int i = 0; i < count; i++) {
+            names[i] = stream.readString();
+            unsigned int argTypesLength = stream.readUInt32();
+            if (argTypesLength == 0 || argTypesLength > (unsigned int) (stream.size() - stream.position()) / SIZEOF_INTEGER) {
+                throw (int) RECEIVE_INVALID_MESSAGE;
+            }
+            argTypes[i].resize(argTypesLength);
+            stream.readInt32(&argTypes[i].front(), argTypesLength);
+            ttls[i] = stream.readUInt32();
+
+            // The arguments are read up to their terminating zero
+            if (argTypes[i].back() != 0) {
+                throw (int) RECEIVE_INVALID_MESSAGE;
+            }
+        }
+
+        // Register the server once and add every function to the support lists
+        server_register(server_identifier, port, version, serverfd);
+        vector<ReasonCode> results(count);
+        for (unsigned int i = 0; i < count; i++) {
+            results[i] = function_add(names[i], &argTypes[i].front(), server_identifier, port, version, ttls[i]);
+        }
+
+        // send success
+        handler.sendRegisterBatchResponse(results);
+    }
+    catch (int e) {
+        // Remove the server completely to ensure
+        //no issues related to any of the commands
+        server_remove(serverfd);
+
+        // send register error
+        handler.sendRegisterError(ReasonCode::ERROR);
+    }
+    catch (const exception& e) {
+        // The request ended before its last function
+        server_remove(serverfd);
+        handler.sendRegisterError(ReasonCode::ERROR);
+    }
+}
+
+// Handles an incoming cache request for a server locations (LOC_CACHE_REQUEST), subscribing the connection to the
+// changes of the servers of the function (SUBSCRIBE) or telling whether the list the client has is current (LOC_CACHE_REVALIDATE).
+void handleLocationCacheRequest(Protocol& handler, BinaryStream& stream, int socketfd, MessageType type) {
     try {
         // Get the name of the function
         string name = stream.readString();
@@ -237,17 +357,31 @@ void handleLocationCacheRequest(Protocol& handler, BinaryStream& stream) {
         int argTypes[argTypesLength];
         stream.readInt32(argTypes, argTypesLength);
 
+        // Subscriptions are followed by the id the client gave them, and revalidations by the generation the client has
+        bool subscribe = (type == SUBSCRIBE);
+        unsigned int subscription = subscribe ? stream.readUInt32() : 0;
+        unsigned int generation = (type == LOC_CACHE_REVALIDATE) ? stream.readUInt32() : 0;
+
         // Construct an rpc definition
         rpc_info rpc(name, argTypes);
 
         // Using the rpc definition, we lookup to see if we actually know any
         // servers that support this function
         if(m_serverFunctionMap.find(rpc) != m_serverFunctionMap.end()) {
-            list<function_info*>* supportedServers = m_serverFunctionMap[rpc];
+            function_servers* functionServers = m_serverFunctionMap[rpc];
+            list<function_info*>* supportedServers = &functionServers->servers;
 
-            // If the list is not empty, set the list to the user
-            if (supportedServers->size() > 0) {
-                handler.sendLocationCacheResponse(*supportedServers);
+            // The subscription lasts while the function is known (even without any servers, until one comes back)
+            if (subscribe) {
+                functionServers->subscribers.insert(make_pair(socketfd, subscription));
+            }
+
+            // If the list is not empty, set the list to the user (unless the user has it already)
+            if (supportedServers->size() > 0 && generation != 0 && generation == functionServers->generation) {
+                handler.sendLocationCacheNotModified(generation);
+            }
+            else if (supportedServers->size() > 0) {
+                handler.sendLocationCacheResponse(*supportedServers, functionServers->generation);
             }
             else {
                 // if the list is empty, inform client that we have nothing available
@@ -265,6 +399,65 @@ void handleLocationCacheRequest(Protocol& handler, BinaryStream& stream) {
     }
 }
 
+// Handles an incoming cache request for the server locations of many functions at once (LOC_CACHE_BATCH), subscribing
+// the connection to the changes of their servers if asked to.  Functions without servers are answered with an empty list.
+void handleLocationCacheBatchRequest(Protocol& handler, BinaryStream& stream, int socketfd) {
+    try {
+        // Get the number of functions, and whether to subscribe to them (each function takes at least the length of
+        // its name, the number of its arguments and their terminating zero)
+        unsigned int count = stream.readUInt32();
+        bool subscribe = stream.readUInt32() != 0;
+        size_t remaining = stream.size() - stream.position();
+        if (count > remaining / (3 * SIZEOF_INTEGER)) {
+            throw (int) RECEIVE_INVALID_MESSAGE;
+        }
+
+        // The whole request is read first, so a malformed one subscribes to none of the functions
+        vector<string> names(count);
+        vector<vector<int>> argTypes(count);
+        vector<unsigned int> subscriptions(count, 0);
+        for (unsigned int i = 0; i < count; i++) {
+            // Get the name and arguments of the function (and the id the client gave its subscription)
+            names[i] = stream.readString();
+            unsigned int argTypesLength = stream.readUInt32();
+            remaining = stream.size() - stream.position();
+            if (argTypesLength == 0 || argTypesLength > remaining / SIZEOF_INTEGER) {
+                throw (int) RECEIVE_INVALID_MESSAGE;
+            }
+            argTypes[i].resize(argTypesLength);
+            stream.readInt32(&argTypes[i].front(), argTypesLength);
+            if (argTypes[i].back() != 0) {
+                throw (int) RECEIVE_INVALID_MESSAGE;
+            }
+            subscriptions[i] = subscribe ? stream.readUInt32() : 0;
+        }
+
+        vector<list<function_info*>> services(count);
+        vector<unsigned int> generations(count, 0);
+        for (unsigned int i = 0; i < count; i++) {
+            // Lookup the servers that support this function, as for a single request
+            map<rpc_info, function_servers*>::iterator position = m_serverFunctionMap.find(rpc_info(names[i], &argTypes[i].front()));
+            if (position != m_serverFunctionMap.end()) {
+                if (subscribe) {
+                    position->second->subscribers.insert(make_pair(socketfd, subscriptions[i]));
+                }
+                services[i] = position->second->servers;
+                generations[i] = position->second->generation;
+            }
+        }
+
+        handler.sendLocationCacheBatchResponse(services, generations);
+    }
+    catch (int e) {
+        // An error happened, so throw a failure message
+        handler.sendLocationCacheError(ERROR);
+    }
+    catch (const exception& e) {
+        // The request ended before its last function
+        handler.sendLocationCacheError(ERROR);
+    }
+}
+
 // Handles an incoming request for a server location.
 void handleLocationRequest(Protocol& handler, BinaryStream& stream) {
     try {
@@ -280,10 +473,11 @@ void handleLocationRequest(Protocol& handler, BinaryStream& stream) {
         rpc_info rpc(name, argTypes);
 
         // Get a server based on the priority queue (round robin)
-        server_info *location = getPriorityServer(rpc);
+        function_info *function = NULL;
+        server_info *location = getPriorityServer(rpc, &function);
         if (location != NULL) {
             // Send the server and port that we got
-            handler.sendLocationResponse(location->server_identifier, location->port);
+            handler.sendLocationResponse(location->server_identifier, location->port, location->version, function->ttl);
         }
         else {
             // We could not find an appropriate server for the function
@@ -344,8 +538,9 @@ void handleTerminateRequest() {
 }
 
 void handleServerClose(int socketfd, fd_set *master_set) {
-    // Cleanup server
+    // Cleanup server (or the subscriptions of a client)
     m_messageBlocks[socketfd] = 0;
+    subscriber_remove(socketfd);
     server_remove(socketfd);
 
     // Cleanup socket
@@ -365,8 +560,9 @@ void handleRequest(int socketfd, fd_set *master_set) {
         // Bytes are available for processing
         unsigned int size = m_messageBlocks[socketfd];
 
-        // Allocate a buffer for storing the received bytes
-        char buffer[size];
+        // Allocate a buffer for storing the received bytes (on the heap, as batched registrations can be large)
+        vector<char> received(size);
+        char* buffer = &received.front();
         int status = handler.receiveMessage(size, buffer);
 
         // If completed with no errors, then we need to handle the specific message
@@ -386,11 +582,19 @@ void handleRequest(int socketfd, fd_set *master_set) {
             case REGISTER:
                 handleRegisterRequest(handler, stream, socketfd);
                 break;
+            case REGISTER_BATCH:
+                handleRegisterBatchRequest(handler, stream, socketfd);
+                break;
             case LOC_REQUEST:
                 handleLocationRequest(handler, stream);
                 break;
             case LOC_CACHE_REQUEST:
-                handleLocationCacheRequest(handler, stream);
+            case LOC_CACHE_REVALIDATE:
+            case SUBSCRIBE:
+                handleLocationCacheRequest(handler, stream, socketfd, msgType);
+                break;
+            case LOC_CACHE_BATCH:
+                handleLocationCacheBatchRequest(handler, stream, socketfd);
                 break;
             case TERMINATE:
                 // This will probably not be called as
@@ -429,6 +633,32 @@ void handleRequest(int socketfd, fd_set *master_set) {
     }
 }
 
+// Publishes the servers of every function with servers to the routing table.
+void routing_publish() {
+    snapshot_entries entries;
+    for (auto const &rpc_map : m_serverFunctionMap) {
+        if (rpc_map.second->servers.empty()) {
+            continue;
+        }
+
+        list<function_info> services;
+        for (auto const &server : rpc_map.second->servers) {
+            services.push_back(function_info(server->server_identifier, server->port, NULL, server->version, server->ttl));
+        }
+        string key = routingKey(rpc_map.first.name, rpc_map.first.argTypes);
+        entries[key] = make_pair(make_shared<const list<function_info>>(services), rpc_map.second->generation);
+    }
+
+    m_routing.publish(entries);
+    m_routingChanged = false;
+}
+
+// Removes the routing table when the binder is stopped by a signal, so clients do not find it.
+void handleStopSignal(int) {
+    m_routing.close();
+    _exit(0);
+}
+
 // Formatted method for simply printing the binder information
 void print_info(string hostname, int port) {
     std::cout << "BINDER_ADDRESS " << hostname << std::endl;
@@ -464,6 +694,14 @@ int main(int argc, char *argv[]) {
     // Print the settings (hostname / port)
     print_settings(socketfd);
 
+    // Lists of servers start at a generation no earlier binder handed out for them (unless they changed more than once a second)
+    m_firstGeneration = (unsigned int) time(NULL);
+
+    // Clients on this host read the servers from the routing table (they ask over the socket if it cannot be created)
+    m_routing.open(getHostname(), getPort(socketfd));
+    signal(SIGTERM, handleStopSignal);
+    signal(SIGINT, handleStopSignal);
+
     // Establishes the file descriptor sets for monitoring incoming
     // user connections
     int max_fd = socketfd;
@@ -484,11 +722,13 @@ int main(int argc, char *argv[]) {
 
         // On failure exit
         if (selectResult < 0) {
+            m_routing.close();
             return SELECT_FAILURE;
         }
 
         // On timeout exit
         if (selectResult == 0) {
+            m_routing.close();
             return SELECT_TIMEOUT;
         }
 
@@ -515,9 +755,15 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
+
+        // Publish the changes of this pass at once
+        if (m_routingChanged) {
+            routing_publish();
+        }
     }
 
-    // Closes the socket
+    // Closes the socket (and the routing table)
+    m_routing.close();
     close(socketfd);
 
     return 0;
@@ -0,0 +1,68 @@
+#include "breaker.h"
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+CircuitBreaker::CircuitBreaker() : m_state(CLOSED), m_probing(false), m_next(0), m_failures(0) {
+}
+
+bool CircuitBreaker::allow(chrono::steady_clock::time_point now) {
+    if (m_state == OPEN && now - m_opened >= chrono::milliseconds(BREAKER_COOL_DOWN)) {
+        m_state = HALF_OPEN;
+        m_probing = false;
+    }
+
+    // Half open breakers let a single probe through at a time (or another one, if its outcome never came)
+    if (m_state == HALF_OPEN && (!m_probing || now - m_probed >= chrono::milliseconds(BREAKER_COOL_DOWN))) {
+        m_probing = true;
+        m_probed = now;
+        return true;
+    }
+
+    return m_state == CLOSED;
+}
+
+void CircuitBreaker::record(bool failed, chrono::steady_clock::time_point now) {
+    if (m_state == HALF_OPEN) {
+        m_probing = false;
+        if (failed) {
+            open(now);
+        }
+        else {
+            m_state = CLOSED;
+        }
+        return;
+    }
+
+    // Outcomes of requests let through before the breaker opened say nothing new
+    if (m_state == OPEN) {
+        return;
+    }
+
+    if (m_outcomes.size() < BREAKER_WINDOW) {
+        m_outcomes.push_back(failed);
+    }
+    else {
+        m_failures -= m_outcomes[m_next];
+        m_outcomes[m_next] = failed;
+        m_next = (m_next + 1) % BREAKER_WINDOW;
+    }
+    m_failures += failed;
+
+    if (m_outcomes.size() >= BREAKER_MIN_REQUESTS && m_failures * 100 >= m_outcomes.size() * BREAKER_FAILURE_RATE) {
+        open(now);
+    }
+}
+
+void CircuitBreaker::open(chrono::steady_clock::time_point now) {
+    m_state = OPEN;
+    m_opened = now;
+    m_outcomes.clear();
+    m_next = 0;
+    m_failures = 0;
+}
+
+CircuitBreaker::State CircuitBreaker::state() {
+    return m_state;
+}
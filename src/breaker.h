@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+breaker.h
+
+A circuit breaker of a server, kept by clients so calls skip servers known to be down rather than
+waiting on them to fail again.
+
+The breaker starts closed, letting every request through and recording whether the connection to the
+server failed.  Once enough of the last requests failed, it opens, and requests skip the server.  After
+a cool down it is half open: a single request goes through as a probe, which closes the breaker if it
+succeeds, and opens it again if it fails.  Only failures of the connection count, as an error returned
+by the function says nothing about the health of the server.
+*/
+
+#include <chrono>
+#include <vector>
+
+// The outcomes of the last requests a breaker keeps, and how many of them it needs to open.
+#define BREAKER_WINDOW 20
+#define BREAKER_MIN_REQUESTS 5
+
+// The percentage of failures in the window that opens the breaker.
+#define BREAKER_FAILURE_RATE 50
+
+// The milliseconds an open breaker waits before letting a probe through.
+#define BREAKER_COOL_DOWN 1000
+
+// Tracks the health of a server.
+class CircuitBreaker {
+  public:
+    enum State { CLOSED, OPEN, HALF_OPEN };
+
+    // Initializes a new instance of the CircuitBreaker class, closed.
+    CircuitBreaker();
+
+    // Determines if a request may be sent to the server, letting a probe through once an open breaker cooled down.
+    bool allow(std::chrono::steady_clock::time_point now);
+
+    // Records the outcome of a request that was let through.
+    void record(bool failed, std::chrono::steady_clock::time_point now);
+
+    // Gets the state of the breaker.
+    State state();
+
+  private:
+    // Opens the breaker, forgetting the outcomes of the requests before.
+    void open(std::chrono::steady_clock::time_point now);
+
+    State m_state;
+    std::chrono::steady_clock::time_point m_opened;
+    std::chrono::steady_clock::time_point m_probed;
+    bool m_probing;
+
+    // The outcomes of the last requests (true if failed), oldest at next once full, and the failures among them
+    std::vector<bool> m_outcomes;
+    unsigned int m_next;
+    unsigned int m_failures;
+};
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <stdexcept>
 
 using namespace std;
 
@@ -44,6 +45,9 @@ char* BinaryStream::buffer() {
 }
 
 void BinaryStream::seek(int index) {
+    if (index < 0 || (size_t) index > m_bytes.size()) {
+        throw std::out_of_range("BinaryStream::seek");
+    }
     m_position = index;
 }
 
@@ -55,6 +59,10 @@ int BinaryStream::size() {
     return m_bytes.size();
 }
 
+int BinaryStream::position() {
+    return m_position;
+}
+
 //--------------------------------------------------------------------------------------
 
 void BinaryStream::writeString(string value) {
@@ -75,6 +83,42 @@ void BinaryStream::writeCString(const char* value) {
     m_bytes.push_back('\0');
 }
 
+void BinaryStream::writePadding(int alignment) {
+    while (m_bytes.size() % alignment != 0) {
+        m_bytes.push_back('\0');
+    }
+}
+
+void BinaryStream::readPadding(int alignment) {
+    // Padding is relative to the start of the stream, so we align the position the same way
+    while (m_position % alignment != 0) {
+        m_position++;
+    }
+}
+
+void BinaryStream::writeVarUInt32(uint32_t value) {
+    // Least significant group first, the high bit of each byte marks that another one follows
+    while (value >= 128) {
+        m_bytes.push_back((char) ((value & 127) | 128));
+        value >>= 7;
+    }
+    m_bytes.push_back((char) value);
+}
+
+uint32_t BinaryStream::readVarUInt32() {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        unsigned char byte = m_bytes.at(m_position);
+        m_position++;
+
+        value |= (uint32_t) (byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
 std::string BinaryStream::readString() {
     int length = readInt32();
     string value;
@@ -312,6 +356,10 @@ void BinaryStream::writeDouble(double value[], int length) {
     }
 }
 
+void BinaryStream::writeBytes(const char value[], int length) {
+    m_bytes.insert(m_bytes.end(), value, value + length);
+}
+
 //--------------------------------------------------------------------------------------
 
 void BinaryStream::readChar(char array[], unsigned int length) {
@@ -349,3 +397,12 @@ void BinaryStream::readDouble(double array[], unsigned int length) {
         array[i] = readDouble();
     }
 }
+
+void BinaryStream::readBytes(char array[], unsigned int length) {
+    if (m_position < 0 || (size_t) m_position > m_bytes.size() || length > m_bytes.size() - m_position) {
+        throw std::out_of_range("BinaryStream::readBytes");
+    }
+
+    memcpy(array, m_bytes.data() + m_position, length);
+    m_position += length;
+}
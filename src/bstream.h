@@ -37,12 +37,16 @@ class BinaryStream {
     // returns buffer
     char* str();
     char* buffer();
+    // moves to the index, which may not be past the end (throws out_of_range)
     void seek(int index);
     void reset();
 
     // Gets the length of the stream in bytes.
     int size();
 
+    // Gets the current position within the stream.
+    int position();
+
     //--------------------------------------------------------------------------------------
     // Writing
 
@@ -79,6 +83,12 @@ class BinaryStream {
     // Writes a null terminated string to this stream, and advances the current position of the stream.
     void writeCString(const char* value);
 
+    // Writes zero bytes until the length of the stream is a multiple of the specified alignment.
+    void writePadding(int alignment);
+
+    // Writes a four-byte unsigned integer seven bits at a time, using one to five bytes depending on its magnitude.
+    void writeVarUInt32(uint32_t value);
+
     //--------------------------------------------------------------------------------------
 
     // Writes a character array of the specified length to the current stream and advances the current position of the stream.
@@ -99,6 +109,9 @@ class BinaryStream {
     // Writes a 8-byte floating-point array of the specified length to the current stream and advances the current position of the stream.
     void writeDouble(double value[], int length);
 
+    // Writes the specified number of raw bytes to the current stream in a single copy.
+    void writeBytes(const char value[], int length);
+
 
     //--------------------------------------------------------------------------------------
     // Reading
@@ -136,6 +149,12 @@ class BinaryStream {
     // Reads a string from the current stream. The string is null terminated.
     std::vector<char> readCString();
 
+    // Advances the current position of the stream past the padding written by writePadding.
+    void readPadding(int alignment);
+
+    // Reads a four-byte unsigned integer written by writeVarUInt32 and advances the position of the stream past it.
+    uint32_t readVarUInt32();
+
     //--------------------------------------------------------------------------------------
 
     // Reads a character array of the specified length to the current stream and advances the current position of the stream.
@@ -156,6 +175,10 @@ class BinaryStream {
     // Reads a 8-byte floating-point array of the specified length from the current stream and advances the current position of the stream.
     void readDouble(double array[], unsigned int length);
 
+    // Reads the specified number of raw bytes from the current stream in a single copy.
+    // Throws std::out_of_range if the stream holds fewer bytes (as the other reads do).
+    void readBytes(char array[], unsigned int length);
+
   private:
     std::vector<char> m_bytes;
     int m_position;
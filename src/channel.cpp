@@ -0,0 +1,212 @@
+#include "channel.h"
+#include "constants.h"
+#include "helpers.h"
+
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+BinderChannel::Connection::Connection(int socketfd) : socketfd(socketfd), broken(false), reading(false), tickets(0), served(0) {
+}
+
+BinderChannel::Connection::~Connection() {
+    close(socketfd);
+}
+
+//--------------------------------------------------------------------------------------
+
+BinderChannel::BinderChannel() : m_listening(false) {
+    pthread_mutex_init(&m_sendLock, NULL);
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_turn, NULL);
+}
+
+int BinderChannel::send(const binder_request& request, bool answered, shared_ptr<Connection>& connection, unsigned long& ticket) {
+    pthread_mutex_lock(&m_sendLock);
+
+    pthread_mutex_lock(&m_lock);
+    if (!m_connection) {
+        int socketfd = socket_create(getBinderAddress(), getBinderPort());
+        if (socketfd >= 0) {
+            m_connection = make_shared<Connection>(socketfd);
+            pthread_cond_broadcast(&m_turn);
+        }
+    }
+    connection = m_connection;
+    if (connection && answered) {
+        ticket = connection->tickets++;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    if (!connection) {
+        pthread_mutex_unlock(&m_sendLock);
+        return INIT_BINDER_SOCKET_ERROR;
+    }
+
+    Protocol handler(connection->socketfd);
+    int status = request(handler);
+    pthread_mutex_unlock(&m_sendLock);
+
+    if (status < 0) {
+        fail(connection);
+    }
+    return status;
+}
+
+int BinderChannel::readNext(const shared_ptr<Connection>& connection) {
+    connection->reading = true;
+    pthread_mutex_unlock(&m_lock);
+
+    // The message will be of the form: Length, Type, Message (contents)
+    Protocol handler(connection->socketfd);
+    unsigned int length = 0;
+    MessageType type = FAILURE;
+    string message;
+    int status = handler.receiveMessageSize(length);
+    if (status == 0) {
+        status = handler.receiveMessageType(type);
+    }
+    if (status == 0) {
+        message.resize(length);
+        status = (length == 0) ? 0 : handler.receiveMessage(length, &message[0]);
+    }
+
+    // Pushed messages answer no request
+    bool pushed = (status == 0 && type == SERVICES_CHANGED);
+    if (pushed && length > 0) {
+        pthread_mutex_lock(&m_lock);
+        binder_push push = m_push;
+        pthread_mutex_unlock(&m_lock);
+
+        // A push that does not decode leaves us not knowing what changed, so it fails the connection like losing it would
+        if (push) {
+            try {
+                BinaryStream stream(&message[0], length);
+                push(type, stream);
+            }
+            catch (const exception& e) {
+                status = RECEIVE_INVALID_MESSAGE;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&m_lock);
+    connection->reading = false;
+    if (status == 0 && !pushed) {
+        pair<MessageType, string>& response = connection->responses[connection->served++];
+        response.first = type;
+        response.second.swap(message);
+    }
+    pthread_cond_broadcast(&m_turn);
+    return status;
+}
+
+int BinderChannel::exchange(const binder_request& request, MessageType& type, string& response) {
+    shared_ptr<Connection> connection;
+    unsigned long ticket = 0;
+    int status = send(request, true, connection, ticket);
+    if (status < 0) {
+        return status;
+    }
+
+    // Read from the connection until our response arrives, unless another thread is reading it
+    pthread_mutex_lock(&m_lock);
+    while (true) {
+        map<unsigned long, pair<MessageType, string>>::iterator answered = connection->responses.find(ticket);
+        if (answered != connection->responses.end()) {
+            type = answered->second.first;
+            response.swap(answered->second.second);
+            connection->responses.erase(answered);
+            break;
+        }
+
+        if (connection->broken) {
+            status = SOCKET_CONNECTION_ERROR;
+            break;
+        }
+
+        if (connection->reading) {
+            pthread_cond_wait(&m_turn, &m_lock);
+            continue;
+        }
+
+        status = readNext(connection);
+        if (status < 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    if (status < 0) {
+        fail(connection);
+    }
+    return status;
+}
+
+int BinderChannel::notify(const binder_request& request) {
+    shared_ptr<Connection> connection;
+    unsigned long ticket = 0;
+    return send(request, false, connection, ticket);
+}
+
+void BinderChannel::listen(const binder_push& push, const function<void()>& lost) {
+    pthread_mutex_lock(&m_lock);
+    bool listening = m_listening;
+    m_push = push;
+    m_lost = lost;
+    m_listening = true;
+    pthread_mutex_unlock(&m_lock);
+
+    if (!listening) {
+        pthread_t listener;
+        pthread_create(&listener, NULL, &BinderChannel::listenThread, this);
+        pthread_detach(listener);
+    }
+}
+
+void* BinderChannel::listenThread(void* argument) {
+    BinderChannel* channel = (BinderChannel*) argument;
+
+    // Take the turn to read whenever nobody else has it (waiting for the next connection once one fails)
+    pthread_mutex_lock(&channel->m_lock);
+    while (true) {
+        shared_ptr<Connection> connection = channel->m_connection;
+        if (!connection || connection->reading) {
+            pthread_cond_wait(&channel->m_turn, &channel->m_lock);
+            continue;
+        }
+
+        if (channel->readNext(connection) < 0) {
+            pthread_mutex_unlock(&channel->m_lock);
+            channel->fail(connection);
+            pthread_mutex_lock(&channel->m_lock);
+        }
+    }
+    return NULL;
+}
+
+void BinderChannel::fail(const shared_ptr<Connection>& connection) {
+    pthread_mutex_lock(&m_lock);
+    bool lost = !connection->broken;
+    if (lost) {
+        // Threads still reading from the socket are woken up by the shutdown, and the last one closes it
+        connection->broken = true;
+        shutdown(connection->socketfd, SHUT_RDWR);
+        if (m_connection == connection) {
+            m_connection.reset();
+        }
+    }
+    pthread_cond_broadcast(&m_turn);
+
+    function<void()> forget = lost ? m_lost : function<void()>();
+    pthread_mutex_unlock(&m_lock);
+
+    // The binder forgot the subscriptions made over the connection
+    if (forget) {
+        forget();
+    }
+}
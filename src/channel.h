@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+channel.h
+
+The connection of a client to the binder, shared by all of its threads.
+
+The binder answers the requests of a connection in the order they arrive, so threads do not wait for
+the responses to each other's requests before sending their own.  Requests are sent one at a time (so
+their frames never interleave), each taking a ticket, and responses are matched to the tickets in the
+order they are read.  One thread at a time reads from the connection, handing every response to the
+thread whose ticket it answers, until its own response arrives and another waiting thread takes over.
+A failure of the connection fails every request in flight on it, and the next request connects again.
+
+Clients that subscribed to the changes of the servers of their functions (see rpcSubscribe) also get
+messages the binder pushes unasked (SERVICES_CHANGED).  Those are handed to the push handler, and a
+listener thread keeps reading the connection while no request is waiting for its response.
+*/
+
+#include "protocol.h"
+
+#include <pthread.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+// Sends a request to the binder over the protocol handler.
+typedef std::function<int(Protocol&)> binder_request;
+
+// Handles a message the binder pushed unasked, given its type and contents.
+typedef std::function<void(MessageType, BinaryStream&)> binder_push;
+
+// Multiplexes the requests of the threads of a client over a single connection to the binder.
+class BinderChannel {
+  public:
+    // Initializes a new instance of the BinderChannel class, connecting on the first request.
+    BinderChannel();
+
+    // Sends a request, receiving the type and contents of its response.
+    int exchange(const binder_request& request, MessageType& type, std::string& response);
+
+    // Sends a request that has no response.
+    int notify(const binder_request& request);
+
+    // Hands the messages pushed by the binder to the handler, reading them as they arrive, and tells the lost
+    // handler whenever the connection fails (as the binder forgets the subscriptions made over it).
+    void listen(const binder_push& push, const std::function<void()>& lost);
+
+  private:
+    // A connection to the binder, closed once the last thread using it is done with it.
+    struct Connection {
+        int socketfd;
+        bool broken;
+        bool reading;                   // a thread is reading from the connection
+        unsigned long tickets;          // handed out to the requests sent
+        unsigned long served;           // the requests whose response was read
+        std::map<unsigned long, std::pair<MessageType, std::string>> responses;  // read, not yet taken by their thread
+
+        Connection(int socketfd);
+        ~Connection();
+    };
+
+    // Sends a request over the connection (connecting first if needed), handing out its ticket if it has a response.
+    int send(const binder_request& request, bool answered, std::shared_ptr<Connection>& connection, unsigned long& ticket);
+
+    // Reads the next message from the connection, taking the turn to read (with the lock held on entry and exit).
+    // Responses are kept for the thread of their ticket, and pushed messages are handed to the push handler.
+    int readNext(const std::shared_ptr<Connection>& connection);
+
+    // Fails the connection, waking the threads waiting for their responses over it.
+    void fail(const std::shared_ptr<Connection>& connection);
+
+    // Reads the messages pushed by the binder while no request is waiting for its response.
+    static void* listenThread(void* channel);
+
+    pthread_mutex_t m_sendLock;     // held to send a request
+    pthread_mutex_t m_lock;         // held to read or update the connection
+    pthread_cond_t m_turn;          // signalled once a message was read, or the connection changed
+    std::shared_ptr<Connection> m_connection;
+
+    // Set once by listen
+    binder_push m_push;
+    std::function<void()> m_lost;
+    bool m_listening;
+
+    // The channel is shared by address, so copying is not permitted
+    BinderChannel(const BinderChannel&);
+    BinderChannel& operator =(const BinderChannel&);
+};
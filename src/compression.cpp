@@ -0,0 +1,92 @@
+#include "compression.h"
+
+#include <vector>
+
+#ifdef RPC_WITH_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef RPC_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+unsigned int compression_codecs() {
+    unsigned int codecs = CODEC_NONE;
+#ifdef RPC_WITH_LZ4
+    codecs |= CODEC_LZ4;
+#endif
+#ifdef RPC_WITH_ZSTD
+    codecs |= CODEC_ZSTD;
+#endif
+    return codecs;
+}
+
+unsigned int compression_choose(unsigned int accepted) {
+    unsigned int common = accepted & compression_codecs();
+
+    // LZ4 is preferred as it is cheap enough to never be slower than the network
+    if (common & CODEC_LZ4) {
+        return CODEC_LZ4;
+    }
+    if (common & CODEC_ZSTD) {
+        return CODEC_ZSTD;
+    }
+    return CODEC_NONE;
+}
+
+//--------------------------------------------------------------------------------------
+
+int compression_compress(unsigned int codec, const char* payload, unsigned int size, vector<char>& output) {
+    // Builds without any codec never compress
+    (void) payload;
+    (void) size;
+    (void) output;
+
+    switch(codec) {
+#ifdef RPC_WITH_LZ4
+        case CODEC_LZ4: {
+                output.resize(LZ4_compressBound(size));
+                int compressed = LZ4_compress_default(payload, &output.front(), size, output.size());
+                return compressed > 0 ? compressed : -1;
+            }
+#endif
+#ifdef RPC_WITH_ZSTD
+        case CODEC_ZSTD: {
+                output.resize(ZSTD_compressBound(size));
+                size_t compressed = ZSTD_compress(&output.front(), output.size(), payload, size, 1);
+                return ZSTD_isError(compressed) ? -1 : (int) compressed;
+            }
+#endif
+        default:
+            return -1;
+    }
+}
+
+int compression_decompress(unsigned int codec, const char* compressed, unsigned int compressedSize, char* output, unsigned int size) {
+    // Builds without any codec never decompress
+    (void) compressed;
+    (void) compressedSize;
+    (void) output;
+    (void) size;
+
+    switch(codec) {
+#ifdef RPC_WITH_LZ4
+        case CODEC_LZ4: {
+                int decompressed = LZ4_decompress_safe(compressed, output, compressedSize, size);
+                return decompressed == (int) size ? 0 : -1;
+            }
+#endif
+#ifdef RPC_WITH_ZSTD
+        case CODEC_ZSTD: {
+                size_t decompressed = ZSTD_decompress(output, size, compressed, compressedSize);
+                return (!ZSTD_isError(decompressed) && decompressed == size) ? 0 : -1;
+            }
+#endif
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+compression.h
+
+Payload compression codecs for large messages.
+
+Codecs are only available when the library is built against them (see the CODECS variable in the Makefile).
+Peers tell each other which codecs they accept (see Protocol), and a message is only compressed with a codec the
+receiver accepts, once it is large enough for compression to pay off.
+*/
+
+#include <vector>
+
+// Codecs are identified by a bit, so that a set of codecs fits in a mask.
+#define CODEC_NONE 0
+#define CODEC_LZ4  1
+#define CODEC_ZSTD 2
+
+// Messages with smaller payloads than this are never compressed.
+#define COMPRESSION_THRESHOLD 4096
+
+// Returns the mask of the codecs linked into this build.
+unsigned int compression_codecs();
+
+// Returns the preferred codec out of the mask of codecs accepted by the peer (CODEC_NONE if there is none in common).
+unsigned int compression_choose(unsigned int accepted);
+
+// Compresses the payload with the codec into the output buffer. Returns the compressed size, or a negative value on failure.
+int compression_compress(unsigned int codec, const char* payload, unsigned int size, std::vector<char>& output);
+
+// Decompresses the compressed payload with the codec into the output buffer, which must be exactly the original size.
+// Returns zero on success, or a negative value on failure.
+int compression_decompress(unsigned int codec, const char* compressed, unsigned int compressedSize, char* output, unsigned int size);
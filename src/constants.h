@@ -22,7 +22,75 @@ enum MessageType {
 
     LOC_CACHE_REQUEST = 14,
     LOC_CACHE_SUCCESS = 24,
-    LOC_CACHE_FAILURE = 44
+    LOC_CACHE_FAILURE = 44,
+
+    // Execute messages that only carry inputs in the request and outputs in the reply (PROTOCOL_V2).
+    // Failures are reported with EXECUTE_FAILURE.
+    EXECUTE_DIRECTED = 15,
+    EXECUTE_DIRECTED_SUCCESS = 25,
+
+    // Directed execute whose streamed arguments follow in STREAM_CHUNK messages, each
+    // argument closed by STREAM_END (PROTOCOL_V4).  Streamed outputs are sent the same way
+    // ahead of the EXECUTE_DIRECTED_SUCCESS or EXECUTE_FAILURE reply.
+    EXECUTE_STREAMED = 16,
+    STREAM_CHUNK = 17,
+    STREAM_END = 18,
+
+    // Directed execute naming the function by a handle the server handed out in the reply to an
+    // earlier request on a compact connection, instead of by name and argument types (PROTOCOL_V7).
+    EXECUTE_HANDLE = 19,
+
+    // Location cache request that also subscribes the connection to the changes of the servers of the
+    // function, answered with LOC_CACHE_SUCCESS or LOC_CACHE_FAILURE.  From then on, the binder pushes
+    // a SERVICES_CHANGED message on the connection whenever a server of the function is added or removed.
+    SUBSCRIBE = 30,
+    SERVICES_CHANGED = 31,
+
+    // Location cache request naming the generation of the list the client has, answered with
+    // LOC_CACHE_NOT_MODIFIED (carrying only the generation) if it is still current, and as a
+    // LOC_CACHE_REQUEST otherwise.
+    LOC_CACHE_REVALIDATE = 32,
+    LOC_CACHE_NOT_MODIFIED = 33,
+
+    // Registration of many functions of a server at once, answered with REGISTER_BATCH_SUCCESS
+    // (carrying the reason code of each function, in order) or REGISTER_FAILURE.
+    REGISTER_BATCH = 34,
+    REGISTER_BATCH_SUCCESS = 35,
+
+    // Cached location request for many functions at once (subscribing to all of them, or none), answered
+    // with LOC_CACHE_BATCH_SUCCESS (carrying the servers of each function, in order) or LOC_CACHE_FAILURE.
+    LOC_CACHE_BATCH = 36,
+    LOC_CACHE_BATCH_SUCCESS = 37
+};
+
+//--------------------------------------------------------------------------------------
+// Specifies the versions of the wire protocol.  Servers advertise the highest version they
+// understand when registering, the binder hands it to clients with the server locations, and
+// clients execute using the lower of the server version and their own.
+enum ProtocolVersion {
+    // The original format, every argument is sent in both directions.
+    PROTOCOL_V1 = 1,
+
+    // Direction-aware execute messages (EXECUTE_DIRECTED).
+    PROTOCOL_V2 = 2,
+
+    // Variable-length array arguments (ARG_VARIABLE).
+    PROTOCOL_V3 = 3,
+
+    // Streamed array arguments (ARG_STREAM, EXECUTE_STREAMED).
+    PROTOCOL_V4 = 4,
+
+    // Frames advertising the accepted codecs and carrying compressed payloads (see compression.h).
+    PROTOCOL_V5 = 5,
+
+    // Delta encoded integer arrays (ARG_PACKED).
+    PROTOCOL_V6 = 6,
+
+    // Compact (varint) frame headers and function handles (EXECUTE_HANDLE).
+    PROTOCOL_V7 = 7,
+
+    // The highest version understood by this build.
+    PROTOCOL_CURRENT = PROTOCOL_V7
 };
 
 //--------------------------------------------------------------------------------------
@@ -34,8 +102,10 @@ enum ReasonCode {
     RECEIVED_TERMINATED=-500,
 
     FUNCTION_OVERRIDDEN = 201,
+    LOCATION_NOT_MODIFIED = 304,
     FUNCTION_NOT_AVAILABLE = -404,
     FUNCTION_EXECUTION_ERROR = -405,
+    FUNCTION_BACKING_OFF = -406,        // no server was tried, as the retry budget ran out or every circuit breaker was open
 
     SOCKET_OPEN_ERROR = -300,
     SOCKET_UNKNOWN_HOST = -301,
@@ -46,6 +116,8 @@ enum ReasonCode {
     SOCKET_CONNECTION_ERROR = -310,
 
     EXECUTE_UNKNOWN_SKELETON = -202,
+    EXECUTE_UNSUPPORTED_ARGUMENT = -203,
+    EXECUTE_UNKNOWN_HANDLE = -204,
 
     INIT_BINDER_ADDRESS_NOT_SET = -501,
     INIT_BINDER_PORT_NOT_SET = -502,
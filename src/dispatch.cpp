@@ -0,0 +1,162 @@
+#include "dispatch.h"
+#include "helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// The most seeds tried for a bucket before the table is made larger
+#define DISPATCH_MAX_SEEDS 65536
+
+// The average number of keys per bucket
+#define DISPATCH_BUCKET_KEYS 2
+
+//--------------------------------------------------------------------------------------
+
+// Mixes the bits of the value, so every bit of the result depends on every bit of the value.
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// Returns the bucket of the hash.
+static unsigned int bucketOf(const dispatch_table& table, uint64_t hash) {
+    return (unsigned int) ((hash >> 32) % table.seeds.size());
+}
+
+// Returns the slot the hash is sent to by the seed.
+static size_t slotOf(const dispatch_table& table, uint64_t hash, unsigned int seed) {
+    return mix(hash + seed * 0x9e3779b97f4a7c15ULL) & (table.slots.size() - 1);
+}
+
+// Determines if the argument types have the same shape (see dispatch.h).
+static bool sameShape(const vector<int>& registered, int* argTypes) {
+    for (unsigned int i = 0; i < registered.size(); i++) {
+        if ((registered[i] == 0) != (argTypes[i] == 0)) {
+            return false;
+        }
+        if (registered[i] != argTypes[i] && isArgTypeArray(registered[i]) != isArgTypeArray(argTypes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Places the keys of every bucket, largest buckets first, in a table of the specified number of slots.
+// Returns false if a bucket has no seed that places all of its keys.
+static bool place(const vector<uint64_t>& hashes, size_t size, dispatch_table& table) {
+    table.seeds.assign(hashes.size() / DISPATCH_BUCKET_KEYS + 1, 0);
+    dispatch_slot empty = { 0, -1 };
+    table.slots.assign(size, empty);
+
+    vector<vector<int>> buckets(table.seeds.size());
+    for (unsigned int i = 0; i < hashes.size(); i++) {
+        buckets[bucketOf(table, hashes[i])].push_back(i);
+    }
+
+    vector<unsigned int> order(buckets.size());
+    for (unsigned int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](unsigned int l, unsigned int r) {
+        return buckets[l].size() > buckets[r].size();
+    });
+
+    vector<size_t> slots;
+    for (unsigned int bucket : order) {
+        const vector<int>& members = buckets[bucket];
+        if (members.empty()) {
+            break;
+        }
+
+        bool placed = false;
+        for (unsigned int seed = 0; seed < DISPATCH_MAX_SEEDS && !placed; seed++) {
+            slots.clear();
+            placed = true;
+            for (unsigned int i = 0; i < members.size() && placed; i++) {
+                size_t slot = slotOf(table, hashes[members[i]], seed);
+                placed = table.slots[slot].index < 0 && find(slots.begin(), slots.end(), slot) == slots.end();
+                slots.push_back(slot);
+            }
+
+            if (placed) {
+                table.seeds[bucket] = seed;
+                for (unsigned int i = 0; i < members.size(); i++) {
+                    table.slots[slots[i]].hash = hashes[members[i]];
+                    table.slots[slots[i]].index = members[i];
+                }
+            }
+        }
+
+        if (!placed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------
+
+uint64_t dispatch_hash(const char* name, int* argTypes) {
+    // FNV-1a over the name, then one bit per argument (array or scalar) and the number of arguments
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+    }
+
+    unsigned int count = 0;
+    for (; argTypes[count] != 0; count++) {
+        hash = (hash ^ (isArgTypeArray(argTypes[count]) ? 2 : 1)) * 0x100000001b3ULL;
+    }
+    return mix(hash ^ count);
+}
+
+bool dispatch_build(const vector<dispatch_key>& keys, dispatch_table& table) {
+    table.keys = keys;
+
+    vector<uint64_t> hashes;
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        hashes.push_back(dispatch_hash(keys[i].name.c_str(), const_cast<int*>(&keys[i].argTypes.front())));
+    }
+
+    // Keys with the same hash cannot be told apart by any seed
+    vector<uint64_t> sorted(hashes);
+    sort(sorted.begin(), sorted.end());
+    if (adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+        return false;
+    }
+
+    // Start with the smallest power of two that fits the keys, and grow until every bucket is placed
+    size_t size = 1;
+    while (size < keys.size()) {
+        size <<= 1;
+    }
+    while (!place(hashes, size, table)) {
+        size <<= 1;
+    }
+    return true;
+}
+
+int dispatch_find(const dispatch_table& table, const char* name, int* argTypes) {
+    if (table.keys.empty()) {
+        return -1;
+    }
+
+    uint64_t hash = dispatch_hash(name, argTypes);
+    const dispatch_slot& slot = table.slots[slotOf(table, hash, table.seeds[bucketOf(table, hash)])];
+    if (slot.index < 0 || slot.hash != hash) {
+        return -1;
+    }
+
+    // The hash only makes a match likely, so the key is compared as the registration map would
+    const dispatch_key& key = table.keys[slot.index];
+    if (strcmp(key.name.c_str(), name) != 0 || !sameShape(key.argTypes, argTypes)) {
+        return -1;
+    }
+    return slot.index;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+dispatch.h
+
+The dispatch table of the server, frozen from the registered functions when rpcExecute starts.
+
+Requests are matched to registered functions by name and by the shape of their argument types: the
+number of arguments and whether each is an array or a scalar (see operator< of rpc_info, which the
+registration map is ordered by).  A map lookup compares names and argument types all the way down the
+tree; the dispatch table hashes the name and shape once and finds the only slot the function can be in.
+
+The table is a perfect hash built by hash and displace: keys are spread over small buckets by their
+hash, and each bucket gets the seed that sends all of its keys to free slots.  A lookup reads the seed
+of its bucket (a small array) and then a single slot, which holds the full hash of its key, so misses
+are rejected without touching the keys.  The table never changes once built, so lookups take no lock.
+*/
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The key of a registered function.
+struct dispatch_key {
+    std::string name;
+    std::vector<int> argTypes;  // terminated by zero
+};
+
+// A slot of the table.
+struct dispatch_slot {
+    uint64_t hash;  // the hash of the key (see dispatch_hash)
+    int index;      // the index of the key, or -1 if the slot is empty
+};
+
+// The perfect hash table of a set of keys.
+struct dispatch_table {
+    std::vector<unsigned int> seeds;    // the seed of every bucket
+    std::vector<dispatch_slot> slots;   // a power of two
+    std::vector<dispatch_key> keys;
+};
+
+// Hashes the name and the shape of the argument types (terminated by zero).
+uint64_t dispatch_hash(const char* name, int* argTypes);
+
+// Builds the table of the keys, which must all have distinct shapes.  Returns false if two keys
+// have the same hash, in which case lookups have to go elsewhere.
+bool dispatch_build(const std::vector<dispatch_key>& keys, dispatch_table& table);
+
+// Finds the key matching the name and argument types.  Returns its index, or -1 if there is none.
+int dispatch_find(const dispatch_table& table, const char* name, int* argTypes);
@@ -0,0 +1,82 @@
+#include "flight.h"
+
+#include <functional>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+FlightGroup::FlightGroup() : m_coalesced(0) {
+}
+
+FlightGroup::Shard& FlightGroup::shard(const string& key) {
+    return m_shards[hash<string>()(key) % FLIGHT_SHARDS];
+}
+
+bool FlightGroup::join(const string& key, flight*& joined) {
+    Shard& keyShard = shard(key);
+    pthread_mutex_lock(&keyShard.lock);
+
+    map<string, flight*>::iterator existing = keyShard.flights.find(key);
+    if (existing != keyShard.flights.end()) {
+        joined = existing->second;
+        joined->waiters++;
+        m_coalesced++;
+        pthread_mutex_unlock(&keyShard.lock);
+        return false;
+    }
+
+    joined = new flight();
+    pthread_cond_init(&joined->landed, NULL);
+    joined->lock = &keyShard.lock;
+    joined->finished = false;
+    joined->status = 0;
+    joined->waiters = 0;
+    keyShard.flights[key] = joined;
+
+    pthread_mutex_unlock(&keyShard.lock);
+    return true;
+}
+
+int FlightGroup::wait(flight* joined, string& result) {
+    pthread_mutex_t* lock = joined->lock;
+    pthread_mutex_lock(lock);
+    while (!joined->finished) {
+        pthread_cond_wait(&joined->landed, lock);
+    }
+
+    int status = joined->status;
+    result = joined->result;
+    joined->waiters--;
+    release(joined);
+
+    pthread_mutex_unlock(lock);
+    return status;
+}
+
+void FlightGroup::land(const string& key, flight* led, int status, const string& result) {
+    Shard& keyShard = shard(key);
+    pthread_mutex_lock(&keyShard.lock);
+
+    // Later calls start a flight of their own
+    keyShard.flights.erase(key);
+
+    led->finished = true;
+    led->status = status;
+    led->result = result;
+    pthread_cond_broadcast(&led->landed);
+    release(led);
+
+    pthread_mutex_unlock(&keyShard.lock);
+}
+
+void FlightGroup::release(flight* done) {
+    if (done->finished && done->waiters == 0) {
+        pthread_cond_destroy(&done->landed);
+        delete done;
+    }
+}
+
+unsigned long FlightGroup::coalesced() {
+    return m_coalesced;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+/*
+flight.h
+
+Single-flight coalescing of identical calls made by several threads at once.
+
+The first thread to make a call leads its flight: it makes the call and lands the flight with the
+outcome (a status and the encoded result).  Threads that make the same call (by key) while it is in
+flight join it instead, and wait for the leader to land it, each getting a copy of the outcome.  Once
+a flight lands, the next call with its key starts a new flight, so results are never reused after the
+fact (that is the job of the memo cache, see memo.h).
+
+The client coalesces location cache fetches for the same signature, and executes of functions that
+are pure or declared idempotent (see rpcDeclareIdempotent) with the same inputs.  The flights are split
+in shards by the hash of their key, so unrelated calls do not contend for a lock.
+*/
+
+#include <pthread.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+// The shards of the flights of a group.
+#define FLIGHT_SHARDS 16
+
+// A call in flight.
+struct flight {
+    pthread_cond_t landed;
+    pthread_mutex_t* lock;  // of the shard of the flight
+    bool finished;
+    int status;
+    std::string result;
+    unsigned int waiters;   // the threads that joined the flight and have not had its outcome yet
+};
+
+// Coalesces identical calls in flight.
+class FlightGroup {
+  public:
+    // Initializes a new instance of the FlightGroup class with no flights.
+    FlightGroup();
+
+    // Joins the flight of the key, starting it if there is none.  Returns true if the caller leads the
+    // flight, and must land it once its call is made.  Otherwise the caller waits for it with wait.
+    bool join(const std::string& key, flight*& joined);
+
+    // Waits for the flight to land, returning its status and copying its result.
+    int wait(flight* joined, std::string& result);
+
+    // Lands the flight of the key led by the caller with the outcome of its call, waking the threads waiting on it.
+    void land(const std::string& key, flight* led, int status, const std::string& result);
+
+    // Gets the number of calls that waited on a flight rather than being made.
+    unsigned long coalesced();
+
+  private:
+    // Frees the flight once it landed and every waiter had its outcome.
+    void release(flight* done);
+
+    struct Shard {
+        pthread_mutex_t lock;
+        std::map<std::string, flight*> flights;
+
+        Shard() {
+            pthread_mutex_init(&lock, NULL);
+        }
+    };
+
+    // Gets the shard of the flights of the key.
+    Shard& shard(const std::string& key);
+
+    Shard m_shards[FLIGHT_SHARDS];
+    std::atomic<unsigned long> m_coalesced;
+
+    // Flights are shared by address, so copying is not permitted
+    FlightGroup(const FlightGroup&);
+    FlightGroup& operator =(const FlightGroup&);
+};
@@ -62,6 +62,35 @@ bool isArgTypeOutput(int argType) {
     return ((argType & ( 1 << 30 )) >> 30) & 1;
 }
 
+bool isArgTypeInPlace(int argType) {
+    // The argument type is defined as 4 bytes ([0][1][2][3]).
+    // We are after the third bit of the [0] byte.
+    return (argType >> ARG_INPLACE) & 1;
+}
+
+bool isArgTypeVariable(int argType) {
+    // The argument type is defined as 4 bytes ([0][1][2][3]).
+    // We are after the fourth bit of the [0] byte.
+    return (argType >> ARG_VARIABLE) & 1;
+}
+
+bool isArgTypeStream(int argType) {
+    // The argument type is defined as 4 bytes ([0][1][2][3]).
+    // We are after the fifth bit of the [0] byte.
+    return (argType >> ARG_STREAM) & 1;
+}
+
+bool isArgTypePacked(int argType) {
+    // The argument type is defined as 4 bytes ([0][1][2][3]).
+    // We are after the sixth bit of the [0] byte, which only applies to integer arrays.
+    int type = getArgType(argType);
+    return ((argType >> ARG_PACKED) & 1) && (type == ARG_INT || type == ARG_LONG) && isArgTypeArray(argType);
+}
+
+bool isArgTypeArray(int argType) {
+    return isArgTypeVariable(argType) || isArgTypeStream(argType) || getArgTypeArrayLength(argType) != 0;
+}
+
 //--------------------------------------------------------------------------------------
 
 int type_sizeof(int type) {
@@ -90,33 +119,49 @@ int type_sizeof(int type) {
     return -1;
 }
 
+bool type_is_native(int type) {
+    // Integers are written with memcpy in host byte order, so they match the host
+    // layout as long as the host type has the same width as the wire type.
+    // Floating point values are written as text, so they never match.
+    switch(type) {
+        case ARG_CHAR:
+            return true;
+        case ARG_SHORT:
+            return sizeof(short) == sizeof(int16_t);
+        case ARG_INT:
+            return sizeof(int) == sizeof(int32_t);
+        case ARG_LONG:
+            return sizeof(long) == sizeof(int64_t);
+        default:
+            return false;
+    }
+}
+
 int socket_create(string server_identifier, int server_port) {
-    // This code is to help opening of socket
-    struct hostent *server;
-    int socketfd;
+    // Look up the address of the server (getaddrinfo, unlike gethostbyname, can be called from several threads at once)
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* server = NULL;
+    string port = to_string(server_port);
+    if (getaddrinfo(server_identifier.c_str(), port.c_str(), &hints, &server) != 0 || server == NULL) {
+        return SOCKET_UNKNOWN_HOST;
+    }
 
     // Open socket on any details
-    socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    int socketfd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
     if (socketfd < 0) {
+        freeaddrinfo(server);
         return SOCKET_OPEN_ERROR;
     }
 
-    server = gethostbyname(server_identifier.c_str());
-    if (server == NULL) {
-        return SOCKET_UNKNOWN_HOST;
-    }
-
-    // Create new socketaddr struct and wipe the data in it
-    struct sockaddr_in serverAddress;
-    memset((char*) &serverAddress, 0, sizeof(serverAddress));
-
-    // Assignment to server address (port and server identifier)
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(server_port);
-    bcopy((char*) server->h_addr, (char*) &serverAddress.sin_addr.s_addr, server->h_length);
-
     // Attempt to connect to the socket
-    if (connect(socketfd, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0) {
+    int connected = connect(socketfd, server->ai_addr, server->ai_addrlen);
+    freeaddrinfo(server);
+    if (connected < 0) {
+        close(socketfd);
         return SOCKET_CONNECTION_ERROR;
     }
     return socketfd;
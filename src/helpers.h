@@ -30,12 +30,30 @@ bool isArgTypeInput(int argType);
 // Determines if the argument is an input.
 bool isArgTypeOutput(int argType);
 
+// Determines if the argument is to be bound in-place to the received frame.
+bool isArgTypeInPlace(int argType);
+
+// Determines if the argument is a variable-length array (passed as an rpc_array).
+bool isArgTypeVariable(int argType);
+
+// Determines if the argument is a streamed array (passed as an rpc_array, or an rpc_stream to skeletons).
+bool isArgTypeStream(int argType);
+
+// Determines if the argument is an integer array to be packed (see packing.h).
+bool isArgTypePacked(int argType);
+
+// Determines if the argument is an array (fixed, variable-length or streamed).
+bool isArgTypeArray(int argType);
+
 //--------------------------------------------------------------------------------------
 // Code for handling type data
 
 // Returns the size in bytes of the type defined by the specfied type identifier.
 int type_sizeof(int type);
 
+// Determines if the wire representation of the type is identical to its host layout.
+bool type_is_native(int type);
+
 //--------------------------------------------------------------------------------------
 // Code for handling socket host address information
 
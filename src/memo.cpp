@@ -0,0 +1,104 @@
+#include "memo.h"
+
+using namespace std;
+
+// The bytes every entry takes besides its key and value
+#define MEMO_ENTRY_OVERHEAD 64
+
+//--------------------------------------------------------------------------------------
+
+MemoCache::MemoCache(size_t capacity) : m_capacity(capacity), m_size(0) {
+    m_stats.hits = 0;
+    m_stats.misses = 0;
+    m_stats.evictions = 0;
+}
+
+uint64_t MemoCache::hash(const string& signature, const string& inputs) {
+    // FNV-1a over the signature and then the inputs
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (string::const_iterator c = signature.begin(); c != signature.end(); ++c) {
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+    }
+    for (string::const_iterator c = inputs.begin(); c != inputs.end(); ++c) {
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+list<MemoCache::Entry>::iterator MemoCache::locate(uint64_t hash, const string& signature, const string& inputs) {
+    pair<Index::iterator, Index::iterator> range = m_index.equal_range(hash);
+    for (Index::iterator i = range.first; i != range.second; ++i) {
+        if (i->second->signature == signature && i->second->inputs == inputs) {
+            return i->second;
+        }
+    }
+    return m_entries.end();
+}
+
+void MemoCache::remove(list<Entry>::iterator entry) {
+    pair<Index::iterator, Index::iterator> range = m_index.equal_range(entry->hash);
+    for (Index::iterator i = range.first; i != range.second; ++i) {
+        if (i->second == entry) {
+            m_index.erase(i);
+            break;
+        }
+    }
+
+    m_size -= entry->signature.size() + entry->inputs.size() + entry->outputs.size() + MEMO_ENTRY_OVERHEAD;
+    m_entries.erase(entry);
+}
+
+void MemoCache::trim() {
+    while (m_size > m_capacity && !m_entries.empty()) {
+        remove(--m_entries.end());
+        m_stats.evictions++;
+    }
+}
+
+bool MemoCache::find(uint64_t hash, const string& signature, const string& inputs, string& outputs) {
+    list<Entry>::iterator entry = locate(hash, signature, inputs);
+    if (entry == m_entries.end()) {
+        m_stats.misses++;
+        return false;
+    }
+
+    // Expired entries are dropped on the way
+    if (entry->expires <= chrono::steady_clock::now()) {
+        remove(entry);
+        m_stats.misses++;
+        return false;
+    }
+
+    // Move the entry to the front, as the most recently used
+    m_entries.splice(m_entries.begin(), m_entries, entry);
+    outputs = entry->outputs;
+    m_stats.hits++;
+    return true;
+}
+
+void MemoCache::store(uint64_t hash, const string& signature, const string& inputs, const string& outputs, unsigned int ttl) {
+    list<Entry>::iterator existing = locate(hash, signature, inputs);
+    if (existing != m_entries.end()) {
+        remove(existing);
+    }
+
+    size_t bytes = signature.size() + inputs.size() + outputs.size() + MEMO_ENTRY_OVERHEAD;
+    if (ttl == 0 || bytes > m_capacity) {
+        return;
+    }
+
+    Entry entry = { hash, signature, inputs, outputs, chrono::steady_clock::now() + chrono::milliseconds(ttl) };
+    m_entries.push_front(entry);
+    m_index.insert(make_pair(hash, m_entries.begin()));
+    m_size += bytes;
+    trim();
+}
+
+void MemoCache::setCapacity(size_t capacity) {
+    m_capacity = capacity;
+    trim();
+}
+
+rpc_memo_stats MemoCache::stats() {
+    return m_stats;
+}
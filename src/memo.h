@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+memo.h
+
+A bounded least recently used cache of the results of pure functions (see rpcRegisterPure), kept by
+clients for their own calls and by servers for the calls of every client (see rpcRegisterCached).
+
+Entries are keyed by the signature of the call (its name and argument types) and the bytes of its
+input values, and hold the encoded output values (or the whole response, on servers).  They are found by a hash of both, and the key is
+compared in full on a match, so a hash collision never returns the result of another call.  Every entry
+expires after the time to live the function was registered with, and once the keys and values of the
+entries exceed the capacity, the least recently used ones are evicted.
+*/
+
+#include "rpc.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// The bytes the cache of a client holds at most, unless set otherwise (see rpcSetMemoCapacity).
+#define MEMO_DEFAULT_CAPACITY (1 << 20)
+
+// Caches the results of calls to pure functions.
+class MemoCache {
+  public:
+    // Initializes a new instance of the MemoCache class holding at most the specified number of bytes.
+    MemoCache(size_t capacity);
+
+    // Hashes the signature and inputs of a call.
+    static uint64_t hash(const std::string& signature, const std::string& inputs);
+
+    // Finds the result of the call with the signature and inputs (and their hash).  Returns false if there is none, or it expired.
+    bool find(uint64_t hash, const std::string& signature, const std::string& inputs, std::string& outputs);
+
+    // Stores the result of the call with the signature and inputs (and their hash) for the time to live (in milliseconds).
+    void store(uint64_t hash, const std::string& signature, const std::string& inputs, const std::string& outputs, unsigned int ttl);
+
+    // Sets the number of bytes the cache holds at most, evicting entries as needed.  Zero disables the cache.
+    void setCapacity(size_t capacity);
+
+    // Gets the counters of the cache.
+    rpc_memo_stats stats();
+
+  private:
+    struct Entry {
+        uint64_t hash;
+        std::string signature;
+        std::string inputs;
+        std::string outputs;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // Finds the entry of the call, or returns the end of the entries.
+    std::list<Entry>::iterator locate(uint64_t hash, const std::string& signature, const std::string& inputs);
+
+    // Removes the entry, forgetting its bytes.
+    void remove(std::list<Entry>::iterator entry);
+
+    // Evicts the least recently used entries until the cache holds at most its capacity.
+    void trim();
+
+    typedef std::unordered_multimap<uint64_t, std::list<Entry>::iterator> Index;
+
+    // The entries, most recently used first, and their index by hash
+    std::list<Entry> m_entries;
+    Index m_index;
+
+    size_t m_capacity;
+    size_t m_size;
+    rpc_memo_stats m_stats;
+};
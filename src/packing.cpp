@@ -0,0 +1,257 @@
+#include "packing.h"
+#include "protocol.h"
+#include "constants.h"
+#include "rpc.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+// Returns the number of bytes of the varint encoding of the value.
+static unsigned int varintSize(uint64_t value) {
+    unsigned int size = 1;
+    while (value >= 128) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Returns the number of bits needed to hold the value.
+static unsigned int bitWidth(uint64_t value) {
+    unsigned int width = 0;
+    while (value != 0) {
+        value >>= 1;
+        width++;
+    }
+    return width;
+}
+
+// Appends the varint encoding of the value to the buffer.
+static void putVarint(vector<char>& buffer, uint64_t value) {
+    while (value >= 128) {
+        buffer.push_back((char) ((value & 127) | 128));
+        value >>= 7;
+    }
+    buffer.push_back((char) value);
+}
+
+// Reads a varint from the bytes, advancing the position. Returns false if it runs past the end.
+static bool getVarint(const unsigned char* bytes, size_t size, size_t& position, uint64_t& value) {
+    value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (position >= size) {
+            return false;
+        }
+
+        unsigned char byte = bytes[position++];
+        value |= (uint64_t) (byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends the least significant bytes of the bit accumulator to the buffer.
+static void putBytes(vector<char>& buffer, uint64_t bits, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        buffer.push_back((char) (bits >> (i * 8)));
+    }
+}
+
+// Reads up to eight bytes starting at the offset as a little-endian value (missing bytes are zero).
+static uint64_t getBytes(const unsigned char* bytes, size_t size, size_t offset) {
+    uint64_t bits = 0;
+    for (unsigned int i = 0; i < 8 && offset + i < size; i++) {
+        bits |= (uint64_t) bytes[offset + i] << (i * 8);
+    }
+    return bits;
+}
+
+//--------------------------------------------------------------------------------------
+
+// Encodes the values of type T (int or long) into the stream.
+template <typename T>
+static void encode(BinaryStream& stream, const T* values, unsigned int count) {
+    // Turn the values into zigzag deltas, keeping track of how large each encoding would be
+    vector<uint64_t> deltas(count);
+    uint64_t previous = 0;
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+    size_t varints = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t current = (uint64_t) (int64_t) values[i];
+        int64_t delta = (int64_t) (current - previous);
+        previous = current;
+
+        deltas[i] = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+        varints += varintSize(deltas[i]);
+
+        if (i > 0) {
+            lowest = deltas[i] < lowest ? deltas[i] : lowest;
+            highest = deltas[i] > highest ? deltas[i] : highest;
+        }
+    }
+
+    size_t raw = (size_t) count * sizeof(T);
+    size_t packed = raw;
+    unsigned int width = 0;
+    if (count > 1) {
+        width = bitWidth(highest - lowest);
+        packed = varintSize(deltas[0]) + varintSize(lowest) + 1 + ((size_t) width * (count - 1) + 7) / 8;
+    }
+
+    // Raw values are cheapest to decode, so only encode when it is smaller
+    if (raw <= varints && raw <= packed) {
+        stream.writeChar((char) PACKING_RAW);
+        writeValues(stream, sizeof(T) == sizeof(int) ? ARG_INT : ARG_LONG, (void*) values, count);
+        return;
+    }
+
+    vector<char> buffer;
+    if (varints < packed) {
+        buffer.reserve(varints);
+        for (unsigned int i = 0; i < count; i++) {
+            putVarint(buffer, deltas[i]);
+        }
+
+        stream.writeChar((char) PACKING_VARINT);
+        stream.writeChar(&buffer.front(), buffer.size());
+        return;
+    }
+
+    buffer.reserve(packed);
+    putVarint(buffer, deltas[0]);
+    putVarint(buffer, lowest);
+    buffer.push_back((char) width);
+
+    // Fill a 64-bit accumulator with the offsets from the frame of reference, flushing it when full
+    uint64_t bits = 0;
+    unsigned int filled = 0;
+    for (unsigned int i = 1; i < count && width > 0; i++) {
+        uint64_t offset = deltas[i] - lowest;
+        bits |= offset << filled;
+
+        if (filled + width >= 64) {
+            putBytes(buffer, bits, 8);
+            bits = filled == 0 ? 0 : offset >> (64 - filled);
+            filled = filled + width - 64;
+        }
+        else {
+            filled += width;
+        }
+    }
+    putBytes(buffer, bits, (filled + 7) / 8);
+
+    stream.writeChar((char) PACKING_BITS);
+    stream.writeChar(&buffer.front(), buffer.size());
+}
+
+// Decodes the values of type T (int or long) from the stream.
+template <typename T>
+static int decode(BinaryStream& stream, T* values, unsigned int count) {
+    if (stream.position() >= stream.size()) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    char encoding = stream.readChar();
+    if (encoding == PACKING_RAW) {
+        if ((size_t) (stream.size() - stream.position()) < (size_t) count * sizeof(T)) {
+            return RECEIVE_INVALID_MESSAGE;
+        }
+
+        readValues(stream, sizeof(T) == sizeof(int) ? ARG_INT : ARG_LONG, values, count);
+        return 0;
+    }
+
+    const unsigned char* bytes = (const unsigned char*) stream.buffer();
+    size_t size = stream.size();
+    size_t position = stream.position();
+    uint64_t previous = 0;
+    uint64_t delta;
+
+    if (encoding == PACKING_VARINT) {
+        for (unsigned int i = 0; i < count; i++) {
+            if (!getVarint(bytes, size, position, delta)) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+
+            previous += (delta >> 1) ^ (0 - (delta & 1));
+            values[i] = (T) previous;
+        }
+
+        stream.seek(position);
+        return 0;
+    }
+
+    if (encoding != PACKING_BITS) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    uint64_t lowest;
+    if (count == 0 || !getVarint(bytes, size, position, delta) || !getVarint(bytes, size, position, lowest) || position >= size) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    unsigned int width = bytes[position++];
+    size_t length = ((size_t) width * (count - 1) + 7) / 8;
+    if (width > 64 || size - position < length) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    previous = (delta >> 1) ^ (0 - (delta & 1));
+    values[0] = (T) previous;
+
+    // Every offset starts at a known bit, and spans at most nine bytes
+    uint64_t mask = width == 64 ? UINT64_MAX : (((uint64_t) 1 << width) - 1);
+    size_t end = position + length;
+    size_t bit = (size_t) position * 8;
+
+    for (unsigned int i = 1; i < count; i++, bit += width) {
+        size_t offset = bit / 8;
+        unsigned int shift = bit % 8;
+
+        uint64_t bits = getBytes(bytes, end, offset) >> shift;
+        if (shift + width > 64) {
+            bits |= getBytes(bytes, end, offset + 8) << (64 - shift);
+        }
+
+        delta = (bits & mask) + lowest;
+        previous += (delta >> 1) ^ (0 - (delta & 1));
+        values[i] = (T) previous;
+    }
+
+    stream.seek(end);
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+void packing_encode(BinaryStream& stream, int ctype, void* values, unsigned int count) {
+    switch(ctype) {
+        case ARG_INT:
+            encode(stream, (int*) values, count);
+            break;
+        case ARG_LONG:
+            encode(stream, (long*) values, count);
+            break;
+        default:
+            break;
+    }
+}
+
+int packing_decode(BinaryStream& stream, int ctype, void* values, unsigned int count) {
+    switch(ctype) {
+        case ARG_INT:
+            return decode(stream, (int*) values, count);
+        case ARG_LONG:
+            return decode(stream, (long*) values, count);
+        default:
+            return RECEIVE_INVALID_MESSAGE;
+    }
+}
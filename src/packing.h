@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+packing.h
+
+Compact encodings of integer arrays flagged ARG_PACKED (see rpc.h).
+
+The values are turned into deltas (each value minus the one before it, the first value is taken as is),
+and the deltas are zigzag encoded so that small negative deltas become small unsigned values. Sorted ids and
+timestamps then only need a few bits per element. The encoder picks the smallest of:
+
+  PACKING_RAW     the values as written by writeValues
+  PACKING_VARINT  every zigzag delta as a little-endian base 128 varint
+  PACKING_BITS    the first zigzag delta as a varint, then the smallest of the remaining ones (the frame of
+                  reference) as a varint, a byte with the bit width, and every remaining delta minus the
+                  frame of reference packed into exactly that many bits (least significant bit first)
+
+The encoding is announced by a single byte ahead of the values.
+*/
+
+#include "bstream.h"
+
+// The encodings of a packed array.
+#define PACKING_RAW    0
+#define PACKING_VARINT 1
+#define PACKING_BITS   2
+
+// Writes the values of an ARG_INT or ARG_LONG array with the smallest encoding.
+void packing_encode(BinaryStream& stream, int ctype, void* values, unsigned int count);
+
+// Reads the values of an ARG_INT or ARG_LONG array written by packing_encode.
+// Returns zero on success, or RECEIVE_INVALID_MESSAGE if the encoding is malformed.
+int packing_decode(BinaryStream& stream, int ctype, void* values, unsigned int count);
@@ -0,0 +1,181 @@
+#include "plan.h"
+#include "helpers.h"
+#include "constants.h"
+#include "arena.h"
+#include "rpc.h"
+
+#include <cstring>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+// Kernels of the values that do not match the host layout
+
+static void readChars(BinaryStream& stream, void* values, unsigned int count) { stream.readChar((char*) values, count); }
+static void readShorts(BinaryStream& stream, void* values, unsigned int count) { stream.readInt16((short*) values, count); }
+static void readInts(BinaryStream& stream, void* values, unsigned int count) { stream.readInt32((int*) values, count); }
+static void readLongs(BinaryStream& stream, void* values, unsigned int count) { stream.readInt64((long*) values, count); }
+static void readDoubles(BinaryStream& stream, void* values, unsigned int count) { stream.readDouble((double*) values, count); }
+static void readFloats(BinaryStream& stream, void* values, unsigned int count) { stream.readFloat((float*) values, count); }
+
+static void writeChars(BinaryStream& stream, void* values, unsigned int count) { stream.writeChar((char*) values, count); }
+static void writeShorts(BinaryStream& stream, void* values, unsigned int count) { stream.writeInt16((short*) values, count); }
+static void writeInts(BinaryStream& stream, void* values, unsigned int count) { stream.writeInt32((int*) values, count); }
+static void writeLongs(BinaryStream& stream, void* values, unsigned int count) { stream.writeInt64((long*) values, count); }
+static void writeDoubles(BinaryStream& stream, void* values, unsigned int count) { stream.writeDouble((double*) values, count); }
+static void writeFloats(BinaryStream& stream, void* values, unsigned int count) { stream.writeFloat((float*) values, count); }
+
+// Indexed by the rpc type (rpc.h)
+static const plan_kernel m_readKernels[] = { NULL, readChars, readShorts, readInts, readLongs, readDoubles, readFloats };
+static const plan_kernel m_writeKernels[] = { NULL, writeChars, writeShorts, writeInts, writeLongs, writeDoubles, writeFloats };
+
+//--------------------------------------------------------------------------------------
+
+// Compiles the runs of a message that transmits the specified arguments (the ones a request leaves out start zeroed).
+static void compileMessage(int* argTypes, marshalling_plan& plan, const vector<bool>& transmitted, bool request, plan_message& message) {
+    message.runs.clear();
+    message.zeroes.clear();
+    message.fixed = true;
+    message.size = 0;
+
+    for (unsigned int i = 0; i < transmitted.size(); i++) {
+        plan_run run = { i, i, plan.offsets[i], plan.sizes[i], 0, NULL, NULL };
+        int ctype = getArgType(argTypes[i]);
+
+        if (!transmitted[i]) {
+            if (request) {
+                message.zeroes.push_back(run);
+            }
+            continue;
+        }
+
+        if (!type_is_native(ctype)) {
+            unsigned int length = getArgTypeArrayLength(argTypes[i]);
+            run.count = length == 0 ? 1 : length;
+            run.read = m_readKernels[ctype];
+            run.write = m_writeKernels[ctype];
+            message.runs.push_back(run);
+            message.fixed = false;
+            continue;
+        }
+
+        // Arguments that follow each other in the frame and in the storage are copied together
+        message.size += run.bytes;
+        if (!message.runs.empty()) {
+            plan_run& previous = message.runs.back();
+            if (previous.read == NULL && previous.offset + previous.bytes == run.offset) {
+                previous.last = i;
+                previous.bytes += run.bytes;
+                continue;
+            }
+        }
+        message.runs.push_back(run);
+    }
+}
+
+unsigned int plan_layout(unsigned int version) {
+    return version < PROTOCOL_V2 ? 0 : 1;
+}
+
+bool plan_compile(int* argTypes, marshalling_plan& plan) {
+    unsigned int argLen = getArgTypesLength(argTypes) - 1;
+    plan.offsets.clear();
+    plan.sizes.clear();
+
+    // Lay out the storage: scalars at their natural alignment, arrays at a cache line
+    size_t cursor = 0;
+    for (unsigned int i = 0; i < argLen; i++) {
+        int argType = argTypes[i];
+        if (isArgTypeVariable(argType) || isArgTypeStream(argType) || isArgTypePacked(argType) || isArgTypeInPlace(argType)) {
+            return false;
+        }
+
+        int ctype = getArgType(argType);
+        int size = type_sizeof(ctype);
+        if (size <= 0) {
+            return false;
+        }
+
+        unsigned int length = getArgTypeArrayLength(argType);
+        size_t alignment = length == 0 ? size : ARENA_ALIGNMENT;
+        cursor = (cursor + alignment - 1) / alignment * alignment;
+
+        plan.offsets.push_back(cursor);
+        plan.sizes.push_back((length == 0 ? 1 : length) * size);
+        cursor += plan.sizes.back();
+    }
+    plan.storage = cursor;
+
+    // PROTOCOL_V1 transmits every argument, later versions only the inputs or outputs
+    for (unsigned int layout = 0; layout < 2; layout++) {
+        vector<bool> inputs(argLen, true);
+        vector<bool> outputs(argLen, true);
+        for (unsigned int i = 0; layout == 1 && i < argLen; i++) {
+            inputs[i] = isArgTypeInput(argTypes[i]);
+            outputs[i] = isArgTypeOutput(argTypes[i]);
+        }
+
+        compileMessage(argTypes, plan, inputs, true, plan.requests[layout]);
+        compileMessage(argTypes, plan, outputs, false, plan.responses[layout]);
+    }
+    return true;
+}
+
+int plan_readRequest(const marshalling_plan& plan, BinaryStream& stream, void** args, char* storage, unsigned int version) {
+    const plan_message& message = plan.requests[plan_layout(version)];
+
+    for (unsigned int i = 0; i < plan.offsets.size(); i++) {
+        args[i] = (void*) (storage + plan.offsets[i]);
+    }
+
+    // Frames made only of copies have a fixed size, so they are checked once
+    size_t remaining = stream.size() - stream.position();
+    if (message.fixed && remaining < message.size) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    for (vector<plan_run>::const_iterator run = message.runs.begin(); run != message.runs.end(); ++run) {
+        if (run->read != NULL) {
+            run->read(stream, storage + run->offset, run->count);
+        }
+        else if (message.fixed || (size_t) (stream.size() - stream.position()) >= run->bytes) {
+            stream.readBytes(storage + run->offset, run->bytes);
+        }
+        else {
+            return RECEIVE_INVALID_MESSAGE;
+        }
+    }
+
+    // The skeleton fills the outputs, so start them zeroed
+    for (vector<plan_run>::const_iterator run = message.zeroes.begin(); run != message.zeroes.end(); ++run) {
+        memset(storage + run->offset, 0, run->bytes);
+    }
+    return 0;
+}
+
+void plan_writeResponse(const marshalling_plan& plan, BinaryStream& stream, void** args, unsigned int version) {
+    const plan_message& message = plan.responses[plan_layout(version)];
+
+    for (vector<plan_run>::const_iterator run = message.runs.begin(); run != message.runs.end(); ++run) {
+        if (run->write != NULL) {
+            run->write(stream, args[run->first], run->count);
+            continue;
+        }
+
+        // Skeletons may point an argument elsewhere (e.g. at a string they return), in which
+        // case the arguments of the run are no longer laid out together and go one by one
+        char* start = (char*) args[run->first];
+        bool together = true;
+        for (unsigned int i = run->first + 1; i <= run->last && together; i++) {
+            together = ((char*) args[i] == start + (plan.offsets[i] - run->offset));
+        }
+
+        if (together) {
+            stream.writeBytes(start, run->bytes);
+            continue;
+        }
+        for (unsigned int i = run->first; i <= run->last; i++) {
+            stream.writeBytes((char*) args[i], plan.sizes[i]);
+        }
+    }
+}
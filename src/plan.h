@@ -0,0 +1,73 @@
+#pragma once
+
+/*
+plan.h
+
+Marshalling plans, compiled once per registered signature (see rpcRegister).
+
+The generic marshalling re-derives the type, length and size of every argument of every request and
+dispatches on the type of each.  A plan does that once: it lays out the storage of the arguments and
+turns the transmitted arguments into a flat table of runs, each either a single memcpy between the frame
+and the storage (for integers, whose wire layout matches the host layout, see type_is_native) or a
+kernel that converts the values of a single argument (floating point values are written as text).
+
+Scalars are stored at their natural alignment and arrays at a cache line, so consecutive integer scalars
+share one run: f0(out int, in int, in int) reads its directed request with a single memcpy.  Signatures
+made only of integers have a fixed frame size, which is checked once up front.  Skeletons registered with
+a marshaller (see rpcRegisterMarshalled) only use the plan for those frames, and the marshaller otherwise.
+
+Only scalars and fixed-length arrays are planned.  Signatures with variable-length, streamed, packed or
+in-place arguments are marshalled generically, as are requests whose argument types differ from the
+registered ones in any way, flags included (e.g. a different array length, which still finds the function).
+*/
+
+#include "bstream.h"
+
+#include <cstddef>
+#include <vector>
+
+// Converts the values of an argument between the stream and its storage.
+typedef void (*plan_kernel)(BinaryStream& stream, void* values, unsigned int count);
+
+// A run of the table: either a copy of consecutive arguments, or the kernel of a single argument.
+struct plan_run {
+    unsigned int first;     // the arguments the run covers
+    unsigned int last;
+    unsigned int offset;    // the offset of the run in the storage
+    unsigned int bytes;     // the bytes of storage (and of the frame, for copies) the run covers
+    unsigned int count;     // the number of values the kernels convert
+    plan_kernel read;       // both NULL for copies
+    plan_kernel write;
+};
+
+// The runs of a message, in the order the arguments are transmitted.
+struct plan_message {
+    std::vector<plan_run> runs;
+    std::vector<plan_run> zeroes;   // the outputs left out of a request, which start zeroed
+    bool fixed;                     // whether every run is a copy
+    size_t size;                    // the bytes of the arguments in the frame, if fixed
+};
+
+// The compiled marshalling of a signature.  Messages are indexed by plan_layout.
+struct marshalling_plan {
+    std::vector<unsigned int> offsets;  // the offset of every argument in the storage
+    std::vector<unsigned int> sizes;    // the bytes of every argument
+    size_t storage;                     // the bytes of storage of all arguments
+    plan_message requests[2];
+    plan_message responses[2];
+};
+
+// Selects the messages of the protocol version: PROTOCOL_V1 transmits every argument both ways,
+// later versions only the inputs in requests and the outputs in responses.
+unsigned int plan_layout(unsigned int version);
+
+// Compiles the plan of the signature.  Returns false if the signature has arguments plans do not cover.
+bool plan_compile(int* argTypes, marshalling_plan& plan);
+
+// Reads the argument values of a request into the storage, pointing the arguments at it.  Outputs the
+// request does not carry are zeroed.  Returns zero on success, or RECEIVE_INVALID_MESSAGE if the frame
+// is too short.
+int plan_readRequest(const marshalling_plan& plan, BinaryStream& stream, void** args, char* storage, unsigned int version);
+
+// Writes the argument values of a response from the storage read by plan_readRequest.
+void plan_writeResponse(const marshalling_plan& plan, BinaryStream& stream, void** args, unsigned int version);
@@ -4,6 +4,10 @@
 #include "conversion.h"
 #include "bstream.h"
 #include "rpc.h"
+#include "compression.h"
+#include "packing.h"
+#include "rpccall.h"
+#include "plan.h"
 
 #include <cerrno>
 #include <iostream>
@@ -11,6 +15,7 @@
 #include <string.h>
 #include <string>
 #include <sys/socket.h>
+#include <vector>
 
 using namespace std;
 
@@ -19,6 +24,44 @@ using namespace std;
 // Creates an instance of the protocol controller.
 Protocol::Protocol(int socketfd) {
     _sfd = socketfd;
+    m_peerCodecs = CODEC_NONE;
+    m_advertise = false;
+    m_codec = CODEC_NONE;
+    m_compact = false;
+    m_announced = false;
+    m_typeWord = 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+void Protocol::setPeerCodecs(unsigned int codecs) {
+    m_peerCodecs = codecs;
+
+    // Only peers that advertise codecs understand our advertisements
+    if (codecs != CODEC_NONE) {
+        m_advertise = true;
+    }
+}
+
+unsigned int Protocol::getPeerCodecs() {
+    return m_peerCodecs;
+}
+
+void Protocol::advertiseCodecs() {
+    m_advertise = true;
+}
+
+//--------------------------------------------------------------------------------------
+
+void Protocol::useCompactFrames() {
+    if (!m_compact) {
+        m_compact = true;
+        m_announced = false;
+    }
+}
+
+bool Protocol::isCompact() {
+    return m_compact;
 }
 
 //--------------------------------------------------------------------------------------
@@ -29,21 +72,46 @@ int Protocol::sendTerminate() {
 
 //--------------------------------------------------------------------------------------
 
-int Protocol::sendRegister(string server_identifier, unsigned short port, string name, int argTypes[]) {
+int Protocol::sendRegister(string server_identifier, unsigned short port, string name, int argTypes[], unsigned int ttl) {
     unsigned int count = getArgTypesLength(argTypes);
 
     // Allocate sending buffer and write format
-    // Format is as follows: length of server identifier, server identifier, length of name, name,  argTypes array (ending in a zero)
+    // Format is as follows: length of server identifier, server identifier, length of name, name,  argTypes array (ending in a zero),
+    // the highest protocol version the server understands and the time to live (trailing, so older binders ignore them)
     BinaryStream stream;
     stream.writeString(server_identifier);
     stream.writeInt16(port);
     stream.writeString(name);
     stream.writeUInt32(count);
     stream.writeInt32(argTypes, count);
+    stream.writeUInt32(PROTOCOL_CURRENT);
+    stream.writeUInt32(ttl);
 
     return sendMessage(stream.size(), REGISTER, stream.str());
 }
 
+int Protocol::sendRegisterBatch(string server_identifier, unsigned short port, const list<function_info>& functions) {
+    // Allocate sending buffer and write format
+    // Format is as follows: length of server identifier, server identifier, port, the highest protocol version the server
+    // understands, the number of functions, then the length of the name, name, argTypes array (ending in a zero) and time
+    // to live of each function
+    BinaryStream stream;
+    stream.writeString(server_identifier);
+    stream.writeInt16(port);
+    stream.writeUInt32(PROTOCOL_CURRENT);
+    stream.writeUInt32(functions.size());
+
+    for (const function_info& function : functions) {
+        unsigned int count = getArgTypesLength(function.rpcdef->argTypes);
+        stream.writeString(function.rpcdef->name);
+        stream.writeUInt32(count);
+        stream.writeInt32(function.rpcdef->argTypes, count);
+        stream.writeUInt32(function.ttl);
+    }
+
+    return sendMessage(stream.size(), REGISTER_BATCH, stream.str());
+}
+
 int Protocol::sendRegisterResponse(ReasonCode code) {
     // Allocate a buffer for an 32-bit integer
     BinaryStream stream;
@@ -52,6 +120,17 @@ int Protocol::sendRegisterResponse(ReasonCode code) {
     return sendMessage(stream.size(), REGISTER_SUCCESS, stream.str());
 }
 
+int Protocol::sendRegisterBatchResponse(const vector<ReasonCode>& codes) {
+    // Format is as follows: the number of functions, then the reason code of each
+    BinaryStream stream;
+    stream.writeUInt32(codes.size());
+    for (ReasonCode code : codes) {
+        stream.writeInt32(static_cast<int>(code));
+    }
+
+    return sendMessage(stream.size(), REGISTER_BATCH_SUCCESS, stream.str());
+}
+
 int Protocol::sendRegisterError(ReasonCode code) {
     // Allocate a buffer for an 32-bit integer
     BinaryStream stream;
@@ -77,12 +156,15 @@ int Protocol::sendLocationRequest(string name, int argTypes[]) {
     return sendMessage(stream.size(), LOC_REQUEST, stream.str());
 }
 
-int Protocol::sendLocationResponse(string server_identifier, unsigned short port) {
+int Protocol::sendLocationResponse(string server_identifier, unsigned short port, unsigned int version, unsigned int ttl) {
     // Allocate sending buffer and write format
-    // Format is as follows: length of server identifier, server identifier, port number
+    // Format is as follows: length of server identifier, server identifier, port number, protocol version, time to live
+    // The version and time to live are trailing, so older clients that do not know about them simply ignore them
     BinaryStream stream;
     stream.writeString(server_identifier);
     stream.writeInt16(port);
+    stream.writeUInt32(version);
+    stream.writeUInt32(ttl);
 
     // Sends the message
     return sendMessage(stream.size(), LOC_SUCCESS, stream.str());
@@ -99,108 +181,320 @@ int Protocol::sendLocationError(ReasonCode reasonCode) {
 
 //--------------------------------------------------------------------------------------
 
-int Protocol::sendExecuteRequest(std::string name, int* argTypes, void**args) {
-    unsigned int argTypesLength = getArgTypesLength(argTypes);
+void writeValues(BinaryStream& stream, int ctype, void* values, unsigned int count) {
+    switch(ctype) {
+        case ARG_CHAR:
+            stream.writeChar((char*) values, count);
+            break;
+        case ARG_SHORT:
+            stream.writeInt16((short*) values, count);
+            break;
+        case ARG_INT:
+            stream.writeInt32((int*) values, count);
+            break;
+        case ARG_LONG:
+            stream.writeInt64((long*) values, count);
+            break;
+        case ARG_DOUBLE:
+            stream.writeDouble((double*) values, count);
+            break;
+        case ARG_FLOAT:
+            stream.writeFloat((float*) values, count);
+            break;
+        default:
+            break;
+    }
+}
 
-    // Write the initial format of the message to the stream
-    // This format is:  { string length, the string, # of arguments, argument values}
+void readValues(BinaryStream& stream, int ctype, void* values, unsigned int count) {
+    switch(ctype) {
+        case ARG_CHAR:
+            stream.readChar((char*) values, count);
+            break;
+        case ARG_SHORT:
+            stream.readInt16((short*) values, count);
+            break;
+        case ARG_INT:
+            stream.readInt32((int*) values, count);
+            break;
+        case ARG_LONG:
+            stream.readInt64((long*) values, count);
+            break;
+        case ARG_DOUBLE:
+            stream.readDouble((double*) values, count);
+            break;
+        case ARG_FLOAT:
+            stream.readFloat((float*) values, count);
+            break;
+        default:
+            break;
+    }
+}
 
-    BinaryStream stream;
-    stream.writeString(name);
-    stream.writeUInt32(argTypesLength);
-    stream.writeInt32(argTypes, argTypesLength);
+//--------------------------------------------------------------------------------------
+
+// Writes the value of a single argument to the stream.
+static void writeArgument(BinaryStream& stream, int argType, void* argValue) {
+    // Are we dealing with an array?
+    int ctype = getArgType(argType);
+    unsigned int length = getArgTypeArrayLength(argType);
+
+    if (isArgTypeVariable(argType)) {
+        // Variable-length arrays are prefixed with the number of elements in use
+        rpc_array* array = (rpc_array*) argValue;
+        length = array->length < array->capacity ? array->length : array->capacity;
+        stream.writeUInt32(length);
+        argValue = array->data;
+    }
+    else if(length == 0) {
+        // It is a scalar
+        length = 1;
+    }
+
+    // Packed arrays pick their own encoding (and are never in-place)
+    if (isArgTypePacked(argType)) {
+        packing_encode(stream, ctype, argValue, length);
+        return;
+    }
+
+    // In-place arguments are naturally aligned (relative to the start of the message)
+    // so that the receiver can bind them directly to the frame
+    if (isArgTypeInPlace(argType) && type_is_native(ctype)) {
+        stream.writePadding(type_sizeof(ctype));
+    }
 
+    // We loop around the number of values we need to write
+    // If scalar, this loop happens only once
+    writeValues(stream, ctype, argValue, length);
+}
+
+bool writeRequestArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller) {
+    // Typed signatures have their own marshaller (and never stream)
+    if (marshaller != NULL) {
+        marshaller->writeRequest(stream, args, version);
+        return false;
+    }
+
+    unsigned int argTypesLength = getArgTypesLength(argTypes);
+
+    bool streamed = false;
     for(unsigned int i = 0; i < argTypesLength - 1; i++) {
-        // The argument to write into the code
-        int argType = argTypes[i];
+        // Streamed arrays only declare their length (inputs) or capacity (outputs), the
+        // elements follow the message in chunks
+        if (isArgTypeStream(argTypes[i])) {
+            rpc_array* array = (rpc_array*) args[i];
+            stream.writeUInt32(isArgTypeInput(argTypes[i]) ? array->length : array->capacity);
+            streamed = true;
+            continue;
+        }
 
-        // Are we dealing with an array?
-        void* argValue = args[i];
-        int ctype = getArgType(argType);
-        unsigned short length = getArgTypeArrayLength(argType);
-        if(length == 0) {
-            // It is a scalar
-            length = 1;
+        // The server needs the capacity of variable-length arrays to allocate their storage
+        if (isArgTypeVariable(argTypes[i])) {
+            stream.writeUInt32(((rpc_array*) args[i])->capacity);
         }
 
-        // We loop around the number of values we need to write
-        // If scalar, this loop happens only once
-        switch(ctype) {
-            case ARG_CHAR:
-                stream.writeChar((char*) argValue, length);
-                break;
-            case ARG_SHORT:
-                stream.writeInt16((short*) argValue, length);
-                break;
-            case ARG_INT:
-                stream.writeInt32((int*) argValue, length);
-                break;
-            case ARG_LONG:
-                stream.writeInt64((long*) argValue, length);
-                break;
-            case ARG_DOUBLE:
-                stream.writeDouble((double*) argValue, length);
-                break;
-            case ARG_FLOAT:
-                stream.writeFloat((float*) argValue, length);
-                break;
-            default:
-                break;
+        // Directed requests only carry the inputs, the server provides storage for the outputs
+        if (version >= PROTOCOL_V2 && !isArgTypeInput(argTypes[i])) {
+            continue;
         }
+
+        writeArgument(stream, argTypes[i], args[i]);
     }
-    return sendMessage(stream.size(), EXECUTE, stream.str());
+    return streamed;
 }
 
-int Protocol::sendExecuteResponse(std::string name, int* argTypes, void**args) {
+void writeRequestPrefix(BinaryStream& stream, const std::string& name, int* argTypes) {
     unsigned int argTypesLength = getArgTypesLength(argTypes);
+    stream.writeString(name);
+    stream.writeUInt32(argTypesLength);
+    stream.writeInt32(argTypes, argTypesLength);
+}
 
+int Protocol::sendExecuteRequest(std::string name, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller) {
     // Write the initial format of the message to the stream
-    // This format is:  { string length, the string, # of arguments, argument values}
+    // This format is:  { string length, the string, # of arguments, argument types, argument values}
+    // Variable-length arrays are written as { capacity, length, elements }
 
     BinaryStream stream;
-    stream.writeString(name);
-    stream.writeInt32(argTypes, argTypesLength);
+    writeRequestPrefix(stream, name, argTypes);
+
+    bool streamed = writeRequestArguments(stream, argTypes, args, version, marshaller);
+
+    MessageType type = (version >= PROTOCOL_V2) ? EXECUTE_DIRECTED : EXECUTE;
+    if (streamed) {
+        type = EXECUTE_STREAMED;
+    }
+    return sendMessage(stream.size(), type, stream.str());
+}
+
+int Protocol::sendExecuteHandle(unsigned int epoch, unsigned int handle, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller) {
+    // The format is: { epoch, handle (varint), argument values }
+    BinaryStream stream;
+    stream.writeUInt32(epoch);
+    stream.writeVarUInt32(handle);
+    writeRequestArguments(stream, argTypes, args, version, marshaller);
+
+    return sendMessage(stream.size(), EXECUTE_HANDLE, stream.str());
+}
+
+int Protocol::sendExecutePrepared(BinaryStream& prefix, MessageType type, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller) {
+    BinaryStream stream;
+    stream.writeBytes(prefix.buffer(), prefix.size());
+    writeRequestArguments(stream, argTypes, args, version, marshaller);
+
+    return sendMessage(stream.size(), type, stream.str());
+}
+
+void writeResponseArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller,
+                            const marshalling_plan* plan) {
+    // Registered signatures have a plan, which beats the marshaller of typed signatures on
+    // responses made only of integers (as it copies them in bulk)
+    if (plan != NULL && (marshaller == NULL || plan->responses[plan_layout(version)].fixed)) {
+        plan_writeResponse(*plan, stream, args, version);
+        return;
+    }
+    if (marshaller != NULL) {
+        marshaller->writeResponse(stream, args, version);
+        return;
+    }
+
+    unsigned int argTypesLength = getArgTypesLength(argTypes);
+    for(unsigned int i = 0; i < argTypesLength - 1; i++) {
+        // Directed responses only carry the outputs (streamed ones were sent ahead of the response)
+        if (version < PROTOCOL_V2 || (isArgTypeOutput(argTypes[i]) && !isArgTypeStream(argTypes[i]))) {
+            writeArgument(stream, argTypes[i], args[i]);
+        }
+    }
+}
+
+int readResponseArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller) {
+    // Typed signatures have their own marshaller
+    if (marshaller != NULL) {
+        marshaller->readResponse(stream, args, version);
+        return 0;
+    }
+
+    unsigned int argTypesLength = getArgTypesLength(argTypes);
+    vector<char> skipped;
 
     for(unsigned int i = 0; i < argTypesLength - 1; i++) {
-        // The argument to write into the code
         int argType = argTypes[i];
 
-        // Are we dealing with an array?
-        void* argValue = args[i];
-        int ctype = getArgType(argType);
-        unsigned short length = getArgTypeArrayLength(argType);
-        if(length == 0) {
+        // Streamed outputs were received ahead of the response, and directed responses
+        // only carry the outputs.  Responses that echo every argument have the inputs
+        // read past, as the caller may not expect them to change.
+        bool output = isArgTypeOutput(argType);
+        if (isArgTypeStream(argType) || (!output && version >= PROTOCOL_V2)) {
+            continue;
+        }
+
+        int type = getArgType(argType);
+        unsigned int length = getArgTypeArrayLength(argType);
+        void* value = args[i];
+
+        // Variable-length arrays are prefixed with the number of elements in use,
+        // which can never be more than the capacity the caller declared
+        if (isArgTypeVariable(argType)) {
+            rpc_array* array = (rpc_array*) args[i];
+            length = stream.readUInt32();
+            if (length > array->capacity) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+
+            if (output) {
+                array->length = length;
+            }
+            value = array->data;
+        }
+        else if (length == 0) {
             // It is a scalar
             length = 1;
         }
 
-        // We loop around the number of values we need to write
-        // If scalar, this loop happens only once
-        switch(ctype) {
-            case ARG_CHAR:
-                stream.writeChar((char*) argValue, length);
-                break;
-            case ARG_SHORT:
-                stream.writeInt16((short*) argValue, length);
-                break;
-            case ARG_INT:
-                stream.writeInt32((int*) argValue, length);
-                break;
-            case ARG_LONG:
-                stream.writeInt64((long*) argValue, length);
-                break;
-            case ARG_DOUBLE:
-                stream.writeDouble((double*) argValue, length);
-                break;
-            case ARG_FLOAT:
-                stream.writeFloat((float*) argValue, length);
-                break;
-            default:
-                break;
+        if (type_sizeof(type) < 0) {
+            continue;
         }
+
+        if (!output) {
+            skipped.resize((size_t) length * type_sizeof(type) + 1);
+            value = &skipped.front();
+        }
+
+        // Packed arrays pick their own encoding (and are never in-place)
+        if (isArgTypePacked(argType)) {
+            int status = packing_decode(stream, type, value, length);
+            if (status != 0) {
+                return status;
+            }
+            continue;
+        }
+
+        // In-place arguments are padded to their natural alignment
+        if (isArgTypeInPlace(argType) && type_is_native(type)) {
+            stream.readPadding(type_sizeof(type));
+        }
+
+        readValues(stream, type, value, length);
+    }
+    return 0;
+}
+
+void writeExecuteResponse(BinaryStream& stream, std::string name, int* argTypes, void** args, unsigned int version,
+                          const rpc_marshaller* marshaller, const marshalling_plan* plan) {
+    // Directed responses only carry the output values, as the caller already knows the
+    // name and signature of the command it executed.
+    if (version >= PROTOCOL_V2) {
+        writeResponseArguments(stream, argTypes, args, version, marshaller, plan);
+        return;
+    }
+
+    // Write the initial format of the message to the stream
+    // This format is:  { string length, the string, argument types, argument values}
+    stream.writeString(name);
+    stream.writeInt32(argTypes, getArgTypesLength(argTypes));
+    writeResponseArguments(stream, argTypes, args, version, marshaller, plan);
+}
+
+int Protocol::sendExecuteResponse(std::string name, int* argTypes, void**args, unsigned int version, unsigned int epoch, unsigned int handle,
+                                  const rpc_marshaller* marshaller, const marshalling_plan* plan) {
+    BinaryStream stream;
+    writeExecuteResponse(stream, name, argTypes, args, version, marshaller, plan);
+    return sendExecutePayload(stream.str(), stream.size(), version, epoch, handle);
+}
+
+int Protocol::sendExecutePayload(const char* payload, unsigned int size, unsigned int version, unsigned int epoch, unsigned int handle) {
+    if (version < PROTOCOL_V2) {
+        return sendMessage(size, EXECUTE_SUCCESS, const_cast<char*>(payload));
+    }
+
+    // The handle for later requests trails the outputs
+    if (handle == 0) {
+        return sendMessage(size, EXECUTE_DIRECTED_SUCCESS, const_cast<char*>(payload));
+    }
+
+    BinaryStream stream;
+    stream.writeBytes(payload, size);
+    stream.writeUInt32(epoch);
+    stream.writeVarUInt32(handle);
+    return sendMessage(stream.size(), EXECUTE_DIRECTED_SUCCESS, stream.str());
+}
+
+int Protocol::sendChunk(int argType, void* values, unsigned int count) {
+    // Format is as follows: number of elements, elements
+    BinaryStream stream;
+    stream.writeUInt32(count);
+    if (isArgTypePacked(argType)) {
+        packing_encode(stream, getArgType(argType), values, count);
+    }
+    else {
+        writeValues(stream, getArgType(argType), values, count);
     }
 
-    return sendMessage(stream.size(), EXECUTE_SUCCESS, stream.str());
+    return sendMessage(stream.size(), STREAM_CHUNK, stream.str());
+}
+
+int Protocol::sendChunkEnd() {
+    return sendMessage(0, STREAM_END, NULL);
 }
 
 int Protocol::sendExecuteError(ReasonCode reasonCode) {
@@ -228,9 +522,41 @@ int Protocol::sendLocationCacheRequest(string name, int*argTypes) {
     return sendMessage(stream.size(), LOC_CACHE_REQUEST, stream.str());
 }
 
-int Protocol::sendLocationCacheResponse(list<function_info*> &services) {
-    // Allocate sending stream
+int Protocol::sendLocationCacheRevalidate(string name, int* argTypes, unsigned int generation) {
+    unsigned int count = getArgTypesLength(argTypes);
+
+    // Format is that of the cached location request, followed by the generation of the list we have
+    BinaryStream stream;
+    stream.writeString(name);
+    stream.writeUInt32(count);
+    stream.writeInt32(argTypes, count);
+    stream.writeUInt32(generation);
+
+    return sendMessage(stream.size(), LOC_CACHE_REVALIDATE, stream.str());
+}
+
+int Protocol::sendLocationCacheNotModified(unsigned int generation) {
+    BinaryStream stream;
+    stream.writeUInt32(generation);
+
+    return sendMessage(stream.size(), LOC_CACHE_NOT_MODIFIED, stream.str());
+}
+
+int Protocol::sendSubscribe(string name, int* argTypes, unsigned int subscription) {
+    unsigned int count = getArgTypesLength(argTypes);
+
+    // Format is that of the cached location request, followed by the id the client gives the subscription
     BinaryStream stream;
+    stream.writeString(name);
+    stream.writeUInt32(count);
+    stream.writeInt32(argTypes, count);
+    stream.writeUInt32(subscription);
+
+    return sendMessage(stream.size(), SUBSCRIBE, stream.str());
+}
+
+// Writes the servers of a function and the generation of their list, as carried by cached location responses.
+void writeLocationCacheList(BinaryStream& stream, list<function_info*> &services, unsigned int generation) {
     stream.writeUInt32(services.size());
     for(auto const service : services) {
         // The format is as follows: length of server_identifier, server_identifier, port
@@ -238,9 +564,59 @@ int Protocol::sendLocationCacheResponse(list<function_info*> &services) {
         stream.writeInt16(service->port);
     }
 
+    // The protocol versions of each of the services trail the list, so older clients ignore them
+    for(auto const service : services) {
+        stream.writeUInt32(service->version);
+    }
+
+    // Followed by the time to live of the function on each of them
+    for(auto const service : services) {
+        stream.writeUInt32(service->ttl);
+    }
+
+    // And the generation of the list
+    stream.writeUInt32(generation);
+}
+
+int Protocol::sendLocationCacheResponse(list<function_info*> &services, unsigned int generation) {
+    // Allocate sending stream
+    BinaryStream stream;
+    writeLocationCacheList(stream, services, generation);
+
     return sendMessage(stream.size(), LOC_CACHE_SUCCESS, stream.str());
 }
 
+int Protocol::sendLocationCacheBatch(const vector<rpc_info>& functions, bool subscribe, const vector<unsigned int>& subscriptions) {
+    // Format is as follows: the number of functions, whether to subscribe to them, then the length of the name, name,
+    // argTypes array (ending in a zero) and subscription id (if subscribing) of each function
+    BinaryStream stream;
+    stream.writeUInt32(functions.size());
+    stream.writeUInt32(subscribe ? 1 : 0);
+
+    for (unsigned int i = 0; i < functions.size(); i++) {
+        unsigned int count = getArgTypesLength(functions[i].argTypes);
+        stream.writeString(functions[i].name);
+        stream.writeUInt32(count);
+        stream.writeInt32(functions[i].argTypes, count);
+        if (subscribe) {
+            stream.writeUInt32(subscriptions[i]);
+        }
+    }
+
+    return sendMessage(stream.size(), LOC_CACHE_BATCH, stream.str());
+}
+
+int Protocol::sendLocationCacheBatchResponse(vector<list<function_info*>> &services, const vector<unsigned int>& generations) {
+    // Format is as follows: the number of functions, then the servers of each in the format of a cached location response
+    BinaryStream stream;
+    stream.writeUInt32(services.size());
+    for (unsigned int i = 0; i < services.size(); i++) {
+        writeLocationCacheList(stream, services[i], generations[i]);
+    }
+
+    return sendMessage(stream.size(), LOC_CACHE_BATCH_SUCCESS, stream.str());
+}
+
 int Protocol::sendLocationCacheError(ReasonCode reasonCode) {
     // Allocate a buffer for an 32-bit integer
     BinaryStream stream;
@@ -250,40 +626,165 @@ int Protocol::sendLocationCacheError(ReasonCode reasonCode) {
     return sendMessage(stream.size(), LOC_CACHE_FAILURE, stream.str());
 }
 
+int Protocol::sendServicesChanged(unsigned int subscription, unsigned int generation, bool added, function_info &service) {
+    // Format is as follows: subscription id, generation of the list after the change, whether the server was added (or removed),
+    // length of server_identifier, server_identifier, port, protocol version, time to live
+    BinaryStream stream;
+    stream.writeUInt32(subscription);
+    stream.writeUInt32(generation);
+    stream.writeUInt32(added ? 1 : 0);
+    stream.writeString(service.server_identifier);
+    stream.writeInt16(service.port);
+    stream.writeUInt32(service.version);
+    stream.writeUInt32(service.ttl);
+
+    return sendMessage(stream.size(), SERVICES_CHANGED, stream.str());
+}
+
 //--------------------------------------------------------------------------------------
 
 int Protocol::receiveMessageType(MessageType &type) {
-    // Allocate a buffer for an 32-bit integer
-    char buffer[SIZEOF_INTEGER];
+    // Compact headers are received as a whole along with the size
+    int result = m_typeWord;
+    if (!m_compact) {
+        // Allocate a buffer for an 32-bit integer
+        char buffer[SIZEOF_INTEGER];
+
+        // receive the message (if zero then success)
+        int status = receiveBytes(SIZEOF_INTEGER, buffer);
+        if (status != 0) {
+            return status;
+        }
 
-    // receive the message (if zero then success)
-    int status = receiveMessage(SIZEOF_INTEGER, buffer);
-    if (status != 0) {
-        return status;
+        // Read the integer from the byte stream
+        result = Convert::parseInt32(buffer);
     }
 
-    // Read the integer from the byte stream
-    int result = Convert::parseInt32(buffer);
-    type = static_cast<MessageType>(result);
+    type = static_cast<MessageType>(result & FRAME_TYPE_MASK);
+
+    // The peer tells us which codecs it accepts, and which codec the payload is compressed with
+    unsigned int accepted = ((unsigned int) result >> FRAME_ACCEPT_SHIFT) & 255;
+    if (accepted != CODEC_NONE) {
+        setPeerCodecs(accepted);
+    }
+    m_codec = ((unsigned int) result >> FRAME_CODEC_SHIFT) & 15;
     return 0;
 }
 
 int Protocol::receiveMessageSize(unsigned int &messageSize) {
+    // Compact headers are received as a whole, keeping the type word for receiveMessageType
+    if (m_compact) {
+        unsigned int header[2];
+        int status = receiveVarints(header, 2);
+        messageSize = header[0];
+        m_typeWord = header[1];
+        return status;
+    }
+
     // Allocate a buffer for an 32-bit integer
     char buffer[SIZEOF_INTEGER];
 
     // receive the message (if zero then success)
-    int status = receiveMessage(SIZEOF_INTEGER, buffer);
+    int status = receiveBytes(SIZEOF_INTEGER, buffer);
     if(status != 0) {
         return status;
     }
 
     // Read the integer from byte stream
     messageSize = Convert::parseUInt32(buffer);
+
+    // The peer switched the connection to compact frames, starting with the type word of this message
+    if ((messageSize & FRAME_COMPACT_FLAG) != 0) {
+        messageSize &= ~FRAME_COMPACT_FLAG;
+        m_compact = true;
+        m_announced = true;
+        return receiveVarints(&m_typeWord, 1);
+    }
+    return 0;
+}
+
+int Protocol::receiveVarints(unsigned int values[], int count) {
+    // Peek at the varints so that the common case consumes them with a single read
+    char header[SIZEOF_COMPACT_HEADER];
+    int peeked = recv(_sfd, header, SIZEOF_COMPACT_HEADER, MSG_PEEK);
+    if (peeked == 0) {
+        return SOCKET_CONNECTION_ERROR;
+    }
+    else if (peeked < 0) {
+        return SOCKET_RECEIVE_ERROR;
+    }
+
+    // The varints end with the last byte that does not have its high bit set
+    int length = 0;
+    int varints = 0;
+    for (; length < peeked && varints < count; length++) {
+        if ((header[length] & 128) == 0) {
+            varints++;
+        }
+    }
+
+    int status = 0;
+    if (varints == count) {
+        status = receiveBytes(length, header);
+    }
+    else {
+        // Only some of the varints have arrived, so read them a byte at a time
+        length = 0;
+        for (varints = 0; varints < count && status == 0; length++) {
+            if (length == SIZEOF_COMPACT_HEADER) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+
+            status = receiveBytes(1, header + length);
+            if ((header[length] & 128) == 0) {
+                varints++;
+            }
+        }
+    }
+    if (status != 0) {
+        return status;
+    }
+
+    BinaryStream stream(header, length);
+    for (int i = 0; i < count; i++) {
+        values[i] = stream.readVarUInt32();
+    }
     return 0;
 }
 
 int Protocol::receiveMessage(unsigned int size, char message[]) {
+    unsigned int codec = m_codec;
+    m_codec = CODEC_NONE;
+
+    if (codec == CODEC_NONE) {
+        return receiveBytes(size, message);
+    }
+
+    // Compressed payloads are prefixed with their compressed size, the message size is the original size
+    char buffer[SIZEOF_INTEGER];
+    int status = receiveBytes(SIZEOF_INTEGER, buffer);
+    if (status != 0) {
+        return status;
+    }
+
+    // Payloads are only compressed when that makes them smaller, so a larger compressed size is invalid
+    unsigned int compressedSize = Convert::parseUInt32(buffer);
+    if (compressedSize > size) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+    vector<char> compressed(compressedSize > 0 ? compressedSize : 1);
+    status = receiveBytes(compressedSize, &compressed.front());
+    if (status != 0) {
+        return status;
+    }
+
+    if (compression_decompress(codec, &compressed.front(), compressedSize, message, size) != 0) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+    return 0;
+}
+
+int Protocol::receiveBytes(unsigned int size, char message[]) {
     //NOTE: This would be better as vector<char> and populating that instead
     // If empty, return
     if (size == 0) {
@@ -317,11 +818,50 @@ int Protocol::receiveMessage(unsigned int size, char message[]) {
 //--------------------------------------------------------------------------------------
 
 int Protocol::sendMessage(unsigned int messageSize, MessageType messageType, char message[]) {
-    // Allocate the buffer, and send the contents
+    int typeWord = static_cast<int>(messageType);
+
+    // Tell the peer which codecs we accept
+    if (m_advertise) {
+        typeWord |= compression_codecs() << FRAME_ACCEPT_SHIFT;
+    }
+
+    // Large payloads are compressed with a codec the peer accepts, if that makes them smaller
+    unsigned int codec = compression_choose(m_peerCodecs);
+    vector<char> compressed;
+    int compressedSize = -1;
+    if (codec != CODEC_NONE && messageSize >= COMPRESSION_THRESHOLD) {
+        compressedSize = compression_compress(codec, message, messageSize, compressed);
+    }
+
+    bool compress = compressedSize >= 0 && (unsigned int) compressedSize + SIZEOF_LENGTH < messageSize;
+    if (compress) {
+        typeWord |= codec << FRAME_CODEC_SHIFT;
+    }
+
+    // Allocate the buffer, and write the header (the first compact one flags its size word, so the peer knows to switch)
     BinaryStream stream;
-    stream.writeUInt32(messageSize);
-    stream.writeInt32(static_cast<int>(messageType));
-    stream.writeChar(message, messageSize);
+    if (m_compact && !m_announced) {
+        stream.writeUInt32(messageSize | FRAME_COMPACT_FLAG);
+        stream.writeVarUInt32(typeWord);
+        m_announced = true;
+    }
+    else if (m_compact) {
+        stream.writeVarUInt32(messageSize);
+        stream.writeVarUInt32(typeWord);
+    }
+    else {
+        stream.writeUInt32(messageSize);
+        stream.writeInt32(typeWord);
+    }
+
+    // Send the contents
+    if (compress) {
+        stream.writeUInt32(compressedSize);
+        stream.writeChar(&compressed.front(), compressedSize);
+    }
+    else {
+        stream.writeChar(message, messageSize);
+    }
 
     // Gets the buffer pointer from the stream
     char* pointer = stream.str();
@@ -329,15 +869,15 @@ int Protocol::sendMessage(unsigned int messageSize, MessageType messageType, cha
     int bytesRead;
 
     while (bytesRemaining > 0) {
-        // Read from the socket the number of bytes specified
-        bytesRead = send(_sfd, pointer, bytesRemaining, 0);
+        // Send the remaining bytes, without raising SIGPIPE if the peer went away (prepared calls keep their connection)
+        bytesRead = send(_sfd, pointer, bytesRemaining, MSG_NOSIGNAL);
 
         if (bytesRead == 0) {
             break;
         }
         else if (bytesRead < 0) {
             // if negative, then errwor
-            return bytesRead;
+            return SOCKET_SEND_ERROR;
         }
 
         // Update number of bytes left to read (+ adjust pointer)
@@ -5,8 +5,10 @@
 #include "conversion.h"
 #include "bstream.h"
 
+#include <cstddef>
 #include <string>
 #include <list>
+#include <vector>
 
 
 // Macros to remove magic numbers
@@ -18,6 +20,58 @@
 #define SIZEOF_PORT 2
 #define SIZEOF_NULLTERM 1
 
+// The largest number of element bytes carried by a single STREAM_CHUNK
+#define STREAM_CHUNK_SIZE 65536
+
+// The message type is sent as 4 bytes, the low two ([2][3]) hold the type itself.
+// Byte [1] holds the codecs the sender accepts, and the low bits of byte [0] hold the
+// codec the payload is compressed with (see compression.h).
+#define FRAME_TYPE_MASK 65535
+#define FRAME_ACCEPT_SHIFT 16
+#define FRAME_CODEC_SHIFT 24
+
+// A connection switches to compact frames by setting this bit in the size of its first compact
+// frame, which is followed by the type word as a varint.  Every later frame (in either direction)
+// starts with the message size and type word as varints, rather than four bytes each, so even
+// one-shot calls save on both headers.  Messages are therefore smaller than 2 GB.
+#define FRAME_COMPACT_FLAG 0x80000000
+#define SIZEOF_COMPACT_HEADER 10
+
+// Marshals the arguments of a single signature (see rpccall.h).
+struct rpc_marshaller;
+
+// The compiled marshalling of a registered signature (see plan.h).
+struct marshalling_plan;
+
+//--------------------------------------------------------------------------------------
+
+// Writes the specified number of values of the rpc type to the stream.
+void writeValues(BinaryStream& stream, int ctype, void* values, unsigned int count);
+
+// Reads the specified number of values of the rpc type from the stream.
+void readValues(BinaryStream& stream, int ctype, void* values, unsigned int count);
+
+// Writes the name and argument types an execute request starts with.
+void writeRequestPrefix(BinaryStream& stream, const std::string& name, int* argTypes);
+
+// Writes the argument values of an execute request, returning whether any of them is streamed.
+// The values are written by the marshaller of the signature, if there is one.
+bool writeRequestArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller);
+
+// Writes the argument values of an execute response (only the outputs, from PROTOCOL_V2 on).
+// The values are written by the plan or marshaller of the signature, if there is one.
+void writeResponseArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller,
+                            const marshalling_plan* plan = NULL);
+
+// Writes the payload of an execute success response in the format of the specified protocol version
+// (without the handle that may trail a directed response, see sendExecutePayload).
+void writeExecuteResponse(BinaryStream& stream, std::string name, int* argTypes, void** args, unsigned int version,
+                          const rpc_marshaller* marshaller = NULL, const marshalling_plan* plan = NULL);
+
+// Reads the output values of an execute response into the arguments.
+// Returns zero on success, or RECEIVE_INVALID_MESSAGE if the values are malformed.
+int readResponseArguments(BinaryStream& stream, int* argTypes, void** args, unsigned int version, const rpc_marshaller* marshaller);
+
 //--------------------------------------------------------------------------------------
 
 class Protocol {
@@ -31,42 +85,89 @@ class Protocol {
     // Sends a termination message.
     int sendTerminate();
 
-    // Sends the register request with the socket host address and remote procedure command (rpc) definition.
-    int sendRegister(std::string server_identifier, unsigned short port, std::string name, int argTypes[]);
+    // Sends the register request with the socket host address and remote procedure command (rpc) definition,
+    // and the milliseconds its results may be reused for (zero unless it is pure).
+    int sendRegister(std::string server_identifier, unsigned short port, std::string name, int argTypes[], unsigned int ttl = 0);
+
+    // Sends the register request for many functions of the server at once, with the socket host address and the
+    // remote procedure command (rpc) definition and time to live of each function.
+    int sendRegisterBatch(std::string server_identifier, unsigned short port, const std::list<function_info>& functions);
 
     // Sends the register success response with any possible warnings or errors.
     int sendRegisterResponse(ReasonCode code);
 
+    // Sends the batched register success response with the warnings or errors of each function, in order.
+    int sendRegisterBatchResponse(const std::vector<ReasonCode>& codes);
+
     // Sends the register error response with the associated error.
     int sendRegisterError(ReasonCode code);
 
     // Sends the cached location request with the remote procedure command (rpc) definition.
     int sendLocationCacheRequest(std::string name, int*argTypes);
 
-    // Sends the cached location success response with the specified server identifier and port
-    int sendLocationCacheResponse(std::list<function_info*> &services);
+    // Sends the cached location revalidation request with the remote procedure command (rpc) definition and the generation of the list we have.
+    int sendLocationCacheRevalidate(std::string name, int* argTypes, unsigned int generation);
+
+    // Sends the cached location response telling the list of the specified generation is still current.
+    int sendLocationCacheNotModified(unsigned int generation);
+
+    // Sends the subscribe request with the remote procedure command (rpc) definition and the id of the subscription.
+    int sendSubscribe(std::string name, int* argTypes, unsigned int subscription);
+
+    // Sends the cached location success response with the servers of the function and the generation of the list
+    int sendLocationCacheResponse(std::list<function_info*> &services, unsigned int generation);
+
+    // Sends the cached location request for many functions, subscribing to their changes with the specified ids if asked to.
+    int sendLocationCacheBatch(const std::vector<rpc_info>& functions, bool subscribe, const std::vector<unsigned int>& subscriptions);
+
+    // Sends the batched cached location response with the servers and generation of the list of each function, in order
+    // (without servers if the function is not available).
+    int sendLocationCacheBatchResponse(std::vector<std::list<function_info*>> &services, const std::vector<unsigned int>& generations);
 
     // Sends the cached location error response with the specified reasonCode
     int sendLocationCacheError(ReasonCode reasonCode);
 
+    // Pushes the change of a server of a subscribed function, with the generation of the list once changed.
+    int sendServicesChanged(unsigned int subscription, unsigned int generation, bool added, function_info &service);
+
     // Sends the location request with the remote procedure command (rpc) definition.
     int sendLocationRequest(std::string name, int argTypes[]);
 
-    // Sends the location success response with the specified server identifier and port
-    int sendLocationResponse(std::string server_identifier, unsigned short port);
+    // Sends the location success response with the specified server identifier, port, protocol version and time to live
+    int sendLocationResponse(std::string server_identifier, unsigned short port, unsigned int version, unsigned int ttl = 0);
 
     // Sends the location error response with the specified reasonCode
     int sendLocationError(ReasonCode reasonCode);
 
-    // Sends the execute request with the function and parameters.
-    int sendExecuteRequest(std::string name, int* argTypes, void**args);
+    // Sends the execute request with the function and parameters in the format of the specified protocol version.
+    // The parameters are written by the marshaller of the signature, if there is one.
+    int sendExecuteRequest(std::string name, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller = NULL);
+
+    // Sends the execute request for the function with the handle the server handed out (in its specified epoch).
+    int sendExecuteHandle(unsigned int epoch, unsigned int handle, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller = NULL);
+
+    // Sends an execute request of the specified type, made of a prefix encoded ahead of time (the name and argument
+    // types, or the handle of the function) followed by the parameters.  Used by prepared calls (see rpcPrepare).
+    int sendExecutePrepared(BinaryStream& prefix, MessageType type, int* argTypes, void**args, unsigned int version, const rpc_marshaller* marshaller = NULL);
 
-    // Sends the execute response with the function and parameters.
-    int sendExecuteResponse(std::string name, int* argTypes, void**args);
+    // Sends the execute response with the function and parameters in the format of the specified protocol version.
+    // Directed responses can hand out a function handle (non-zero) for later requests.
+    int sendExecuteResponse(std::string name, int* argTypes, void**args, unsigned int version, unsigned int epoch = 0, unsigned int handle = 0,
+                            const rpc_marshaller* marshaller = NULL, const marshalling_plan* plan = NULL);
+
+    // Sends the execute response with a payload written by writeExecuteResponse (for the same protocol version),
+    // followed by the function handle (if non-zero) on directed responses.
+    int sendExecutePayload(const char* payload, unsigned int size, unsigned int version, unsigned int epoch = 0, unsigned int handle = 0);
 
     // Sends the execute error response with the specified reasonCode.
     int sendExecuteError(ReasonCode reasonCode);
 
+    // Sends a chunk of the elements of a streamed argument.
+    int sendChunk(int argType, void* values, unsigned int count);
+
+    // Sends the end of a streamed argument.
+    int sendChunkEnd();
+
     //--------------------------------------------------------------------------------------
     // Methods that handle receiving of data from bound socket.
 
@@ -79,10 +180,50 @@ class Protocol {
     // Receives the message type from the bound socket.
     int receiveMessageType(MessageType &type);
 
+    //--------------------------------------------------------------------------------------
+    // Methods that handle the compression handshake.
+
+    // Sets the codecs the peer accepts, and advertises our own codecs back to it.
+    void setPeerCodecs(unsigned int codecs);
+
+    // Gets the codecs the peer accepts (as advertised in the messages it sent).
+    unsigned int getPeerCodecs();
+
+    // Advertises the codecs we accept in the messages we send.
+    void advertiseCodecs();
+
+    //--------------------------------------------------------------------------------------
+    // Methods that handle the framing of the connection.
+
+    // Switches the connection to compact frames, telling the peer ahead of the next message.
+    void useCompactFrames();
+
+    // Determines if the connection uses compact frames (either side switched it).
+    bool isCompact();
+
   private:
 
     // Sends the structural protocol message over the currently bound socket.
     int sendMessage(unsigned int messageSize, MessageType msgType, char message[]);
 
+    // Receives the specified number of bytes from the bound socket.
+    int receiveBytes(unsigned int size, char buffer[]);
+
+    // Receives the specified number of varints (at most two) of a compact header.
+    int receiveVarints(unsigned int values[], int count);
+
     int _sfd;
+
+    // The codecs the peer accepts, and whether we tell it which ones we accept
+    unsigned int m_peerCodecs;
+    bool m_advertise;
+
+    // The codec the payload of the message being received is compressed with
+    unsigned int m_codec;
+
+    // Whether the connection uses compact frames, and whether the peer has been told so.
+    // The type word of a compact header is received along with the size.
+    bool m_compact;
+    bool m_announced;
+    unsigned int m_typeWord;
 };
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "routing.h"
+#include "constants.h"
+#include "helpers.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+// The segment starts with this header, followed by the image of the table.
+#define ROUTING_MAGIC "RPCROUT1"
+#define ROUTING_MAGIC_SIZE 8
+#define ROUTING_HOST_SIZE 256
+
+struct routing_header {
+    char magic[ROUTING_MAGIC_SIZE];
+    char host[ROUTING_HOST_SIZE];
+    uint32_t port;
+    uint32_t pid;
+    atomic<uint32_t> closed;        // the binder no longer maintains the table
+    atomic<uint32_t> sequence;      // odd while the image is rewritten
+    atomic<uint32_t> size;          // of the image
+};
+
+#define ROUTING_IMAGE_OFFSET sizeof(routing_header)
+
+// The size the segment starts at, the reads of a reader before it asks the binder instead, and the milliseconds
+// between the checks that the binder is running (and between the attempts to map its segment).
+#define ROUTING_INITIAL_SIZE 65536
+#define ROUTING_READ_ATTEMPTS 64
+#define ROUTING_CHECK_MS 1000
+
+// Gets the name of the segment of the binder on the port.
+string routingSegment(unsigned short port) {
+    return "/rpcbinder." + to_string((long long) port);
+}
+
+// Whether the process is running.
+bool processRunning(unsigned int pid) {
+    return kill((pid_t) pid, 0) == 0 || errno == EPERM;
+}
+
+string routingKey(const string& name, int* argTypes) {
+    string key(name.c_str());
+    key.push_back('\0');
+
+    unsigned int length = getArgTypesLength(argTypes);
+    for (unsigned int i = 0; i + 1 < length; i++) {
+        key.push_back(isArgTypeArray(argTypes[i]) ? 'a' : 's');
+    }
+    return key;
+}
+
+//--------------------------------------------------------------------------------------
+
+RoutingPublisher::RoutingPublisher() : m_fd(-1), m_data(NULL), m_size(0) {
+}
+
+int RoutingPublisher::open(const string& host, unsigned short port) {
+    m_name = routingSegment(port);
+
+    // A segment left by a binder that did not exit cleanly is replaced (its readers keep their mapping of it)
+    shm_unlink(m_name.c_str());
+    m_fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (m_fd < 0 || ftruncate(m_fd, ROUTING_INITIAL_SIZE) != 0) {
+        close();
+        return ERROR;
+    }
+
+    void* data = mmap(NULL, ROUTING_INITIAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED) {
+        close();
+        return ERROR;
+    }
+    m_data = (char*) data;
+    m_size = ROUTING_INITIAL_SIZE;
+
+    routing_header* header = (routing_header*) m_data;
+    memcpy(header->magic, ROUTING_MAGIC, ROUTING_MAGIC_SIZE);
+    strncpy(header->host, host.c_str(), ROUTING_HOST_SIZE - 1);
+    header->port = port;
+    header->pid = getpid();
+
+    // Start with an empty table
+    publish(snapshot_entries());
+    return SUCCESS;
+}
+
+void RoutingPublisher::publish(const snapshot_entries& entries) {
+    if (m_data == NULL) {
+        return;
+    }
+
+    string image;
+    snapshot_encode(entries, image);
+
+    // Grow the segment to fit the table (readers map it again once they see the larger table)
+    size_t needed = ROUTING_IMAGE_OFFSET + image.size();
+    if (needed > m_size) {
+        size_t size = max(needed, 2 * m_size);
+        void* data = MAP_FAILED;
+        if (ftruncate(m_fd, size) == 0) {
+            data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        }
+        if (data == MAP_FAILED) {
+            // Readers go back to the socket
+            close();
+            return;
+        }
+        munmap(m_data, m_size);
+        m_data = (char*) data;
+        m_size = size;
+    }
+
+    routing_header* header = (routing_header*) m_data;
+    uint32_t sequence = header->sequence.load(memory_order_relaxed);
+    header->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(m_data + ROUTING_IMAGE_OFFSET, image.data(), image.size());
+    header->size.store(image.size(), memory_order_relaxed);
+
+    header->sequence.store(sequence + 2, memory_order_release);
+}
+
+void RoutingPublisher::close() {
+    if (m_data != NULL) {
+        routing_header* header = (routing_header*) m_data;
+        header->closed.store(1, memory_order_release);
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        shm_unlink(m_name.c_str());
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_fd = -1;
+}
+
+//--------------------------------------------------------------------------------------
+
+RoutingTable::Mapping::Mapping(char* data, size_t size, unsigned int pid)
+    : data(data), size(size), pid(pid), checked(chrono::steady_clock::now().time_since_epoch().count()) {
+}
+
+RoutingTable::Mapping::~Mapping() {
+    munmap(data, size);
+}
+
+RoutingTable::RoutingTable() : m_nextAttach(0) {
+    pthread_mutex_init(&m_attachLock, NULL);
+}
+
+void RoutingTable::attach(size_t needed) {
+    pthread_mutex_lock(&m_attachLock);
+
+    // Another thread may have mapped the segment meanwhile
+    shared_ptr<Mapping> current = atomic_load(&m_mapping);
+    if (current && needed != 0 && current->size >= needed) {
+        pthread_mutex_unlock(&m_attachLock);
+        return;
+    }
+
+    shared_ptr<Mapping> mapping;
+    int fd = shm_open(routingSegment(getBinderPort()).c_str(), O_RDONLY, 0);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && (size_t) info.st_size >= ROUTING_IMAGE_OFFSET && (size_t) info.st_size >= needed) {
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            routing_header* header = (routing_header*) data;
+            mapping = make_shared<Mapping>((char*) data, info.st_size, header->pid);
+
+            // Only the table of the binder we use is read, while it is maintained
+            bool ours = memcmp(header->magic, ROUTING_MAGIC, ROUTING_MAGIC_SIZE) == 0
+                && strncmp(header->host, getBinderAddress().c_str(), ROUTING_HOST_SIZE) == 0
+                && header->port == (uint32_t) getBinderPort();
+            if (!ours || header->closed.load(memory_order_acquire) != 0 || !processRunning(header->pid)) {
+                mapping.reset();
+            }
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+
+    atomic_store(&m_mapping, mapping);
+    if (!mapping) {
+        m_nextAttach.store((chrono::steady_clock::now() + chrono::milliseconds(ROUTING_CHECK_MS)).time_since_epoch().count(), memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&m_attachLock);
+}
+
+void RoutingTable::detach() {
+    pthread_mutex_lock(&m_attachLock);
+    atomic_store(&m_mapping, shared_ptr<Mapping>());
+    m_nextAttach.store((chrono::steady_clock::now() + chrono::milliseconds(ROUTING_CHECK_MS)).time_since_epoch().count(), memory_order_relaxed);
+    pthread_mutex_unlock(&m_attachLock);
+}
+
+bool RoutingTable::find(const string& key, list<function_info>& services, unsigned int& generation) {
+    for (unsigned int attempt = 0; attempt < ROUTING_READ_ATTEMPTS; attempt++) {
+        chrono::steady_clock::rep now = chrono::steady_clock::now().time_since_epoch().count();
+
+        shared_ptr<Mapping> mapping = atomic_load(&m_mapping);
+        if (!mapping) {
+            if (now < m_nextAttach.load(memory_order_relaxed)) {
+                return false;
+            }
+            attach(0);
+            mapping = atomic_load(&m_mapping);
+            if (!mapping) {
+                return false;
+            }
+        }
+
+        // Once a while, make sure the binder did not go away without closing its table (the times are shared by every
+        // reader without a lock, and only decide when to check, so they need no ordering)
+        routing_header* header = (routing_header*) mapping->data;
+        chrono::steady_clock::rep interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::milliseconds(ROUTING_CHECK_MS)).count();
+        bool due = now - mapping->checked.load(memory_order_relaxed) > interval;
+        if (header->closed.load(memory_order_acquire) != 0 || (due && !processRunning(mapping->pid))) {
+            detach();
+            return false;
+        }
+        if (due) {
+            mapping->checked.store(now, memory_order_relaxed);
+        }
+
+        // Read the table while the binder is not rewriting it
+        uint32_t sequence = header->sequence.load(memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+
+        size_t size = header->size.load(memory_order_relaxed);
+        if (ROUTING_IMAGE_OFFSET + size > mapping->size) {
+            attach(ROUTING_IMAGE_OFFSET + size);
+            continue;
+        }
+
+        bool found = snapshot_find(mapping->data + ROUTING_IMAGE_OFFSET, size, key, services, generation);
+        atomic_thread_fence(memory_order_acquire);
+        if (header->sequence.load(memory_order_relaxed) == sequence) {
+            return found;
+        }
+    }
+
+    // The table kept changing, so the binder is asked instead
+    return false;
+}
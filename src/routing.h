@@ -0,0 +1,100 @@
+#pragma once
+
+/*
+routing.h
+
+The routing table the binder publishes for the clients on its host: the servers of every function, in a
+shared memory segment the clients map read-only, so they find the servers of a function by reading memory
+instead of asking the binder over its socket.
+
+The segment is named after the port of the binder, and starts with a header naming the binder (its host,
+port and process id), so clients of another binder, or of a binder that exited, do not read it.  The table
+follows the header as an image in the layout of a snapshot (see snapshot.h), keyed by routingKey, and is
+guarded by a sequence lock: the binder makes the sequence odd while it rewrites the image and even once it
+is done, and readers that saw an odd sequence, or one that changed while they read, read again.  Readers
+take no lock, and a reader that keeps failing asks the binder instead.
+
+The binder rewrites the table once per pass of its loop in which servers were added or removed, growing the
+segment as needed.  Readers map the segment at the size they find, and map it again once the table outgrew
+it (the mapping is swapped in the manner of read-copy-update, as the service cache does).  A binder that
+exits sets the closed flag of the header, and one that is killed cannot, so readers also check that its
+process is running (with kill, at most once every ROUTING_CHECK_MS).  Either way its readers unmap the table
+and fall back to the socket, trying to map the segment again after the same interval.
+*/
+
+#include "snapshot.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+
+// Gets the key of the function in the routing table.  The binder matches functions by name and by whether
+// each argument is an array (see rpc_info), so that is all the key holds.
+std::string routingKey(const std::string& name, int* argTypes);
+
+// Publishes the routing table of the binder.
+class RoutingPublisher {
+  public:
+    // Initializes a new instance of the RoutingPublisher class with no segment.
+    RoutingPublisher();
+
+    // Creates the segment of the binder on the host and port, replacing any left by an earlier one.
+    int open(const std::string& host, unsigned short port);
+
+    // Replaces the table with the servers of each function (keyed by routingKey) and their generation.
+    void publish(const snapshot_entries& entries);
+
+    // Marks the table as no longer maintained, and removes the segment.
+    void close();
+
+  private:
+    std::string m_name;
+    int m_fd;
+    char* m_data;
+    size_t m_size;
+
+    // The publisher owns the segment, so copying is not permitted
+    RoutingPublisher(const RoutingPublisher&);
+    RoutingPublisher& operator =(const RoutingPublisher&);
+};
+
+// Reads the routing table published by the binder the client uses, if it runs on the same host.
+class RoutingTable {
+  public:
+    // Initializes a new instance of the RoutingTable class, mapping the segment on first use.
+    RoutingTable();
+
+    // Finds the servers of the function (keyed by routingKey) along with their generation.  Returns false if the
+    // table has none, or is not available.
+    bool find(const std::string& key, std::list<function_info>& services, unsigned int& generation);
+
+  private:
+    // A mapping of the segment, unmapped once the last reader is done with it.
+    struct Mapping {
+        char* data;
+        size_t size;
+        unsigned int pid;
+        std::atomic<std::chrono::steady_clock::rep> checked;   // when the binder was last known to be running
+
+        Mapping(char* data, size_t size, unsigned int pid);
+        ~Mapping();
+    };
+
+    // Maps the segment (again), if it is at least the size needed and the binder that published it is running.
+    void attach(size_t needed);
+
+    // Drops the mapping, trying to map the segment again after a while.
+    void detach();
+
+    pthread_mutex_t m_attachLock;
+    std::shared_ptr<Mapping> m_mapping;
+    std::atomic<std::chrono::steady_clock::rep> m_nextAttach;    // read by every reader, written under the attach lock
+
+    // The table is shared by address, so copying is not permitted
+    RoutingTable(const RoutingTable&);
+    RoutingTable& operator =(const RoutingTable&);
+};
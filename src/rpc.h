@@ -1,3 +1,5 @@
+#pragma once
+
 /*
  * rpc.h
  *
@@ -17,13 +19,211 @@ extern "C" {
 #define ARG_INPUT   31
 #define ARG_OUTPUT  30
 
+/*
+ * Input arguments flagged in-place are aligned on the wire, and when their
+ * wire representation matches the host layout the server binds them directly
+ * to the received frame instead of copying them.
+ */
+#define ARG_INPLACE 29
+
+/*
+ * Variable-length array arguments are passed as a pointer to an rpc_array.
+ * The caller declares the capacity, and only the elements in use (length)
+ * are transferred, so the array length in the argument type is ignored.
+ * Servers refuse capacities of more than 64 MB, which should be streamed.
+ */
+#define ARG_VARIABLE 28
+
+typedef struct rpc_array {
+    unsigned int capacity;  /* number of elements data can hold */
+    unsigned int length;    /* number of elements in use */
+    void *data;
+} rpc_array;
+
+/*
+ * Streamed array arguments are passed by the caller as an rpc_array, but their
+ * elements are transferred in chunks after the execute message, so neither
+ * side buffers the whole array. A streamed argument is either an input or an
+ * output, never both.
+ *
+ * Skeletons receive an rpc_stream instead of the array, and read the input
+ * elements as they arrive with rpcStreamRead (which returns the number of
+ * elements read, fewer than requested only at the end of the stream). Outputs
+ * are written with rpcStreamWrite, up to the capacity declared by the caller.
+ * Streams are transferred in argument order, inputs before outputs, so reading
+ * a stream skips what is left of earlier input streams and writing an output
+ * skips what is left of every input stream.
+ */
+#define ARG_STREAM 27
+
+typedef struct rpc_stream rpc_stream;
+
+extern int rpcStreamRead(rpc_stream* stream, void* data, unsigned int count);
+extern int rpcStreamWrite(rpc_stream* stream, void* data, unsigned int count);
+extern unsigned int rpcStreamLength(rpc_stream* stream);
+
+/*
+ * Integer arrays (ARG_INT or ARG_LONG) flagged packed are delta encoded on
+ * the wire, which shrinks sorted ids and timestamps several times over. The
+ * encoding is chosen per array and never larger than the plain values, so
+ * the flag only changes how the array travels, not how it is passed.
+ */
+#define ARG_PACKED 26
+
+/*
+ * Calls made repeatedly with the same name and argument types can be prepared
+ * once with rpcPrepare. The prepared call locates a server, keeps a connection
+ * to it open, and encodes the name and argument types up front, so each
+ * rpcCallPrepared only encodes the argument values. If the connection breaks,
+ * the server is located again and the call retried once. The argument types
+ * are copied, and rpcReleasePrepared closes the connection.
+ */
+typedef struct rpc_prepared rpc_prepared;
+
+
+/*
+ * Functions registered pure with rpcRegisterPure always return the same
+ * outputs for the same inputs, for the specified time to live (in
+ * milliseconds). Clients learn this when locating the function, and keep the
+ * results of later calls in a bounded cache, so calls repeated with the same
+ * inputs are answered without the network. Streamed calls are never cached.
+ * rpcMemoStats gives the counters of the cache, and rpcSetMemoCapacity bounds
+ * the bytes it holds (zero disables it).
+ */
+typedef struct rpc_memo_stats {
+    unsigned long hits;         /* calls answered by the cache */
+    unsigned long misses;       /* calls of functions known to be pure that went to a server */
+    unsigned long evictions;    /* results dropped to stay within the capacity */
+} rpc_memo_stats;
+
+extern void rpcMemoStats(rpc_memo_stats* stats);
+extern void rpcSetMemoCapacity(unsigned long bytes);
+
+/*
+ * Servers keep the responses of functions registered with rpcRegisterCached
+ * (or rpcRegisterPure) for the specified time to live (in milliseconds), and
+ * answer requests with the same argument values from any client with them,
+ * without calling the skeleton. Unlike pure functions, clients are not told,
+ * so every call still reaches the server. rpcResultCacheStats gives the
+ * counters of the cache, and rpcSetResultCacheCapacity bounds the bytes it
+ * holds (zero disables it).
+ */
+extern void rpcResultCacheStats(rpc_memo_stats* stats);
+extern void rpcSetResultCacheCapacity(unsigned long bytes);
+
+/*
+ * Threads of a client that make the same call at the same time share a
+ * single request: the first one makes it, and the others wait for it and get
+ * a copy of its outputs (or its error). Location lookups are always shared
+ * this way, and so are calls of pure functions, and of functions declared
+ * idempotent with rpcDeclareIdempotent, with the same input values. Streamed
+ * calls are never shared. rpcCoalescedCalls gives the number of calls and
+ * lookups answered by another thread's request.
+ */
+extern int rpcDeclareIdempotent(char* name, int* argTypes);
+extern unsigned long rpcCoalescedCalls();
+
+/*
+ * Cached calls of pure or idempotent functions can be hedged with
+ * rpcSetHedging: a call still unanswered at the specified percentile of the
+ * latencies of its last calls is sent to the next server known to support it
+ * as well, and the first response wins. The budget is the percentage of
+ * calls that may be sent twice, which bounds the extra load on the servers.
+ * A percentile of zero (the default) disables hedging, and rpcHedgedCalls
+ * gives the number of calls that were hedged.
+ */
+extern void rpcSetHedging(unsigned int percentile, unsigned int budget);
+extern unsigned long rpcHedgedCalls();
+
+/*
+ * Cached calls skip servers that keep failing: once half of the last
+ * requests to a server failed to connect or lost the connection, its
+ * circuit breaker opens, and calls go straight to the next server known to
+ * support the function. After a second, a single call probes the server
+ * again, closing the breaker if it succeeds. Moving on to another server
+ * after a failure is a retry, and rpcSetRetryBudget sets the percentage of
+ * calls that may be retried (20 by default, in bursts of up to ten), so
+ * failing servers cannot multiply the load on the others. Errors returned
+ * by the function itself are never retried. Calls the budget or the open
+ * breakers keep from every server fail right away, and the servers stay
+ * known, so an outage costs no requests to the binder.
+ */
+extern void rpcSetRetryBudget(unsigned int budget);
+
+/*
+ * rpcSubscribe keeps the servers of cached calls up to date: from then on, a
+ * cached call that asks the binder for the servers of a function subscribes
+ * to it, and the binder pushes every server added or removed afterwards, so
+ * new servers take calls right away and removed ones are never tried. The
+ * changes are read by a thread of the library, over the connection to the
+ * binder, and if that connection is lost the servers are asked for again.
+ * The binder must support subscriptions. Subscribed or not, the cached calls
+ * of a thread start at each of the servers in turn, spreading them over all
+ * of the servers.
+ */
+extern int rpcSubscribe();
+
+/*
+ * Servers of cached calls that are not subscribed to are revalidated with the
+ * binder once they are older than the period set with rpcSetRevalidation (in
+ * milliseconds, five seconds by default): the next cached call names the
+ * generation of the servers it has, and the binder only sends them again if
+ * they changed since, so servers added later take calls as well. A period of
+ * zero keeps the servers until none of them can take a call.
+ */
+extern void rpcSetRevalidation(unsigned int milliseconds);
+
+/*
+ * rpcPrefetch asks the binder for the servers of many functions in a single
+ * request (the functions are given by parallel arrays of names and argument
+ * types), so the first cached call of each of them goes straight to a
+ * server. Functions already known are left out, and those without servers
+ * are looked up again by their first call. Once subscribed, the functions
+ * are subscribed to as well. The binder must support batched lookups.
+ */
+extern int rpcPrefetch(char** names, int** argTypes, unsigned int count);
+
+/*
+ * rpcSetCacheSnapshot keeps the servers of cached calls in a file across
+ * runs of the client, so short-lived clients do not ask the binder for the
+ * servers of every function they call on every run. The file is mapped when
+ * set, the servers of a function are read from it the first time it is
+ * called, and they are revalidated with the binder as if fetched when the
+ * file was written (see rpcSetRevalidation). On exit, the file is replaced
+ * with the servers then known. Subscribed clients only write the file.
+ */
+extern int rpcSetCacheSnapshot(char* path);
 
 typedef int (*skeleton)(int *, void **);
 
+/*
+ * rpcRegisterBatch registers many functions with the binder in a single
+ * request, instead of one request per function, so servers with many
+ * functions come online quickly. Functions with a time to live are
+ * registered as with rpcRegisterPure. It returns zero once the binder took
+ * every function, setting the result of each to what rpcRegister would have
+ * returned for it, or an error if it took none of them. The binder must
+ * support batched registration.
+ */
+typedef struct rpc_registration {
+    char* name;
+    int* argTypes;
+    skeleton f;
+    unsigned int ttl;   /* zero unless the function is pure */
+    int result;         /* set by rpcRegisterBatch */
+} rpc_registration;
+
+extern int rpcRegisterBatch(rpc_registration* functions, unsigned int count);
+
 extern int rpcInit();
 extern int rpcCall(char* name, int* argTypes, void** args);
 extern int rpcCacheCall(char* name, int* argTypes, void** args);
+extern int rpcPrepare(char* name, int* argTypes, rpc_prepared** call);
+extern int rpcCallPrepared(rpc_prepared* call, void** args);
+extern void rpcReleasePrepared(rpc_prepared* call);
 extern int rpcRegister(char* name, int* argTypes, skeleton f);
+extern int rpcRegisterPure(char* name, int* argTypes, skeleton f, unsigned int ttl);
+extern int rpcRegisterCached(char* name, int* argTypes, skeleton f, unsigned int ttl);
 extern int rpcExecute();
 extern int rpcTerminate();
 
@@ -0,0 +1,332 @@
+#pragma once
+
+/*
+rpccall.h
+
+Typed C++ client stubs over rpc.h.
+
+The signature of a call is spelled out as template arguments, so the argument types array is a compile time
+constant and the values are checked by the compiler rather than passed through a void* array:
+
+    int result;
+    int status = rpc::call<rpc::Out<int>, rpc::In<int>, rpc::In<int>>("f0", result, 5, 10);
+
+    long values[11];
+    status = rpc::call<rpc::InOut<long[11]>>("f3", values);
+
+Calls made repeatedly are prepared once and then only encode the argument values (see rpcPrepare):
+
+    rpc_prepared* f0;
+    rpc::prepare<rpc::Out<int>, rpc::In<int>, rpc::In<int>>("f0", &f0);
+    status = rpc::callPrepared<rpc::Out<int>, rpc::In<int>, rpc::In<int>>(f0, result, 5, 10);
+
+Each signature also gets its own marshaller, which writes and reads the arguments with the stream method of
+their type directly (see rpc_marshaller), so a typed call skips the per-argument interpretation of the
+argument types.  Servers can register skeletons with the marshaller of their signature as well, which
+is what the stubs generated by rpcgen (see rpcgen.cpp) do.  Only scalars and fixed-length arrays of the
+rpc types are supported; the flagged argument kinds of rpc.h (variable-length, streamed, packed) go
+through rpcCall as before.
+*/
+
+#include "rpc.h"
+#include "bstream.h"
+#include "constants.h"
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// The alignment of every argument in the storage of a request (a cache line, as for the generic path).
+#define MARSHALLER_ALIGNMENT 64
+
+// Writes and reads the argument values of a single signature, replacing the generic (argument type driven)
+// marshalling of execute requests and responses.  All follow the format of the specified protocol version.
+struct rpc_marshaller {
+    // Writes the argument values of the request (client).
+    void (*writeRequest)(BinaryStream& stream, void** args, unsigned int version);
+
+    // Reads the argument values of the request into the storage, pointing the arguments at it (server).
+    // Outputs the request does not carry are zeroed.
+    void (*readRequest)(BinaryStream& stream, void** args, char* storage, unsigned int version);
+
+    // Writes the argument values of the response (server).
+    void (*writeResponse)(BinaryStream& stream, void** args, unsigned int version);
+
+    // Reads the argument values of the response, after its name and argument types if the version has them (client).
+    void (*readResponse)(BinaryStream& stream, void** args, unsigned int version);
+
+    // The number of bytes of storage readRequest needs (aligned to MARSHALLER_ALIGNMENT).
+    size_t storage;
+};
+
+// Performs a call of a remote procedure command, marshalling the arguments with the marshaller.
+extern int rpcCallMarshalled(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller);
+
+// Performs a cached call of a remote procedure command, marshalling the arguments with the marshaller.
+extern int rpcCacheCallMarshalled(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller);
+
+// Prepares calls of a remote procedure command, marshalling the arguments with the marshaller (see rpcPrepare).
+extern int rpcPrepareMarshalled(char* name, int* argTypes, const rpc_marshaller* marshaller, rpc_prepared** call);
+
+// Registers the skeleton of a remote procedure command, marshalling requests with exactly its argument types with the marshaller.
+extern int rpcRegisterMarshalled(char* name, int* argTypes, skeleton f, const rpc_marshaller* marshaller);
+
+namespace rpc {
+
+    //--------------------------------------------------------------------------------------
+    // Mapping of the C types to the rpc types
+
+    template <typename T> struct value_type;
+
+    template <> struct value_type<char> {
+        static constexpr int code = ARG_CHAR;
+        static void write(BinaryStream& stream, const char* values, int count) { stream.writeChar(values, count); }
+        static void read(BinaryStream& stream, char* values, int count) { stream.readChar(values, count); }
+    };
+
+    template <> struct value_type<short> {
+        static constexpr int code = ARG_SHORT;
+        static void write(BinaryStream& stream, const short* values, int count) { stream.writeInt16(const_cast<short*>(values), count); }
+        static void read(BinaryStream& stream, short* values, int count) { stream.readInt16(values, count); }
+    };
+
+    template <> struct value_type<int> {
+        static constexpr int code = ARG_INT;
+        static void write(BinaryStream& stream, const int* values, int count) { stream.writeInt32(const_cast<int*>(values), count); }
+        static void read(BinaryStream& stream, int* values, int count) { stream.readInt32(values, count); }
+    };
+
+    template <> struct value_type<long> {
+        static constexpr int code = ARG_LONG;
+        static void write(BinaryStream& stream, const long* values, int count) { stream.writeInt64(const_cast<long*>(values), count); }
+        static void read(BinaryStream& stream, long* values, int count) { stream.readInt64(values, count); }
+    };
+
+    template <> struct value_type<double> {
+        static constexpr int code = ARG_DOUBLE;
+        static void write(BinaryStream& stream, const double* values, int count) { stream.writeDouble(const_cast<double*>(values), count); }
+        static void read(BinaryStream& stream, double* values, int count) { stream.readDouble(values, count); }
+    };
+
+    template <> struct value_type<float> {
+        static constexpr int code = ARG_FLOAT;
+        static void write(BinaryStream& stream, const float* values, int count) { stream.writeFloat(const_cast<float*>(values), count); }
+        static void read(BinaryStream& stream, float* values, int count) { stream.readFloat(values, count); }
+    };
+
+    // Splits an argument type into its element type and array length (zero for scalars).
+    template <typename T> struct shape {
+        typedef T element;
+        static constexpr unsigned int length = 0;
+        static constexpr unsigned int count = 1;
+    };
+
+    template <typename T, size_t N> struct shape<T[N]> {
+        static_assert(N <= 65535, "rpc arrays hold at most 65535 elements");
+
+        typedef T element;
+        static constexpr unsigned int length = N;
+        static constexpr unsigned int count = N;
+    };
+
+    //--------------------------------------------------------------------------------------
+    // Argument directions
+
+    // Describes an argument of type T (a scalar or fixed-length array) sent in the specified directions.
+    template <typename T, bool Input, bool Output> struct argument {
+        typedef typename shape<T>::element element;
+
+        static constexpr bool input = Input;
+        static constexpr bool output = Output;
+        static constexpr int argType = (Input ? (1 << ARG_INPUT) : 0) | (Output ? (1 << ARG_OUTPUT) : 0) |
+            (value_type<element>::code << 16) | shape<T>::length;
+
+        // The bytes of storage of the value on the server
+        static constexpr size_t size = shape<T>::count * sizeof(element);
+        static constexpr size_t storage = (size + MARSHALLER_ALIGNMENT - 1) / MARSHALLER_ALIGNMENT * MARSHALLER_ALIGNMENT;
+
+        // Writes the value, if the request of the version carries it.
+        static void writeRequest(BinaryStream& stream, void* value, unsigned int version) {
+            if (version >= PROTOCOL_V2 && !Input) {
+                return;
+            }
+            value_type<element>::write(stream, (const element*) value, shape<T>::count);
+        }
+
+        // Reads the value into the storage, if the request of the version carries it.
+        static void readRequest(BinaryStream& stream, void* value, unsigned int version) {
+            if (version >= PROTOCOL_V2 && !Input) {
+                memset(value, 0, size);
+                return;
+            }
+            value_type<element>::read(stream, (element*) value, shape<T>::count);
+        }
+
+        // Writes the value, if the response of the version carries it.
+        static void writeResponse(BinaryStream& stream, void* value, unsigned int version) {
+            if (version >= PROTOCOL_V2 && !Output) {
+                return;
+            }
+            value_type<element>::write(stream, (const element*) value, shape<T>::count);
+        }
+
+        // Reads the value, if the response of the version carries it.  Responses that echo
+        // every argument have the inputs skipped, as the caller may not expect them to change.
+        static void readResponse(BinaryStream& stream, void* value, unsigned int version) {
+            if (Output) {
+                value_type<element>::read(stream, (element*) value, shape<T>::count);
+            }
+            else if (version < PROTOCOL_V2) {
+                std::vector<element> skipped(shape<T>::count);
+                value_type<element>::read(stream, &skipped.front(), shape<T>::count);
+            }
+        }
+    };
+
+    // An argument only sent to the server.
+    template <typename T> struct In : argument<T, true, false> {
+        typedef const T& param;
+        static void* pointer(param value) { return const_cast<void*>((const void*) &value); }
+    };
+
+    // An argument only returned by the server.
+    template <typename T> struct Out : argument<T, false, true> {
+        typedef T& param;
+        static void* pointer(param value) { return (void*) &value; }
+    };
+
+    // An argument sent to the server and returned by it.
+    template <typename T> struct InOut : argument<T, true, true> {
+        typedef T& param;
+        static void* pointer(param value) { return (void*) &value; }
+    };
+
+    //--------------------------------------------------------------------------------------
+    // Signatures
+
+    // Provides the argument types of the signature as a compile time constant (terminated by zero).
+    template <typename... A> struct signature {
+        static constexpr unsigned int size = sizeof...(A);
+        static constexpr int argTypes[sizeof...(A) + 1] = { A::argType..., 0 };
+    };
+
+    template <typename... A> constexpr int signature<A...>::argTypes[sizeof...(A) + 1];
+
+    namespace detail {
+        // Each of these recurses over the arguments, so the compiler unrolls them into straight-line code.
+
+        template <unsigned int I>
+        void writeRequest(BinaryStream&, void**, unsigned int) {}
+
+        template <unsigned int I, typename First, typename... Rest>
+        void writeRequest(BinaryStream& stream, void** args, unsigned int version) {
+            First::writeRequest(stream, args[I], version);
+            writeRequest<I + 1, Rest...>(stream, args, version);
+        }
+
+        template <unsigned int I>
+        void readRequest(BinaryStream&, void**, char*, unsigned int) {}
+
+        template <unsigned int I, typename First, typename... Rest>
+        void readRequest(BinaryStream& stream, void** args, char* storage, unsigned int version) {
+            args[I] = (void*) storage;
+            First::readRequest(stream, args[I], version);
+            readRequest<I + 1, Rest...>(stream, args, storage + First::storage, version);
+        }
+
+        template <unsigned int I>
+        void writeResponse(BinaryStream&, void**, unsigned int) {}
+
+        template <unsigned int I, typename First, typename... Rest>
+        void writeResponse(BinaryStream& stream, void** args, unsigned int version) {
+            First::writeResponse(stream, args[I], version);
+            writeResponse<I + 1, Rest...>(stream, args, version);
+        }
+
+        template <unsigned int I>
+        void readResponse(BinaryStream&, void**, unsigned int) {}
+
+        template <unsigned int I, typename First, typename... Rest>
+        void readResponse(BinaryStream& stream, void** args, unsigned int version) {
+            First::readResponse(stream, args[I], version);
+            readResponse<I + 1, Rest...>(stream, args, version);
+        }
+
+        template <typename... A> struct storage;
+
+        template <> struct storage<> {
+            static constexpr size_t value = 0;
+        };
+
+        template <typename First, typename... Rest> struct storage<First, Rest...> {
+            static constexpr size_t value = First::storage + storage<Rest...>::value;
+        };
+    }
+
+    // Provides the marshaller of the signature, unrolled over its arguments.
+    template <typename... A> struct marshal {
+        static void writeRequest(BinaryStream& stream, void** args, unsigned int version) {
+            detail::writeRequest<0, A...>(stream, args, version);
+        }
+
+        static void readRequest(BinaryStream& stream, void** args, char* storage, unsigned int version) {
+            detail::readRequest<0, A...>(stream, args, storage, version);
+        }
+
+        static void writeResponse(BinaryStream& stream, void** args, unsigned int version) {
+            detail::writeResponse<0, A...>(stream, args, version);
+        }
+
+        static void readResponse(BinaryStream& stream, void** args, unsigned int version) {
+            detail::readResponse<0, A...>(stream, args, version);
+        }
+
+        static const rpc_marshaller marshaller;
+    };
+
+    template <typename... A> const rpc_marshaller marshal<A...>::marshaller = {
+        &marshal<A...>::writeRequest, &marshal<A...>::readRequest,
+        &marshal<A...>::writeResponse, &marshal<A...>::readResponse,
+        detail::storage<A...>::value
+    };
+
+    //--------------------------------------------------------------------------------------
+    // Calls
+
+    // Performs a call of the remote procedure command with the signature (see rpcCall).
+    template <typename... A>
+    int call(const char* name, typename A::param... values) {
+        // The library may rewrite the argument types, so it gets a copy of the constant
+        int argTypes[] = { A::argType..., 0 };
+        void* args[] = { A::pointer(values)..., NULL };
+        return rpcCallMarshalled(const_cast<char*>(name), argTypes, args, &marshal<A...>::marshaller);
+    }
+
+    // Performs a cached call of the remote procedure command with the signature (see rpcCacheCall).
+    template <typename... A>
+    int cacheCall(const char* name, typename A::param... values) {
+        int argTypes[] = { A::argType..., 0 };
+        void* args[] = { A::pointer(values)..., NULL };
+        return rpcCacheCallMarshalled(const_cast<char*>(name), argTypes, args, &marshal<A...>::marshaller);
+    }
+
+    // Prepares calls of the remote procedure command with the signature (see rpcPrepare).
+    template <typename... A>
+    int prepare(const char* name, rpc_prepared** call) {
+        return rpcPrepareMarshalled(const_cast<char*>(name), const_cast<int*>(signature<A...>::argTypes), &marshal<A...>::marshaller, call);
+    }
+
+    // Performs a call prepared with the same signature by prepare (see rpcCallPrepared).
+    template <typename... A>
+    int callPrepared(rpc_prepared* call, typename A::param... values) {
+        void* args[] = { A::pointer(values)..., NULL };
+        return rpcCallPrepared(call, args);
+    }
+
+    // Registers the skeleton of the remote procedure command with the signature (see rpcRegister).
+    template <typename... A>
+    int registerSkeleton(const char* name, skeleton f) {
+        // The server keeps a pointer to the argument types, so they are the constant of the signature
+        return rpcRegisterMarshalled(const_cast<char*>(name), const_cast<int*>(signature<A...>::argTypes), f, &marshal<A...>::marshaller);
+    }
+}
@@ -5,159 +5,319 @@
 #include "conversion.h"
 #include "bstream.h"
 #include "rpcinfo.h"
-
+#include "packing.h"
+#include "rpccall.h"
+#include "memo.h"
+#include "flight.h"
+#include "breaker.h"
+#include "channel.h"
+#include "servicecache.h"
+#include "snapshot.h"
+#include "routing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/select.h>
 #include <unistd.h>
+#include <vector>
 
 using namespace std;
 
-// A cached list of services similar to the one known by the binder.
-static map<rpc_info, list<function_info>> m_serviceMap;
+// The connection to the binder, shared by the threads of the client, and the servers known to support each
+// signature (fetched from the binder by cached calls).
+static BinderChannel m_binder;
+static ServiceCache m_services;
+
+// The servers known by earlier runs of the client (see rpcSetCacheSnapshot), and whether the cache is written back on exit.
+static ServiceSnapshot m_snapshot;
+static pthread_once_t m_snapshotOnce = PTHREAD_ONCE_INIT;
+
+// The routing table published by the binder, if it runs on this host.
+static RoutingTable m_routing;
+
+// Whether cached calls subscribe to the changes of the servers they fetch (see rpcSubscribe), and the id of the
+// subscription of each signature (and the signature of each id).  The epoch counts the connections to the binder
+// lost, along with the subscriptions made over them.
+static atomic<bool> m_subscribed(false);
+static pthread_mutex_t m_subscriptionLock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, unsigned int> m_subscriptionIds;
+static vector<string> m_subscriptionSignatures;
+static atomic<unsigned int> m_binderEpoch(0);
+
+// The milliseconds after which the servers of a signature that are not subscribed to are revalidated with the binder
+// (zero if they never are).
+#define REVALIDATE_DEFAULT_MS 5000
+static atomic<unsigned int> m_revalidateAfter(REVALIDATE_DEFAULT_MS);
+
+// The state of the servers and signatures below is split in shards by the hash of their key, each with a lock
+// of its own, held to read or update it (never across a request).
+#define CLIENT_SHARDS 16
+template <typename State>
+struct state_shard {
+    pthread_mutex_t lock;
+    map<string, State> states;
+
+    state_shard() {
+        pthread_mutex_init(&lock, NULL);
+    }
+};
 
-// The connection socket to the binder.
-static int m_binderSocket = -1;
+// Gets the shard of the state of the key.
+template <typename State>
+state_shard<State>& shardOf(state_shard<State>* shards, const string& key) {
+    return shards[hash<string>()(key) % CLIENT_SHARDS];
+}
 
-//--------------------------------------------------------------------------------------
+// What we know of each server we talked to (keyed by "identifier:port"): the codecs it accepts, the function handles
+// it handed out in the epoch of its process (keyed by the exact signature they name, see signatureKey), and its
+// circuit breaker.
+struct server_state {
+    unsigned int codecs;
+    unsigned int epoch;
+    map<string, unsigned int> handles;
+    CircuitBreaker breaker;
+
+    server_state() : codecs(0), epoch(0) {}
+};
+static state_shard<server_state> m_servers[CLIENT_SHARDS];
+
+// The latencies (in microseconds) of the last calls of a signature, kept to hedge its later calls.
+#define HEDGE_WINDOW 64
+#define HEDGE_MIN_SAMPLES 16
+struct latency_window {
+    vector<unsigned int> samples;
+    unsigned int next;
+
+    latency_window() : next(0) {}
+};
+
+// What we know of each signature we called (keyed as by signatureKey): the time to live of the results of its function
+// once located (zero for functions that are not pure, see rpcRegisterPure), whether it was declared idempotent (see
+// rpcDeclareIdempotent), and its latencies.
+struct signature_state {
+    bool located;
+    unsigned int ttl;
+    bool idempotent;
+    latency_window latencies;
+
+    signature_state() : located(false), ttl(0), idempotent(false) {}
+};
+static state_shard<signature_state> m_signatures[CLIENT_SHARDS];
+
+// The results of calls to pure functions, split in shards by their hash.
+#define MEMO_SHARDS 16
+struct memo_shard {
+    pthread_mutex_t lock;
+    MemoCache cache;
+
+    memo_shard() : cache(MEMO_DEFAULT_CAPACITY / MEMO_SHARDS) {
+        pthread_mutex_init(&lock, NULL);
+    }
+};
+static memo_shard m_memo[MEMO_SHARDS];
+
+// The lookups of a server (by locateServer) and of the services (by fetchServices) of a signature, and the calls
+// of pure or idempotent functions (keyed by signature and inputs), made by several threads at once.
+static FlightGroup m_locateFlights;
+static FlightGroup m_fetchFlights;
+static FlightGroup m_callFlights;
+
+// A budget of extra requests: every call earns a percentage of a request, and the requests earned pile up to a burst.
+// It is kept in thousandths of a request, so it is updated without a lock.
+struct token_bucket {
+    atomic<long> tokens;
+    atomic<unsigned int> percentage;
+    long burst;
+
+    token_bucket(unsigned int percentage, long burst, long tokens) : tokens(tokens * 1000), percentage(percentage), burst(burst * 1000) {}
+
+    // Earns a call its share of the budget.
+    void earn() {
+        long earned = percentage * 10;
+        long current = tokens;
+        while (!tokens.compare_exchange_weak(current, min(current + earned, burst))) {
+        }
+    }
 
-// Establishes a connection with the binder.
-int binder_connect() {
-    // If we already have a connection, do not bother
-    if (m_binderSocket >= 0) {
-        return 0;
+    // Spends a request from the budget.  Returns false if there is none left.
+    bool spend() {
+        long current = tokens;
+        while (current >= 1000) {
+            if (tokens.compare_exchange_weak(current, current - 1000)) {
+                return true;
+            }
+        }
+        return false;
     }
+};
 
-    // Get socket address information
-    string binderAddress = getBinderAddress();
-    int binderPort = getBinderPort();
+// The percentile of the latencies after which a call is hedged (zero if calls are never hedged), the budget of
+// hedges (none until set), and the number of calls hedged.
+#define HEDGE_MAX_TOKENS 10
+static atomic<unsigned int> m_hedgePercentile(0);
+static token_bucket m_hedges(0, HEDGE_MAX_TOKENS, 0);
+static atomic<unsigned long> m_hedgedCalls(0);
 
-    // Open socket
-    m_binderSocket = socket_create(binderAddress, binderPort);
+// The budget of retries at another server once a server fails a call.
+#define RETRY_DEFAULT_BUDGET 20
+#define RETRY_MAX_TOKENS 10
+static token_bucket m_retries(RETRY_DEFAULT_BUDGET, RETRY_MAX_TOKENS, RETRY_MAX_TOKENS);
 
-    // If less than zero, we have binder socket failure
-    if (m_binderSocket < 0) {
-        return INIT_BINDER_SOCKET_ERROR;
-    }
+//--------------------------------------------------------------------------------------
 
-    // otherwise good.
-    return 0;
+// Returns the protocol version to use when talking to a server that understands the specified version.
+unsigned int negotiateVersion(unsigned int serverVersion) {
+    return serverVersion < PROTOCOL_CURRENT ? serverVersion : (unsigned int) PROTOCOL_CURRENT;
 }
 
-//--------------------------------------------------------------------------------------
-
 // Processes the execute response by reaidng the values into the buffer
-int processExecuteResponse(BinaryStream stream, int argTypes[], void * args[], unsigned int argTypesLength) {
-    stream.readInt32(argTypes, argTypesLength);
+int processExecuteResponse(BinaryStream& stream, int argTypes[], void * args[], unsigned int argTypesLength, unsigned int version, const rpc_marshaller* marshaller) {
+    // Directed responses do not echo the argument types
+    if (version < PROTOCOL_V2) {
+        stream.readInt32(argTypes, argTypesLength);
+    }
+
     // This read code is based on protocol.h / sendExecuteResponse
+    return readResponseArguments(stream, argTypes, args, version, marshaller);
+}
 
-    // Iterate through the arguments
-    for(unsigned int i = 0; i < argTypesLength - 1; i++) {
-        int argType = argTypes[i];
+// Returns the key of the exact signature (name and argument types, including flags and array lengths) of a request.
+string signatureKey(char* name, int* argTypes) {
+    string key(name);
+    key.push_back('\0');
+    key.append((const char*) argTypes, getArgTypesLength(argTypes) * sizeof(int));
+    return key;
+}
 
-        // if it is an output argument, then we do not need
-        // to send this back (empty stub is fine)
-        if (!isArgTypeOutput(argType)) {
+// Returns the index of the first streamed output at or after the specified index, or -1 if there is none.
+int nextStreamOutput(int* argTypes, int index) {
+    for (int i = index; argTypes[i] != 0; i++) {
+        if (isArgTypeStream(argTypes[i]) && isArgTypeOutput(argTypes[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Sends the elements of every streamed input in argument order, each followed by the end of the stream.
+// Only a single chunk is encoded at a time, and TCP flow control bounds how far ahead of the server we get.
+int sendStreamInputs(Protocol& handler, int* argTypes, void** args) {
+    int status = 0;
+
+    for (unsigned int i = 0; argTypes[i] != 0; i++) {
+        if (!isArgTypeStream(argTypes[i]) || !isArgTypeInput(argTypes[i])) {
             continue;
         }
 
-        int type = getArgType(argType);
-        short length = getArgTypeArrayLength(argType);
-
-        // We are working with a scalar, so we resolve it to a value in the array
-        if (length == 0) {
-            switch(type) {
-                case ARG_CHAR:
-                    *((char*)args[i]) = stream.readChar();
-                    break;
-                case ARG_SHORT:
-                    *((short*)args[i]) = stream.readInt16();
-                    break;
-                case ARG_INT:
-                    *((int*)args[i]) = stream.readInt32();
-                    break;
-                case ARG_LONG:
-                    *((long*)args[i]) = stream.readInt64();
-                    break;
-                case ARG_DOUBLE:
-                    *((double*)args[i]) = stream.readDouble();
-                    break;
-                case ARG_FLOAT:
-                    *((float*)args[i]) = stream.readFloat();
-                    break;
-                default:
-                    break;
+        rpc_array* array = (rpc_array*) args[i];
+        int size = type_sizeof(getArgType(argTypes[i]));
+        unsigned int perChunk = STREAM_CHUNK_SIZE / size;
+
+        for (unsigned int sent = 0; sent < array->length; sent += perChunk) {
+            unsigned int count = array->length - sent < perChunk ? array->length - sent : perChunk;
+            status = handler.sendChunk(argTypes[i], (char*) array->data + (size_t) sent * size, count);
+            if (status != 0) {
+                return SOCKET_SEND_ERROR;
             }
         }
-        else {
-            // We are working with an array, so read into the array object (based on length) for the execute parameters
-            switch(type) {
-                case ARG_CHAR:
-                    stream.readChar((char*)args[i], length);
-                    break;
-                case ARG_SHORT:
-                    stream.readInt16((short*)args[i], length);
-                    break;
-                case ARG_INT:
-                    stream.readInt32((int*)args[i], length);
-                    break;
-                case ARG_LONG:
-                    stream.readInt64((long*)args[i], length);
-                    break;
-                case ARG_DOUBLE:
-                    stream.readDouble((double*)args[i], length);
-                    break;
-                case ARG_FLOAT:
-                    stream.readFloat((float*)args[i], length);
-                    break;
-                default:
-                    break;
-            }
+
+        status = handler.sendChunkEnd();
+        if (status != 0) {
+            return SOCKET_SEND_ERROR;
         }
     }
     return 0;
 }
 
-// Sends an execute request to the server
-int sendExecuteRequest(int socketfd, char* name, int* argTypes, void** args) {
-    Protocol handler(socketfd);
-    int status = 0;
+// Reads a chunk of a streamed output straight into the array provided by the caller.
+int processStreamChunk(BinaryStream& stream, int argType, rpc_array* array) {
+    unsigned int count = stream.readUInt32();
 
-    // Send the execute command
-    status = handler.sendExecuteRequest(name, argTypes, args);
-    if (status != 0) {
-        return status;
+    // The server can never send more than the capacity we declared
+    if (array->length + count > array->capacity) {
+        return RECEIVE_INVALID_MESSAGE;
     }
 
+    int size = type_sizeof(getArgType(argType));
+    void* values = (char*) array->data + (size_t) array->length * size;
+    if (isArgTypePacked(argType)) {
+        int status = packing_decode(stream, getArgType(argType), values, count);
+        if (status != 0) {
+            return status;
+        }
+    }
+    else {
+        readValues(stream, getArgType(argType), values, count);
+    }
+    array->length += count;
+    return 0;
+}
+
+// Receives the response to an execute request sent over the connection (after the elements of its streamed
+// inputs), reading the outputs into the arguments.  On return the handle holds the one handed out by the server (if any).
+int receiveExecuteResponse(Protocol& handler, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int version, unsigned int& epoch, unsigned int& handle) {
+    int status = 0;
+
     // -----------------------
     // After sending the execute, we are now waiting for a respond from the server
     // The response will be of the form:
     // Length, Type, Message (contents)
+    // Streamed outputs arrive ahead of the response, so we keep reading until we get it.
     unsigned int length;
     MessageType type;
+    BinaryStream stream;
+    int output = nextStreamOutput(argTypes, 0);
+
+    while (true) {
+        // Get the length of the message.
+        status = handler.receiveMessageSize(length);
+        if (status < 0) {
+            return status;
+        }
 
-    // Get the length of the message.
-    status = handler.receiveMessageSize(length);
-    if (status < 0) {
-        return status;
-    }
+        // Get the type of the message.
+        status = handler.receiveMessageType(type);
+        if (status < 0) {
+            return status;
+        }
 
-    // Get the type of the message.
-    status = handler.receiveMessageType(type);
-    if (status < 0) {
-        return status;
-    }
+        // Using the length, we allocate a buffer for the reply contents
+        stream = BinaryStream(length);
 
-    // Using the length, we allocate a buffer for the reply contents
-    BinaryStream stream(length);
+        // Get the reply contents
+        status = handler.receiveMessage(length, stream.str());
+        if (status < 0) {
+            return status;
+        }
 
-    // Get the reply contents
-    status = handler.receiveMessage(length, stream.str());
-    if (status < 0) {
-        return status;
+        if (type != STREAM_CHUNK && type != STREAM_END) {
+            break;
+        }
+
+        // Stream messages always belong to the current streamed output
+        if (output < 0) {
+            return RECEIVE_INVALID_MESSAGE_TYPE;
+        }
+
+        if (type == STREAM_END) {
+            output = nextStreamOutput(argTypes, output + 1);
+            continue;
+        }
+
+        status = processStreamChunk(stream, argTypes[output], (rpc_array*) args[output]);
+        if (status != 0) {
+            return status;
+        }
     }
 
     // If type is failure, then we need to exit
@@ -166,18 +326,30 @@ int sendExecuteRequest(int socketfd, char* name, int* argTypes, void** args) {
         return returnCode;
     }
 
+    // Get number of arguments & compute length
+    unsigned int argCount = getArgTypesLength(argTypes);
+
+    // Directed responses only contain the outputs, possibly followed by a handle for later requests
+    if (version >= PROTOCOL_V2 && type == EXECUTE_DIRECTED_SUCCESS) {
+        status = processExecuteResponse(stream, argTypes, args, argCount, version, marshaller);
+        handle = 0;
+        if (status == 0 && stream.position() < stream.size()) {
+            epoch = stream.readUInt32();
+            handle = stream.readVarUInt32();
+        }
+        return status;
+    }
+
     // We are expecting a success response, if we do not get it
     // then the message type is invalid
-    if (type != EXECUTE_SUCCESS) {
+    if (version >= PROTOCOL_V2 || type != EXECUTE_SUCCESS) {
         return RECEIVE_INVALID_MESSAGE_TYPE;
     }
 
-    // Get number of arguments & compute length
-    unsigned int argCount = getArgTypesLength(argTypes);
     string functionName = stream.readString();
 
     if(strcmp(functionName.c_str(), name) == 0) {
-        processExecuteResponse(stream, argTypes, args, argCount);
+        processExecuteResponse(stream, argTypes, args, argCount, version, marshaller);
     }
     else {
         return RECEIVE_INVALID_COMMAND_NAME;
@@ -186,113 +358,509 @@ int sendExecuteRequest(int socketfd, char* name, int* argTypes, void** args) {
     return 0;
 }
 
-// Send an execute request to the next most available server in the list.
-int sendExecuteToAvailable(char * name, int*argTypes, void**args, list<function_info> &services) {
+// Sends an execute request over the connection, by the handle if it is non-zero, followed by the elements of its streamed inputs.
+int sendExecute(Protocol& handler, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int version, unsigned int epoch, unsigned int handle) {
+    // Send the execute command (by handle if we have one)
     int status = 0;
+    if (handle != 0) {
+        status = handler.sendExecuteHandle(epoch, handle, argTypes, args, version, marshaller);
+    }
+    else {
+        status = handler.sendExecuteRequest(name, argTypes, args, version, marshaller);
+    }
+    if (status != 0) {
+        return status;
+    }
 
-    // We need to find a server from the list to send execute to, so send it.
-    for (function_info service : services) {
+    // The elements of streamed inputs follow the execute message
+    return sendStreamInputs(handler, argTypes, args);
+}
 
-        // Open socket with the service, if fails, move to the next one
-        int socketfd = socket_create(service.server_identifier, service.port);
-        if(socketfd < 0) {
+// Exchanges an execute request for its response over the connection. The request is sent by
+// the handle if it is non-zero, and on return it holds the handle handed out by the server (if any).
+int exchangeExecute(Protocol& handler, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int version, unsigned int& epoch, unsigned int& handle) {
+    int status = sendExecute(handler, name, argTypes, args, marshaller, version, epoch, handle);
+    if (status != 0) {
+        return status;
+    }
+
+    return receiveExecuteResponse(handler, name, argTypes, args, marshaller, version, epoch, handle);
+}
+
+// Determines if the status is the failure of the connection, rather than of the call.
+bool isConnectionFailure(int status) {
+    return status == SOCKET_SEND_ERROR || status == SOCKET_RECEIVE_ERROR || status == SOCKET_CONNECTION_ERROR || status == SOCKET_UNKNOWN_HOST;
+}
+
+// Checks that the argument types can be sent to a server of the protocol version, pointing them at a copy
+// without the flags the server predates (in unpacked) if needed.  Sets whether any argument is streamed.
+int checkArguments(int*& argTypes, vector<int>& unpacked, unsigned int version, bool& streamed) {
+    // Packing only changes how arrays travel, so servers that predate it get them unpacked
+    if (version < PROTOCOL_V6) {
+        unpacked.assign(argTypes, argTypes + getArgTypesLength(argTypes));
+        for (unsigned int i = 0; i < unpacked.size(); i++) {
+            unpacked[i] &= ~(1 << ARG_PACKED);
+        }
+        argTypes = &unpacked.front();
+    }
+
+    streamed = false;
+    for (unsigned int i = 0; argTypes[i] != 0; i++) {
+        // Variable-length arrays can only be sent to servers that understand them
+        if (version < PROTOCOL_V3 && isArgTypeVariable(argTypes[i])) {
+            return EXECUTE_UNSUPPORTED_ARGUMENT;
+        }
+
+        // Streamed arrays as well, and they are either an input or an output
+        if (isArgTypeStream(argTypes[i])) {
+            if (version < PROTOCOL_V4 || isArgTypeInput(argTypes[i]) == isArgTypeOutput(argTypes[i])) {
+                return EXECUTE_UNSUPPORTED_ARGUMENT;
+            }
+            streamed = true;
+        }
+    }
+    return 0;
+}
+
+// Empties the streamed outputs, which are filled as the chunks arrive.
+void resetStreamOutputs(int* argTypes, void** args) {
+    for (int i = nextStreamOutput(argTypes, 0); i >= 0; i = nextStreamOutput(argTypes, i + 1)) {
+        ((rpc_array*) args[i])->length = 0;
+    }
+}
+
+// Gets the delay (in microseconds) after which a call of the signature is hedged, at the hedging percentile of its latencies,
+// earning the call its share of the budget.  Returns false if calls are not hedged, or too few of them were seen yet.
+bool hedgeDelay(const string& signature, unsigned int& delay) {
+    unsigned int percentile = m_hedgePercentile;
+    if (percentile == 0) {
+        return false;
+    }
+    m_hedges.earn();
+
+    state_shard<signature_state>& shard = shardOf(m_signatures, signature);
+    pthread_mutex_lock(&shard.lock);
+    vector<unsigned int> samples = shard.states[signature].latencies.samples;
+    pthread_mutex_unlock(&shard.lock);
+
+    if (samples.size() < HEDGE_MIN_SAMPLES) {
+        return false;
+    }
+
+    size_t rank = (samples.size() - 1) * percentile / 100;
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    delay = samples[rank];
+    return true;
+}
+
+// Spends a hedge from the budget.  Returns false if there is none left.
+bool spendHedge() {
+    if (!m_hedges.spend()) {
+        return false;
+    }
+    m_hedgedCalls++;
+    return true;
+}
+
+// Records the latency (in microseconds) of a call of the signature, replacing the oldest one once the window is full.
+void recordLatency(const string& signature, unsigned int latency) {
+    state_shard<signature_state>& shard = shardOf(m_signatures, signature);
+    pthread_mutex_lock(&shard.lock);
+    latency_window& window = shard.states[signature].latencies;
+    if (window.samples.size() < HEDGE_WINDOW) {
+        window.samples.push_back(latency);
+    }
+    else {
+        window.samples[window.next] = latency;
+        window.next = (window.next + 1) % HEDGE_WINDOW;
+    }
+    pthread_mutex_unlock(&shard.lock);
+}
+
+// Determines if the circuit breaker of the server lets a request through.
+bool allowServer(const string& server) {
+    state_shard<server_state>& shard = shardOf(m_servers, server);
+    pthread_mutex_lock(&shard.lock);
+    bool allowed = shard.states[server].breaker.allow(chrono::steady_clock::now());
+    pthread_mutex_unlock(&shard.lock);
+    return allowed;
+}
+
+// Records whether the connection to the server failed in its circuit breaker.
+void recordServer(const string& server, bool failed) {
+    state_shard<server_state>& shard = shardOf(m_servers, server);
+    pthread_mutex_lock(&shard.lock);
+    shard.states[server].breaker.record(failed, chrono::steady_clock::now());
+    pthread_mutex_unlock(&shard.lock);
+}
+
+// Gets the codecs accepted by the server.
+unsigned int serverCodecs(const string& server) {
+    state_shard<server_state>& shard = shardOf(m_servers, server);
+    pthread_mutex_lock(&shard.lock);
+    unsigned int codecs = shard.states[server].codecs;
+    pthread_mutex_unlock(&shard.lock);
+    return codecs;
+}
+
+// Records the codecs accepted by the server.
+void recordCodecs(const string& server, unsigned int codecs) {
+    state_shard<server_state>& shard = shardOf(m_servers, server);
+    pthread_mutex_lock(&shard.lock);
+    shard.states[server].codecs = codecs;
+    pthread_mutex_unlock(&shard.lock);
+}
+
+// An execute request sent to a server, awaiting its response over the connection.
+struct execute_attempt {
+    int socketfd;
+    string server;                      // "identifier:port"
+    unsigned int version;
+    Protocol handler;
+
+    int* argTypes;                      // as sent, without the flags the server predates
+    vector<int> unpacked;
+    bool streamed;
+    string signature;
+    unsigned int epoch;
+    unsigned int handle;
+
+    execute_attempt() : socketfd(-1), version(PROTOCOL_V1), handler(-1), argTypes(NULL), streamed(false), epoch(0), handle(0) {}
+};
+
+// Sends an execute request to the server over the connection, without waiting for the response.
+int beginExecute(execute_attempt& attempt, int socketfd, const string& server, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int version) {
+    attempt.socketfd = socketfd;
+    attempt.server = server;
+    attempt.version = version;
+    attempt.handler = Protocol(socketfd);
+    attempt.argTypes = argTypes;
+    attempt.epoch = 0;
+    attempt.handle = 0;
+
+    int status = checkArguments(attempt.argTypes, attempt.unpacked, version, attempt.streamed);
+    if (status != 0) {
+        return status;
+    }
+    resetStreamOutputs(attempt.argTypes, args);
+
+    // Servers that understand compression learn our codecs from the request, and we learn theirs
+    // from the first reply, so only requests after that one can be compressed.
+    state_shard<server_state>& shard = shardOf(m_servers, server);
+    pthread_mutex_lock(&shard.lock);
+    server_state& known = shard.states[server];
+    if (version >= PROTOCOL_V5) {
+        attempt.handler.advertiseCodecs();
+        attempt.handler.setPeerCodecs(known.codecs);
+    }
+
+    // Compact connections have smaller frame headers, and leave out the name and argument types once the
+    // server handed out a handle for them.  Streamed requests are always sent by name, as they cannot be retried.
+    if (version >= PROTOCOL_V7) {
+        attempt.handler.useCompactFrames();
+
+        attempt.signature = signatureKey(name, attempt.argTypes);
+        if (!attempt.streamed && known.handles.count(attempt.signature) != 0) {
+            attempt.epoch = known.epoch;
+            attempt.handle = known.handles[attempt.signature];
+        }
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return sendExecute(attempt.handler, name, attempt.argTypes, args, marshaller, version, attempt.epoch, attempt.handle);
+}
+
+// Receives the response to the execute request, reading the outputs into the arguments.
+int finishExecute(execute_attempt& attempt, char* name, void** args, const rpc_marshaller* marshaller) {
+    unsigned int& handle = attempt.handle;
+    int status = receiveExecuteResponse(attempt.handler, name, attempt.argTypes, args, marshaller, attempt.version, attempt.epoch, handle);
+
+    // The server restarted since it handed out the handle, so forget them all and ask by name
+    state_shard<server_state>& shard = shardOf(m_servers, attempt.server);
+    if (status == EXECUTE_UNKNOWN_HANDLE && handle != 0) {
+        pthread_mutex_lock(&shard.lock);
+        shard.states[attempt.server].handles.clear();
+        pthread_mutex_unlock(&shard.lock);
+
+        handle = 0;
+        status = exchangeExecute(attempt.handler, name, attempt.argTypes, args, marshaller, attempt.version, attempt.epoch, handle);
+    }
+
+    pthread_mutex_lock(&shard.lock);
+    server_state& known = shard.states[attempt.server];
+    known.breaker.record(isConnectionFailure(status), chrono::steady_clock::now());
+    if (attempt.version >= PROTOCOL_V5) {
+        known.codecs = attempt.handler.getPeerCodecs();
+    }
+
+    if (handle != 0) {
+        if (known.epoch != attempt.epoch) {
+            known.epoch = attempt.epoch;
+            known.handles.clear();
+        }
+        known.handles[attempt.signature] = handle;
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    return status;
+}
+
+// Sends an execute request to the server
+int sendExecuteRequest(int socketfd, const string& server, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int version) {
+    execute_attempt attempt;
+    int status = beginExecute(attempt, socketfd, server, name, argTypes, args, marshaller, version);
+    if (status != 0) {
+        return status;
+    }
+
+    return finishExecute(attempt, name, args, marshaller);
+}
+
+// Walks the servers of a list once, from any of them on, wrapping around at the end of the list.
+struct service_cursor {
+    const list<function_info>& services;
+    list<function_info>::const_iterator next;
+    size_t remaining;
+    bool tried;         // whether a request was sent (or attempted) to any of the servers taken
+    bool skipped;       // whether any server taken was skipped, as its circuit breaker was open
+
+    service_cursor(const list<function_info>& services, size_t start)
+        : services(services), next(services.begin()), remaining(services.size()), tried(false), skipped(false) {
+        if (remaining > 0) {
+            advance(next, start % remaining);
+        }
+    }
+
+    // Determines if every server was taken.
+    bool done() const {
+        return remaining == 0;
+    }
+
+    // Takes the next server.
+    const function_info& take() {
+        const function_info& service = *next;
+        if (++next == services.end()) {
+            next = services.begin();
+        }
+        remaining--;
+        return service;
+    }
+};
+
+// The calls made by each thread so far, so its calls start at each of the servers in turn.
+static thread_local unsigned int m_rotation = 0;
+
+// Opens a connection with the next server of the list (from next on) that accepts the execute request, and sends it.
+// Servers whose circuit breaker is open are skipped, and every attempt after the first one of the call is a retry,
+// made only if the retry budget allows it.  Returns FUNCTION_BACKING_OFF if the budget ran out, or every server was
+// skipped without any being tried, and FUNCTION_NOT_AVAILABLE if the servers tried could not take the request.
+int beginExecuteAtNext(execute_attempt& attempt, service_cursor& next, bool& retry, char* name, int* argTypes, void** args, const rpc_marshaller* marshaller) {
+    while (!next.done()) {
+        const function_info& service = next.take();
+        string server = service.server_identifier + ":" + to_string(service.port);
+        if (!allowServer(server)) {
+            next.skipped = true;
             continue;
         }
 
-        // We opened a connection, now send the execute request.
-        status = sendExecuteRequest(socketfd, name, argTypes, args);
+        if (retry && !m_retries.spend()) {
+            return FUNCTION_BACKING_OFF;
+        }
+        retry = true;
+        next.tried = true;
 
-        // Close the socket as we are done with this regardless of success
-        close(socketfd);
+        // Open socket with the service, if fails, move to the next one
+        int socketfd = socket_create(service.server_identifier, service.port);
+        if (socketfd < 0) {
+            recordServer(server, true);
+            continue;
+        }
 
-        // if success, finish, if not successful continue to next server
+        int status = beginExecute(attempt, socketfd, server, name, argTypes, args, marshaller, negotiateVersion(service.version));
         if (status == 0) {
             return 0;
         }
+        recordServer(server, isConnectionFailure(status));
+        close(socketfd);
     }
+    return (next.skipped && !next.tried) ? FUNCTION_BACKING_OFF : FUNCTION_NOT_AVAILABLE;
+}
 
-    return -1;
+// Waits up to the delay (in microseconds) for the response to the execute request.  Returns true if it started to arrive.
+bool awaitResponse(execute_attempt& attempt, unsigned int delay) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(attempt.socketfd, &readable);
+
+    struct timeval timeout;
+    timeout.tv_sec = delay / 1000000;
+    timeout.tv_usec = delay % 1000000;
+    return select(attempt.socketfd + 1, &readable, NULL, NULL, &timeout) != 0;
 }
 
-//--------------------------------------------------------------------------------------
+// Determines if the status is that of a server unable to take the call, which another server may take.
+bool isServerUnavailable(int status) {
+    return isConnectionFailure(status) || status == EXECUTE_UNKNOWN_SKELETON || status == RECEIVED_TERMINATED;
+}
+
+// Receives the response to whichever of the execute requests answers first (or the other one, if that server is unavailable).
+int finishFirstExecute(execute_attempt& first, execute_attempt& second, char* name, void** args, const rpc_marshaller* marshaller) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(first.socketfd, &readable);
+    FD_SET(second.socketfd, &readable);
+
+    int highest = first.socketfd > second.socketfd ? first.socketfd : second.socketfd;
+    bool secondFirst = select(highest + 1, &readable, NULL, NULL, NULL) > 0 && !FD_ISSET(first.socketfd, &readable);
+
+    execute_attempt& winner = secondFirst ? second : first;
+    execute_attempt& loser = secondFirst ? first : second;
+
+    int status = finishExecute(winner, name, args, marshaller);
+    if (isServerUnavailable(status)) {
+        status = finishExecute(loser, name, args, marshaller);
+    }
+    return status;
+}
 
-// Process a location response returned from the server
-int processLocationResponse(string &server_identifier, unsigned short &port) {
-    Protocol handler(m_binderSocket);
+// Send an execute request to the next most available server in the list (FUNCTION_NOT_AVAILABLE if none of them could take it,
+// FUNCTION_BACKING_OFF if the retry budget or the circuit breakers kept it from them), starting from the next server in turn, so the calls are spread over all of them.
+// Hedged requests are sent to the next server as well if the first one does not answer within the hedging delay of
+// the signature, taking whichever response arrives first.  Retries are made as set by beginExecuteAtNext.
+int sendExecuteToAvailable(char * name, int*argTypes, void**args, const rpc_marshaller* marshaller, const list<function_info> &services, bool hedged, bool& retry) {
     int status = 0;
+    string signature = hedged ? signatureKey(name, argTypes) : string();
+    unsigned int delay = 0;
+    hedged = hedged && hedgeDelay(signature, delay);
 
-    // We are receiving a message of the format
-    // LENGTH, TYPE, MESSAGE (contents)
-    MessageType msgType;
-    unsigned int messageSize;
+    // We need to find a server from the list to send execute to, so send it.
+    service_cursor next(services, m_rotation++);
+    while (true) {
+        execute_attempt first;
+        status = beginExecuteAtNext(first, next, retry, name, argTypes, args, marshaller);
+        if (status != 0) {
+            return status;
+        }
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+        // The request is duplicated only if the next server is left, and the budget allows it
+        // (hedges have a budget of their own, so they are not retries)
+        execute_attempt second;
+        bool hedgeRetry = false;
+        if (hedged && !first.streamed && !next.done() && !awaitResponse(first, delay) && spendHedge() &&
+            beginExecuteAtNext(second, next, hedgeRetry, name, argTypes, args, marshaller) == 0) {
+            status = finishFirstExecute(first, second, name, args, marshaller);
+            close(second.socketfd);
+        }
+        else {
+            status = finishExecute(first, name, args, marshaller);
+        }
 
-    // Get the length of the message
-    status = handler.receiveMessageSize(messageSize);
-    if(status < 0) {
-        return status;
+        // Close the socket as we are done with this regardless of success
+        close(first.socketfd);
+
+        // if success, finish, if the server could not take the call continue to next server
+        if (status == 0 && !signature.empty()) {
+            recordLatency(signature, chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count());
+        }
+        if (!isServerUnavailable(status)) {
+            return status;
+        }
     }
+}
 
-    // Get the type of the message
-    status = handler.receiveMessageType(msgType);
-    if(status < 0) {
+//--------------------------------------------------------------------------------------
+
+// Exchanges a request with the binder for the contents of its response, returning the reason code of failure responses.
+int exchangeBinder(const binder_request& request, MessageType success, MessageType failure, string& response) {
+    MessageType type;
+    int status = m_binder.exchange(request, type, response);
+    if (status < 0) {
         return status;
     }
 
-    // Allocate a buffer to store the message.
-    BinaryStream stream(messageSize);
+    // Responses always have contents, if the binder does not provide them, we have a problem
+    if (response.empty()) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
 
-    // Receive the message contents
-    status = handler.receiveMessage(messageSize, stream.str());
-    if(status < 0) {
-        return status;
+    // If failure, get error code and return
+    if (type == failure) {
+        BinaryStream stream(&response[0], response.size());
+        int errorCode = stream.readInt32();
+        return errorCode;
     }
 
-    // if failure, get reasonCode and exit
-    if (msgType == LOC_FAILURE) {
-        int reasonCode = stream.readInt32();
-        return reasonCode;
+    // The binder tells us the locations we have are still current
+    if (type == LOC_CACHE_NOT_MODIFIED) {
+        return LOCATION_NOT_MODIFIED;
     }
 
-    // We expect a SUCCESS message, if it is not this, then
-    // we have an invalid message type
-    if (msgType != LOC_SUCCESS) {
+    // If response is not a success, it is invalid
+    if (type != success) {
         return RECEIVE_INVALID_MESSAGE_TYPE;
     }
+    return 0;
+}
 
+// Process a location response returned from the binder
+int processLocationResponse(BinaryStream& stream, string &server_identifier, unsigned short &port, unsigned int &version, unsigned int &ttl) {
     // Parse the message
     server_identifier = stream.readString();
     port = stream.readUInt16();
 
+    // Binders that predate protocol versions do not send one
+    version = PROTOCOL_V1;
+    if (stream.position() < stream.size()) {
+        version = stream.readUInt32();
+    }
+
+    // Nor a time to live, and neither do servers that predate pure functions
+    ttl = 0;
+    if (stream.position() < stream.size()) {
+        ttl = stream.readUInt32();
+    }
+
     return 0;
 }
 
-// Performs a call of an remote procedure command with the specified arguments.
-int rpcCall(char* name, int* argTypes, void** args) {
+// Asks the binder for the location (server id, port and protocol version) of a server of the remote procedure command,
+// and the time to live of its results.  Threads asking for the same signature at once share the response.
+int locateServer(char* name, int* argTypes, string &server_identifier, unsigned short &port, unsigned int &version, unsigned int &ttl) {
+    string signature = signatureKey(name, argTypes);
     int status = 0;
+    string response;
 
-    // Send location request, if error, then exit
-    string command_name(name);
-
-    // Open connection to binder
-    status = binder_connect();
+    flight* lookup;
+    if (m_locateFlights.join(signature, lookup)) {
+        binder_request request = [&](Protocol& handler) { return handler.sendLocationRequest(name, argTypes); };
+        status = exchangeBinder(request, LOC_SUCCESS, LOC_FAILURE, response);
+        m_locateFlights.land(signature, lookup, status, response);
+    }
+    else {
+        status = m_locateFlights.wait(lookup, response);
+    }
 
-    // If error, return error code
     if (status != 0) {
         return status;
     }
 
-    // Open protocol handler and send location request with args
-    Protocol handler(m_binderSocket);
-    status = handler.sendLocationRequest(name, argTypes);
-    if(status < 0) {
-        return status;
-    }
+    // Process the incoming location response with server id, port and protocol version
+    BinaryStream stream(&response[0], response.size());
+    return processLocationResponse(stream, server_identifier, port, version, ttl);
+}
+
+// Performs a call of an remote procedure command at the server located by the binder.
+// Sets the time to live of the results of the function.
+int callLocated(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, unsigned int& ttl) {
+    int status = 0;
 
     string server_identifier;
     unsigned short port;
+    unsigned int version;
 
-    // Process the incoming location response with server id and port
-    status = processLocationResponse(server_identifier, port);
+    // Send location request, if error, then exit
+    status = locateServer(name, argTypes, server_identifier, port, version, ttl);
     if (status < 0) {
         return status;
     }
@@ -302,7 +870,8 @@ int rpcCall(char* name, int* argTypes, void** args) {
         int serverSocket = socket_create(server_identifier, port);
 
         // Send command to the server
-        status = sendExecuteRequest(serverSocket, name, argTypes, args);
+        string server = server_identifier + ":" + to_string(port);
+        status = sendExecuteRequest(serverSocket, server, name, argTypes, args, marshaller, negotiateVersion(version));
 
         // cleanup
         close(serverSocket);
@@ -313,140 +882,741 @@ int rpcCall(char* name, int* argTypes, void** args) {
 
 //--------------------------------------------------------------------------------------
 
-// Handle a location cache call
-int processLocationCacheCall(BinaryStream& stream, rpc_info &command) {
+// A call prepared by rpcPrepare: the server it was located at and the connection to it, the argument types
+// as sent to that server, and the prefix of its execute requests.  The prefix starts as the name and argument
+// types, and becomes the handle of the function once a server on a compact connection hands one out.
+struct rpc_prepared {
+    string name;
+    vector<int> argTypes;               // as passed to rpcPrepare
+    const rpc_marshaller* marshaller;
+
+    string server;                      // "identifier:port"
+    unsigned int version;
+    int socketfd;
+    Protocol handler;
+
+    vector<int> sentTypes;              // argTypes, without the flags the server predates
+    bool streamed;
+    BinaryStream prefix;
+    MessageType type;                   // the type of the execute requests
+    unsigned int epoch;
+    unsigned int handle;
+
+    rpc_prepared() : marshaller(NULL), version(PROTOCOL_V1), socketfd(-1), handler(-1), streamed(false), type(EXECUTE), epoch(0), handle(0) {}
+};
+
+// Encodes the prefix of the execute requests of the prepared call, by name or by handle (if non-zero).
+void encodePrefix(rpc_prepared* call) {
+    call->prefix = BinaryStream();
+    if (call->handle != 0) {
+        call->prefix.writeUInt32(call->epoch);
+        call->prefix.writeVarUInt32(call->handle);
+        call->type = EXECUTE_HANDLE;
+        return;
+    }
+
+    writeRequestPrefix(call->prefix, call->name, &call->sentTypes.front());
+    call->type = (call->version >= PROTOCOL_V2) ? EXECUTE_DIRECTED : EXECUTE;
+    if (call->streamed) {
+        call->type = EXECUTE_STREAMED;
+    }
+}
+
+// Closes the connection of the prepared call, if it has one.
+void disconnectPrepared(rpc_prepared* call) {
+    if (call->socketfd >= 0) {
+        close(call->socketfd);
+        call->socketfd = -1;
+    }
+}
+
+// Locates a server for the prepared call and connects to it, encoding the requests for its protocol version.
+int connectPrepared(rpc_prepared* call) {
+    int status = 0;
+    disconnectPrepared(call);
+
+    string server_identifier;
+    unsigned short port;
+    unsigned int version;
+    unsigned int ttl;
+    char* name = const_cast<char*>(call->name.c_str());
+
+    status = locateServer(name, &call->argTypes.front(), server_identifier, port, version, ttl);
+    if (status < 0) {
+        return status;
+    }
+
+    call->version = negotiateVersion(version);
+    call->server = server_identifier + ":" + to_string(port);
+
+    int* argTypes = &call->argTypes.front();
+    vector<int> unpacked;
+    status = checkArguments(argTypes, unpacked, call->version, call->streamed);
+    if (status != 0) {
+        return status;
+    }
+    call->sentTypes.assign(argTypes, argTypes + getArgTypesLength(argTypes));
+
+    call->socketfd = socket_create(server_identifier, port);
+    if (call->socketfd < 0) {
+        return SOCKET_CONNECTION_ERROR;
+    }
+
+    // The connection lasts, so the codecs and compact frames are set up once for all calls
+    call->handler = Protocol(call->socketfd);
+    if (call->version >= PROTOCOL_V5) {
+        call->handler.advertiseCodecs();
+
+        call->handler.setPeerCodecs(serverCodecs(call->server));
+    }
+    if (call->version >= PROTOCOL_V7) {
+        call->handler.useCompactFrames();
+    }
+
+    call->epoch = 0;
+    call->handle = 0;
+    encodePrefix(call);
+    return 0;
+}
+
+// Exchanges an execute request of the prepared call for its response over its connection.
+int exchangePrepared(rpc_prepared* call, void** args) {
+    int* argTypes = &call->sentTypes.front();
+    char* name = const_cast<char*>(call->name.c_str());
+    int status = 0;
+
+    resetStreamOutputs(argTypes, args);
+    status = call->handler.sendExecutePrepared(call->prefix, call->type, argTypes, args, call->version, call->marshaller);
+    if (status != 0) {
+        return status;
+    }
+
+    status = sendStreamInputs(call->handler, argTypes, args);
+    if (status != 0) {
+        return status;
+    }
+
+    // Streamed requests are always sent by name, as they cannot be retried
+    unsigned int handle = call->handle;
+    status = receiveExecuteResponse(call->handler, name, argTypes, args, call->marshaller, call->version, call->epoch, handle);
+    if (!call->streamed && handle != call->handle) {
+        call->handle = handle;
+        encodePrefix(call);
+    }
+    return status;
+}
+
+// Prepares calls of an remote procedure command with the specified argument types.
+int rpcPrepare(char* name, int* argTypes, rpc_prepared** call) {
+    return rpcPrepareMarshalled(name, argTypes, NULL, call);
+}
+
+// Prepares calls of an remote procedure command, marshalling the arguments with the marshaller (if any).
+int rpcPrepareMarshalled(char* name, int* argTypes, const rpc_marshaller* marshaller, rpc_prepared** call) {
+    rpc_prepared* prepared = new rpc_prepared();
+    prepared->name = name;
+    prepared->argTypes.assign(argTypes, argTypes + getArgTypesLength(argTypes));
+    prepared->marshaller = marshaller;
+
+    int status = connectPrepared(prepared);
+    if (status != 0) {
+        rpcReleasePrepared(prepared);
+        return status;
+    }
+
+    *call = prepared;
+    return 0;
+}
+
+// Performs a call prepared by rpcPrepare with the specified arguments.
+int rpcCallPrepared(rpc_prepared* call, void** args) {
+    int status = 0;
+
+    // The connection was lost by an earlier call, so locate a server again
+    bool reused = call->socketfd >= 0;
+    if (!reused) {
+        status = connectPrepared(call);
+        if (status != 0) {
+            return status;
+        }
+    }
+
+    status = exchangePrepared(call, args);
+
+    // The server restarted since it handed out the handle, so ask by name
+    if (status == EXECUTE_UNKNOWN_HANDLE && call->handle != 0) {
+        call->handle = 0;
+        encodePrefix(call);
+        status = exchangePrepared(call, args);
+    }
+
+    // The server may have closed the connection since the last call, so retry once on a new one
+    if (isConnectionFailure(status) && reused) {
+        status = connectPrepared(call);
+        if (status == 0) {
+            status = exchangePrepared(call, args);
+        }
+    }
+
+    if (call->version >= PROTOCOL_V5 && call->socketfd >= 0) {
+        recordCodecs(call->server, call->handler.getPeerCodecs());
+    }
+
+    // Servers close streamed connections after the response, and broken ones are of no further use
+    if (call->streamed || isConnectionFailure(status)) {
+        disconnectPrepared(call);
+    }
+    return status;
+}
+
+// Releases a call prepared by rpcPrepare, closing its connection.
+void rpcReleasePrepared(rpc_prepared* call) {
+    if (call == NULL) {
+        return;
+    }
+    disconnectPrepared(call);
+    delete call;
+}
+
+//--------------------------------------------------------------------------------------
+
+// Handle a location cache call, reading the servers and the generation of their list (zero if the binder predates them)
+int processLocationCacheCall(BinaryStream& stream, list<function_info> &services, unsigned int &generation) {
     unsigned int count = stream.readUInt32();
 
-    list<function_info> list;
+    services.clear();
     for (int i = 0; i < count; i++) {
         string server_identifier = stream.readString();
         unsigned short port = stream.readUInt16();
 
         // Add newly discovered supported server to the system
-        function_info service(server_identifier, port, &command);
-        list.push_back(service);
+        function_info service(server_identifier, port, NULL);
+        services.push_back(service);
+    }
+
+    // The protocol versions of the servers trail the list (binders that predate versions do not send them)
+    if (stream.position() < stream.size()) {
+        for (function_info &service : services) {
+            service.version = stream.readUInt32();
+        }
+    }
+
+    // Followed by the time to live of the function on each of them
+    if (stream.position() < stream.size()) {
+        for (function_info &service : services) {
+            service.ttl = stream.readUInt32();
+        }
+    }
+
+    // And the generation of the list
+    generation = 0;
+    if (stream.position() < stream.size()) {
+        generation = stream.readUInt32();
     }
 
-    m_serviceMap[command] = list;
     return 0;
 }
 
-// Performs a call of an remote procedure command with the specified arguments.
-// This command looks for previously known servers to perform the connection.
-int rpcCacheCall(char* name, int* argTypes, void** args) {
-    string command_name(name);
-    int status = 0;
+// Returns the time to live of the results of a function on all of the servers (zero if any of them says it is not pure).
+unsigned int servicesTtl(const list<function_info> &services) {
+    unsigned int ttl = services.empty() ? 0 : UINT_MAX;
+    for (const function_info &service : services) {
+        ttl = service.ttl < ttl ? service.ttl : ttl;
+    }
+    return ttl;
+}
 
-    // if it already exists in cache, use cache
-    rpc_info command(command_name, argTypes);
-    if(m_serviceMap.find(command) != m_serviceMap.end()) {
-        list<function_info> service = m_serviceMap[command];
-        status = sendExecuteToAvailable(name, argTypes, args, service);
+// Gets the id of the subscription of the signature, giving it one the first time.
+unsigned int subscriptionOf(const string& signature) {
+    pthread_mutex_lock(&m_subscriptionLock);
+    map<string, unsigned int>::iterator known = m_subscriptionIds.find(signature);
+    unsigned int subscription = m_subscriptionSignatures.size();
+    if (known != m_subscriptionIds.end()) {
+        subscription = known->second;
+    }
+    else {
+        m_subscriptionIds[signature] = subscription;
+        m_subscriptionSignatures.push_back(signature);
+    }
+    pthread_mutex_unlock(&m_subscriptionLock);
+    return subscription;
+}
 
-        if (status == 0) {
-            return 0;
+// Applies a change of the servers of a subscribed signature pushed by the binder to the cache.
+void applyServicesChanged(MessageType, BinaryStream& stream) {
+    unsigned int subscription = stream.readUInt32();
+    unsigned int generation = stream.readUInt32();
+    bool added = stream.readUInt32() != 0;
+    string server_identifier = stream.readString();
+    unsigned short port = stream.readUInt16();
+    unsigned int version = stream.readUInt32();
+    unsigned int ttl = stream.readUInt32();
+
+    pthread_mutex_lock(&m_subscriptionLock);
+    bool known = subscription < m_subscriptionSignatures.size();
+    string signature = known ? m_subscriptionSignatures[subscription] : string();
+    pthread_mutex_unlock(&m_subscriptionLock);
+
+    if (!known) {
+        return;
+    }
+
+    // A server that registered the function again replaces its earlier entry
+    m_services.apply(signature, generation, [&](list<function_info>& services) {
+        for (list<function_info>::iterator it = services.begin(); it != services.end(); ++it) {
+            if (it->server_identifier == server_identifier && it->port == port) {
+                services.erase(it);
+                break;
+            }
+        }
+
+        if (added) {
+            services.push_back(function_info(server_identifier, port, NULL, version, ttl));
         }
+    });
+}
+
+// Forgets the servers of every signature once the connection their subscriptions were made over is lost.
+void forgetSubscriptions() {
+    m_binderEpoch++;
+    m_services.clear();
+}
+
+// Returns when servers fetched now are due for revalidation (never, if they are subscribed to or the binder predates generations).
+chrono::steady_clock::time_point revalidationTime(bool subscribed, unsigned int generation) {
+    unsigned int after = m_revalidateAfter;
+    if (subscribed || generation == 0 || after == 0) {
+        return chrono::steady_clock::time_point::max();
     }
-    m_serviceMap.erase(command);
+    return chrono::steady_clock::now() + chrono::milliseconds(after);
+}
 
-    // else fetch new servers from binder
-    // send request
+// Fetches the servers supporting the remote procedure command from the binder into the cache, subscribing to their changes
+// if asked to (see rpcSubscribe).  Servers of the known generation (if not zero) are only fetched if their list changed since,
+// and are kept otherwise.  Unless subscribed, they are read from the routing table of the binder if it may answer (see routing.h).
+// Threads fetching the same signature (and generation) from the binder at once share the response.
+int fetchServices(char* name, int* argTypes, const string& signature, unsigned int known, bool routed, service_list &services) {
+    int status = 0;
+    string response;
+    bool subscribed = m_subscribed;
+    unsigned int epoch = m_binderEpoch;
+
+    list<function_info> routes;
+    unsigned int routeGeneration = 0;
+    if (routed && !subscribed && m_routing.find(routingKey(name, argTypes), routes, routeGeneration)) {
+        if (known != 0 && routeGeneration == known) {
+            m_services.renew(signature, services, revalidationTime(false, known));
+        }
+        else {
+            services = m_services.store(signature, routes, routeGeneration, revalidationTime(false, routeGeneration));
+        }
+        return 0;
+    }
 
-    status = binder_connect();
-    if (status != 0) {
-        return status;
+    string key = signature;
+    if (known != 0) {
+        key.append((const char*) &known, sizeof(known));
     }
 
-    // Use protocol handler to send a request for the location cache data
-    // based on the current rpc information
-    Protocol handler(m_binderSocket);
-    handler.sendLocationCacheRequest(command_name, argTypes);
+    flight* fetch;
+    if (m_fetchFlights.join(key, fetch)) {
+        // Use protocol handler to send a request for the location cache data
+        // based on the current rpc information
+        unsigned int subscription = subscribed ? subscriptionOf(signature) : 0;
+        binder_request request = [&](Protocol& handler) {
+            if (subscribed) {
+                return handler.sendSubscribe(string(name), argTypes, subscription);
+            }
+            if (known != 0) {
+                return handler.sendLocationCacheRevalidate(string(name), argTypes, known);
+            }
+            return handler.sendLocationCacheRequest(string(name), argTypes);
+        };
+        status = exchangeBinder(request, LOC_CACHE_SUCCESS, LOC_CACHE_FAILURE, response);
+        m_fetchFlights.land(key, fetch, status, response);
+    } else {
+        status = m_fetchFlights.wait(fetch, response);
+    }
 
-    // -----------------------
-    // After sending the execute, we are now waiting for a response from the server
-    // The response will be of the form:
-    // Length, Type, Message (contents)
-    unsigned int length;
-    MessageType type;
+    // The servers we have are current, so keep them for another while
+    if (status == LOCATION_NOT_MODIFIED) {
+        m_services.renew(signature, services, revalidationTime(subscribed, known));
+        return 0;
+    }
 
-    // Get the length of the message.
-    status = handler.receiveMessageSize(length);
-    if(status < 0) {
+    if (status != 0) {
         return status;
     }
 
-    // Get the type of the message.
-    status = handler.receiveMessageType(type);
-    if(status < 0) {
+    // Process the response from the location cache
+    list<function_info> fetched;
+    unsigned int generation = 0;
+    BinaryStream stream(&response[0], response.size());
+    status = processLocationCacheCall(stream, fetched, generation);
+    if (status < 0) {
         return status;
     }
 
-    // If the length is zero, that is invalid.  We need to receive some number of
-    // locations for this to work, and if the binder does not provide, we have a problem
-    if(length == 0) {
-        return RECEIVE_INVALID_MESSAGE;
+    services = m_services.store(signature, fetched, generation, revalidationTime(subscribed, generation));
+
+    // The subscription may have been made over a connection lost since (or subscribing started meanwhile), so the binder
+    // will not tell us about changes
+    if (m_subscribed && (!subscribed || m_binderEpoch != epoch)) {
+        m_services.remove(signature, services);
+    }
+    return 0;
+}
+
+// Takes the servers of the signature from the snapshot (see rpcSetCacheSnapshot) into the cache, due for revalidation once
+// they are as old as the revalidation period.  Subscribed clients fetch their lists from the binder.
+service_list loadSnapshot(const string& signature, unsigned int& generation, chrono::steady_clock::time_point& revalidate) {
+    list<function_info> services;
+    time_t age = 0;
+    if (m_subscribed || !m_snapshot.take(signature, services, generation, age)) {
+        return service_list();
+    }
+
+    revalidate = revalidationTime(false, generation);
+    if (revalidate != chrono::steady_clock::time_point::max()) {
+        chrono::milliseconds elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::seconds(age));
+        chrono::milliseconds after(m_revalidateAfter);
+        revalidate = chrono::steady_clock::now() + (elapsed < after ? after - elapsed : chrono::milliseconds(0));
+    }
+    return m_services.store(signature, services, generation, revalidate);
+}
+
+// Writes the servers of the cache to the snapshot on exit.
+void writeSnapshot() {
+    snapshot_entries entries;
+    m_services.visit([&](const string& signature, const service_list& services, unsigned int generation) {
+        // Lists of binders that predate generations cannot be revalidated
+        if (generation != 0 && !services->empty()) {
+            entries[signature] = make_pair(services, generation);
+        }
+    });
+    m_snapshot.write(entries);
+}
+
+// Writes the snapshot when the client exits.
+void registerSnapshotWriter() {
+    atexit(writeSnapshot);
+}
+
+// Performs a call of an remote procedure command at one of the servers known to support it (fetched from the binder if needed),
+// hedging it if it can be sent twice.  Sets the time to live of the results of the function.
+int callCached(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, bool hedged, unsigned int& ttl) {
+    string signature = signatureKey(name, argTypes);
+    int status = 0;
+
+    // Every call earns its share of the retry budget, and its first attempt is free
+    m_retries.earn();
+    bool retry = false;
+
+    // if it already exists in cache (or the snapshot), use cache (asking the binder whether it is still current once it is due)
+    unsigned int generation = 0;
+    chrono::steady_clock::time_point revalidate;
+    service_list services = m_services.find(signature, generation, revalidate);
+    if (!services) {
+        services = loadSnapshot(signature, generation, revalidate);
+    }
+    if (services && revalidate != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= revalidate) {
+        status = fetchServices(name, argTypes, signature, generation, true, services);
+        if (status != 0) {
+            return status;
+        }
     }
 
-    // Using the length, we allocate a buffer for the reply contents
-    char buffer[length];
-    status = handler.receiveMessage(length, buffer);
-    if(status < 0) {
+    bool failed = false;
+    if (services) {
+        ttl = servicesTtl(*services);
+        status = sendExecuteToAvailable(name, argTypes, args, marshaller, *services, hedged, retry);
+
+        // Servers that took the call answered for all of them, and servers the call was kept from (by the retry budget
+        // or their circuit breakers) are no reason to doubt the list
+        if (status != FUNCTION_NOT_AVAILABLE) {
+            return status;
+        }
+
+        // None of the servers could take the call, so forget them, unless another thread fetched them again meanwhile
+        m_services.remove(signature, services);
+        failed = true;
+    }
+
+    // else fetch new servers from binder (over the socket if the servers we had failed, as the routing table may lag behind)
+    status = fetchServices(name, argTypes, signature, 0, !failed, services);
+    if (status != 0) {
         return status;
     }
 
-    // Create binary stream handler
-    BinaryStream stream(buffer, length);
+    // Function exists, get list of services and try to execute the command on once of them
+    ttl = servicesTtl(*services);
+    status = sendExecuteToAvailable(name, argTypes, args, marshaller, *services, hedged, retry);
 
-    // If failure, get error code and return
-    if (type == LOC_CACHE_FAILURE) {
-        int errorCode = stream.readInt32();
-        return errorCode;
+    return status;
+}
+
+// Fetches the servers of the functions not in the cache yet from the binder in a single request, subscribing to their
+// changes if asked to (see rpcSubscribe).
+int rpcPrefetch(char** names, int** argTypes, unsigned int count) {
+    bool subscribed = m_subscribed;
+    unsigned int epoch = m_binderEpoch;
+
+    // Functions whose servers we have already are left out
+    vector<rpc_info> functions;
+    vector<string> signatures;
+    vector<unsigned int> subscriptions;
+    for (unsigned int i = 0; i < count; i++) {
+        string signature = signatureKey(names[i], argTypes[i]);
+        unsigned int generation = 0;
+        chrono::steady_clock::time_point revalidate;
+        if (m_services.find(signature, generation, revalidate)) {
+            continue;
+        }
+
+        functions.push_back(rpc_info(string(names[i]), argTypes[i]));
+        signatures.push_back(signature);
+        subscriptions.push_back(subscribed ? subscriptionOf(signature) : 0);
     }
 
-    // If response is not a cache success, it is invalid
-    if(type != LOC_CACHE_SUCCESS) {
-        return RECEIVE_INVALID_MESSAGE_TYPE;
+    if (functions.empty()) {
+        return 0;
     }
 
-    // Process the response from the location cache
-    status = processLocationCacheCall(stream, command);
-    if(status < 0) {
+    string response;
+    binder_request request = [&](Protocol& handler) { return handler.sendLocationCacheBatch(functions, subscribed, subscriptions); };
+    int status = exchangeBinder(request, LOC_CACHE_BATCH_SUCCESS, LOC_CACHE_FAILURE, response);
+    if (status != 0) {
         return status;
     }
 
-    // Search the newly updated cache for the function.  If it does not exist
-    // Then function is not available (404)
-    if (m_serviceMap.find(command) == m_serviceMap.end()) {
-        return FUNCTION_NOT_AVAILABLE;
+    // The servers of each function follow in order, in the format of a single response
+    BinaryStream stream(&response[0], response.size());
+    if (stream.readUInt32() != functions.size()) {
+        return RECEIVE_INVALID_MESSAGE;
     }
 
-    // Function exists, get list of services and try to execute the command on once of them
-    list<function_info> services = m_serviceMap[command];
-    status = sendExecuteToAvailable(name, argTypes, args, services);
+    for (unsigned int i = 0; i < functions.size(); i++) {
+        list<function_info> fetched;
+        unsigned int generation = 0;
+        status = processLocationCacheCall(stream, fetched, generation);
+        if (status < 0) {
+            return status;
+        }
 
-    return status;
+        // Functions without servers are fetched again by the first call of them, and subscriptions made over a
+        // connection lost since are not kept (see fetchServices)
+        if (fetched.empty() || (m_subscribed && (!subscribed || m_binderEpoch != epoch))) {
+            continue;
+        }
+        m_services.store(signatures[i], fetched, generation, revalidationTime(subscribed, generation));
+    }
+    return 0;
+}
+
+// Sets the milliseconds after which the servers of cached calls are revalidated with the binder (zero if they never are).
+void rpcSetRevalidation(unsigned int milliseconds) {
+    m_revalidateAfter = milliseconds;
+}
+
+// Keeps the servers of cached calls in the snapshot at the path across runs of the client.
+int rpcSetCacheSnapshot(char* path) {
+    if (path == NULL || *path == '\0') {
+        return ERROR;
+    }
+
+    m_snapshot.open(string(path));
+    pthread_once(&m_snapshotOnce, registerSnapshotWriter);
+    return 0;
+}
+
+// Subscribes cached calls to the changes of the servers of their functions, pushed by the binder.
+int rpcSubscribe() {
+    if (!m_subscribed.exchange(true)) {
+        // Lists fetched before were not subscribed to
+        m_binder.listen(applyServicesChanged, forgetSubscriptions);
+        m_services.clear();
+    }
+    return 0;
 }
 
 //--------------------------------------------------------------------------------------
 
 // Send an termination request to the binder.
 int rpcTerminate() {
-    int status = 0;
+    // It is possible that binder has already shutdown, in which case we fail to connect
+    return m_binder.notify([](Protocol& handler) { return handler.sendTerminate(); });
+}
+
+//--------------------------------------------------------------------------------------
 
-    // Are we connected? if not, connect so we can tell it to shutdown
-    if (m_binderSocket < 0) {
-        status = binder_connect();
+// Determines if the results of calls with the argument types can be memoized or shared (streamed ones cannot).
+bool isMemoizable(int* argTypes) {
+    for (unsigned int i = 0; argTypes[i] != 0; i++) {
+        if (isArgTypeStream(argTypes[i])) {
+            return false;
+        }
     }
+    return true;
+}
 
-    // Failure status while connecting to binder, return status
-    // It is possible that binder has already shutdown
-    if (status != 0) {
-        return status;
+// Performs a call of an remote procedure command located by the binder (or from the cache of locations, if cached),
+// answering calls of pure functions with inputs seen before from the memo cache.  Threads making the same call of a
+// pure or idempotent function at once share a single request, and cached calls of them may be hedged.
+int callMemoized(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller, bool cached) {
+    string signature = signatureKey(name, argTypes);
+
+    state_shard<signature_state>& shard = shardOf(m_signatures, signature);
+    pthread_mutex_lock(&shard.lock);
+    signature_state& known = shard.states[signature];
+    bool located = known.located;
+    bool pure = located && known.ttl > 0;
+    bool idempotent = known.idempotent;
+    pthread_mutex_unlock(&shard.lock);
+
+    // The outputs may overwrite the inputs, so they are encoded ahead of the call, unless the function is known not to be pure
+    bool memoizable = isMemoizable(argTypes) && (!located || pure);
+    bool shared = isMemoizable(argTypes) && (pure || idempotent);
+    string inputs;
+    uint64_t hash = 0;
+    if (memoizable || shared) {
+        BinaryStream stream;
+        writeRequestArguments(stream, argTypes, args, PROTOCOL_CURRENT, NULL);
+        inputs.assign(stream.buffer(), stream.size());
+        hash = MemoCache::hash(signature, inputs);
     }
 
-    // Open the protocol so we can tell binder to terminate
-    Protocol handler(m_binderSocket);
-    status = handler.sendTerminate();
+    // The outputs are kept as a response of the current version would carry them
+    string outputs;
+    if (memoizable && located) {
+        memo_shard& memo = m_memo[hash % MEMO_SHARDS];
+        pthread_mutex_lock(&memo.lock);
+        bool found = memo.cache.find(hash, signature, inputs, outputs);
+        pthread_mutex_unlock(&memo.lock);
+
+        BinaryStream stream(&outputs[0], outputs.size());
+        if (found && readResponseArguments(stream, argTypes, args, PROTOCOL_CURRENT, NULL) == 0) {
+            return 0;
+        }
+    }
 
+    // The same call is in flight, so wait for its outputs
+    flight* call = NULL;
+    string key = signature + inputs;
+    if (shared && !m_callFlights.join(key, call)) {
+        int status = m_callFlights.wait(call, outputs);
+        if (status != 0) {
+            return status;
+        }
+
+        BinaryStream stream(&outputs[0], outputs.size());
+        return readResponseArguments(stream, argTypes, args, PROTOCOL_CURRENT, NULL);
+    }
+
+    unsigned int ttl = 0;
+    int status = cached ? callCached(name, argTypes, args, marshaller, shared, ttl) : callLocated(name, argTypes, args, marshaller, ttl);
+
+    outputs.clear();
+    if (status == 0 && ((memoizable && ttl > 0) || shared)) {
+        BinaryStream stream;
+        writeResponseArguments(stream, argTypes, args, PROTOCOL_CURRENT, NULL);
+        outputs.assign(stream.buffer(), stream.size());
+    }
+
+    if (status == 0) {
+        pthread_mutex_lock(&shard.lock);
+        signature_state& state = shard.states[signature];
+        state.located = true;
+        state.ttl = ttl;
+        pthread_mutex_unlock(&shard.lock);
+    }
+
+    if (status == 0 && memoizable && ttl > 0) {
+        memo_shard& memo = m_memo[hash % MEMO_SHARDS];
+        pthread_mutex_lock(&memo.lock);
+        memo.cache.store(hash, signature, inputs, outputs, ttl);
+        pthread_mutex_unlock(&memo.lock);
+    }
+
+    if (call != NULL) {
+        m_callFlights.land(key, call, status, outputs);
+    }
     return status;
-}
\ No newline at end of file
+}
+
+// Gets the counters of the memo cache.
+void rpcMemoStats(rpc_memo_stats* stats) {
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->evictions = 0;
+    for (unsigned int i = 0; i < MEMO_SHARDS; i++) {
+        pthread_mutex_lock(&m_memo[i].lock);
+        rpc_memo_stats shard = m_memo[i].cache.stats();
+        pthread_mutex_unlock(&m_memo[i].lock);
+
+        stats->hits += shard.hits;
+        stats->misses += shard.misses;
+        stats->evictions += shard.evictions;
+    }
+}
+
+// Sets the number of bytes the memo cache holds at most (zero disables it).
+void rpcSetMemoCapacity(unsigned long bytes) {
+    for (unsigned int i = 0; i < MEMO_SHARDS; i++) {
+        pthread_mutex_lock(&m_memo[i].lock);
+        m_memo[i].cache.setCapacity(bytes / MEMO_SHARDS);
+        pthread_mutex_unlock(&m_memo[i].lock);
+    }
+}
+
+// Declares calls of an remote procedure command with the specified argument types idempotent, so threads making the same call at once share it.
+int rpcDeclareIdempotent(char* name, int* argTypes) {
+    string signature = signatureKey(name, argTypes);
+    state_shard<signature_state>& shard = shardOf(m_signatures, signature);
+    pthread_mutex_lock(&shard.lock);
+    shard.states[signature].idempotent = true;
+    pthread_mutex_unlock(&shard.lock);
+    return 0;
+}
+
+// Gets the number of calls and location lookups answered by the request of another thread.
+unsigned long rpcCoalescedCalls() {
+    return m_locateFlights.coalesced() + m_fetchFlights.coalesced() + m_callFlights.coalesced();
+}
+
+// Hedges cached calls of pure or idempotent functions still unanswered at the percentile of their latencies (zero disables
+// hedging), sending at most the specified percentage of calls twice.
+void rpcSetHedging(unsigned int percentile, unsigned int budget) {
+    m_hedgePercentile = percentile < 100 ? percentile : 100;
+    m_hedges.percentage = budget;
+}
+
+// Sets the percentage of calls that may be retried at another server once a server fails them.
+void rpcSetRetryBudget(unsigned int budget) {
+    m_retries.percentage = budget;
+}
+
+// Gets the number of calls that were hedged.
+unsigned long rpcHedgedCalls() {
+    return m_hedgedCalls;
+}
+
+// Performs a call of an remote procedure command with the specified arguments.
+int rpcCall(char* name, int* argTypes, void** args) {
+    return rpcCallMarshalled(name, argTypes, args, NULL);
+}
+
+// Performs a call of an remote procedure command, marshalling the arguments with the marshaller (if any).
+int rpcCallMarshalled(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller) {
+    return callMemoized(name, argTypes, args, marshaller, false);
+}
+
+// Performs a call of an remote procedure command with the specified arguments.
+// This command looks for previously known servers to perform the connection.
+int rpcCacheCall(char* name, int* argTypes, void** args) {
+    return rpcCacheCallMarshalled(name, argTypes, args, NULL);
+}
+
+// Performs a cached call of an remote procedure command, marshalling the arguments with the marshaller (if any).
+int rpcCacheCallMarshalled(char* name, int* argTypes, void** args, const rpc_marshaller* marshaller) {
+    return callMemoized(name, argTypes, args, marshaller, true);
+}
@@ -0,0 +1,607 @@
+/*
+ * rpcgen.cpp
+ *
+ * Generates typed client stubs, server skeletons and registration code from an interface definition.
+ *
+ * An interface definition (.idl) lists the remote procedure commands, one per declaration:
+ *
+ *     // Adds the two values
+ *     f0(out int result, in int a, in int b);
+ *
+ *     // Sorts the values in place
+ *     f3(inout long[11] values);
+ *
+ * Every argument has a direction (in, out or inout), a type (char, short, int, long, float or double)
+ * with an optional fixed array length, and a name.  Comments are written as in C++.
+ *
+ * For module.idl this writes:
+ *
+ *   module_rpc.h    the argument types of every command, its marshaller (straight-line code that reads
+ *                   and writes each argument with the stream method of its type, see rpc_marshaller), the
+ *                   client stub in namespace module, and the prototype of the implementation the server
+ *                   provides in namespace module::server, along with module::server::registerAll
+ *   module_rpc.cpp  the skeletons and registerAll, which registers every skeleton with its marshaller
+ *
+ * Usage: rpcgen <module.idl> [output directory]
+ */
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The alignment of every argument in the storage of a request (see MARSHALLER_ALIGNMENT)
+#define STORAGE_ALIGNMENT 64
+
+// The largest length of an array argument (the low 16 bits of its argument type)
+#define MAX_ARRAY_LENGTH 65535
+
+//--------------------------------------------------------------------------------------
+// Interface definition
+
+// Describes an rpc type of the interface definition.
+struct idl_type {
+    string code;      // the macro of the rpc type (rpc.h)
+    string method;    // the suffix of the stream methods (bstream.h)
+    unsigned int size;
+    bool fixed;       // whether its values have a fixed size on the wire
+};
+
+// Describes an argument of a command.
+struct idl_argument {
+    bool input;
+    bool output;
+    string type;
+    unsigned int length;  // zero for scalars
+    string name;
+};
+
+// Describes a command.
+struct idl_function {
+    string name;
+    vector<idl_argument> arguments;
+};
+
+static map<string, idl_type> m_types;
+
+// Fills the table of rpc types.
+static void initTypes() {
+    m_types["char"]   = idl_type { "ARG_CHAR",   "Char",   1, true };
+    m_types["short"]  = idl_type { "ARG_SHORT",  "Int16",  2, true };
+    m_types["int"]    = idl_type { "ARG_INT",    "Int32",  4, true };
+    m_types["long"]   = idl_type { "ARG_LONG",   "Int64",  8, true };
+    m_types["float"]  = idl_type { "ARG_FLOAT",  "Float",  4, false };
+    m_types["double"] = idl_type { "ARG_DOUBLE", "Double", 8, false };
+}
+
+//--------------------------------------------------------------------------------------
+// Parsing
+
+// Splits an interface definition into tokens, keeping track of the line each starts on.
+class Lexer {
+  public:
+    Lexer(const string& file, const string& text) : m_file(file), m_text(text), m_position(0), m_line(1), m_tokenLine(1) {}
+
+    // Returns the next token (identifier, number or punctuation), or an empty string at the end.
+    string next() {
+        skipSpace();
+        m_tokenLine = m_line;
+        if (m_position >= m_text.size()) {
+            return "";
+        }
+
+        size_t start = m_position;
+        char c = m_text[m_position];
+        if (isalnum(c) || c == '_') {
+            while (m_position < m_text.size() && (isalnum(m_text[m_position]) || m_text[m_position] == '_')) {
+                m_position++;
+            }
+        }
+        else {
+            m_position++;
+        }
+        return m_text.substr(start, m_position - start);
+    }
+
+    // Returns the next token, failing if it is not the expected one.
+    void expect(const string& expected) {
+        string token = next();
+        if (token != expected) {
+            fail("expected '" + expected + "' but found '" + describe(token) + "'");
+        }
+    }
+
+    // Reports an error at the line of the last token and exits.
+    void fail(const string& message) {
+        cerr << m_file << ":" << m_tokenLine << ": error: " << message << endl;
+        exit(1);
+    }
+
+    static string describe(const string& token) {
+        return token.empty() ? "end of file" : token;
+    }
+
+  private:
+    // Skips whitespace and comments.
+    void skipSpace() {
+        while (m_position < m_text.size()) {
+            char c = m_text[m_position];
+            if (c == '\n') {
+                m_line++;
+                m_position++;
+            }
+            else if (isspace(c)) {
+                m_position++;
+            }
+            else if (m_text.compare(m_position, 2, "//") == 0) {
+                while (m_position < m_text.size() && m_text[m_position] != '\n') {
+                    m_position++;
+                }
+            }
+            else if (m_text.compare(m_position, 2, "/*") == 0) {
+                size_t end = m_text.find("*/", m_position + 2);
+                if (end == string::npos) {
+                    m_tokenLine = m_line;
+                    fail("unterminated comment");
+                }
+                for (; m_position < end + 2; m_position++) {
+                    if (m_text[m_position] == '\n') {
+                        m_line++;
+                    }
+                }
+            }
+            else {
+                break;
+            }
+        }
+    }
+
+    string m_file;
+    string m_text;
+    size_t m_position;
+    int m_line;
+    int m_tokenLine;
+};
+
+// Determines if the token is a valid C++ identifier.
+static bool isIdentifier(const string& token) {
+    if (token.empty() || isdigit(token[0])) {
+        return false;
+    }
+    for (size_t i = 0; i < token.size(); i++) {
+        if (!isalnum(token[i]) && token[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses a single argument, starting at its direction.
+static idl_argument parseArgument(Lexer& lexer, const string& direction) {
+    idl_argument argument;
+    if (direction != "in" && direction != "out" && direction != "inout") {
+        lexer.fail("expected an argument direction (in, out or inout) but found '" + Lexer::describe(direction) + "'");
+    }
+    argument.input = (direction != "out");
+    argument.output = (direction != "in");
+
+    argument.type = lexer.next();
+    if (m_types.find(argument.type) == m_types.end()) {
+        lexer.fail("unknown argument type '" + Lexer::describe(argument.type) + "'");
+    }
+
+    argument.length = 0;
+    string token = lexer.next();
+    if (token == "[") {
+        string length = lexer.next();
+        long value = (length.empty() || !isdigit(length[0])) ? -1 : strtol(length.c_str(), NULL, 10);
+        if (value < 1 || value > MAX_ARRAY_LENGTH || length.find_first_not_of("0123456789") != string::npos) {
+            lexer.fail("array length must be between 1 and 65535, found '" + Lexer::describe(length) + "'");
+        }
+        argument.length = (unsigned int) value;
+        lexer.expect("]");
+        token = lexer.next();
+    }
+
+    if (!isIdentifier(token)) {
+        lexer.fail("expected an argument name but found '" + Lexer::describe(token) + "'");
+    }
+    argument.name = token;
+    return argument;
+}
+
+// Parses the commands of the interface definition.
+static vector<idl_function> parse(const string& file, const string& text) {
+    Lexer lexer(file, text);
+    vector<idl_function> functions;
+    map<string, bool> names;
+
+    for (string token = lexer.next(); !token.empty(); token = lexer.next()) {
+        idl_function function;
+        if (!isIdentifier(token)) {
+            lexer.fail("expected a command name but found '" + token + "'");
+        }
+        if (names[token]) {
+            lexer.fail("command '" + token + "' is declared twice (overloads are not supported)");
+        }
+        names[token] = true;
+        function.name = token;
+
+        lexer.expect("(");
+        map<string, bool> arguments;
+        token = lexer.next();
+        while (token != ")") {
+            idl_argument argument = parseArgument(lexer, token);
+            if (arguments[argument.name] || argument.name == "args" || argument.name == "argTypes") {
+                lexer.fail("argument name '" + argument.name + "' is already in use");
+            }
+            arguments[argument.name] = true;
+            function.arguments.push_back(argument);
+
+            token = lexer.next();
+            if (token == ",") {
+                token = lexer.next();
+            }
+            else if (token != ")") {
+                lexer.fail("expected ',' or ')' but found '" + Lexer::describe(token) + "'");
+            }
+        }
+        lexer.expect(";");
+
+        functions.push_back(function);
+    }
+    return functions;
+}
+
+//--------------------------------------------------------------------------------------
+// Code generation
+
+// Returns the argument type of the argument (as an expression over the macros of rpc.h).
+static string argTypeOf(const idl_argument& argument) {
+    string result;
+    if (argument.input) {
+        result += "(1 << ARG_INPUT) | ";
+    }
+    if (argument.output) {
+        result += "(1 << ARG_OUTPUT) | ";
+    }
+    result += "(" + m_types[argument.type].code + " << 16)";
+    if (argument.length != 0) {
+        ostringstream length;
+        length << argument.length;
+        result += " | " + length.str();
+    }
+    return result;
+}
+
+// Returns the number of values of the argument.
+static unsigned int countOf(const idl_argument& argument) {
+    return argument.length == 0 ? 1 : argument.length;
+}
+
+// Returns the bytes of storage of the argument on the server, aligned for the next one.
+static unsigned int storageOf(const idl_argument& argument) {
+    unsigned int size = countOf(argument) * m_types[argument.type].size;
+    return (size + STORAGE_ALIGNMENT - 1) / STORAGE_ALIGNMENT * STORAGE_ALIGNMENT;
+}
+
+// Returns the C++ declaration of the argument as a parameter.  Inputs are passed by value (or
+// constant reference for arrays), outputs by reference.
+static string parameterOf(const idl_argument& argument) {
+    ostringstream result;
+    if (argument.length == 0) {
+        result << argument.type << (argument.output ? "& " : " ") << argument.name;
+    }
+    else {
+        result << (argument.output ? "" : "const ") << argument.type << " (&" << argument.name << ")[" << argument.length << "]";
+    }
+    return result.str();
+}
+
+// Returns the parameter list of the command.
+static string parametersOf(const idl_function& function) {
+    string result;
+    for (size_t i = 0; i < function.arguments.size(); i++) {
+        result += (i == 0 ? "" : ", ") + parameterOf(function.arguments[i]);
+    }
+    return result;
+}
+
+// Returns the declaration of the command as written in the interface definition.
+static string declarationOf(const idl_function& function) {
+    ostringstream result;
+    result << function.name << "(";
+    for (size_t i = 0; i < function.arguments.size(); i++) {
+        const idl_argument& argument = function.arguments[i];
+        result << (i == 0 ? "" : ", ") << (argument.input ? (argument.output ? "inout " : "in ") : "out ") << argument.type;
+        if (argument.length != 0) {
+            result << "[" << argument.length << "]";
+        }
+        result << " " << argument.name;
+    }
+    result << ")";
+    return result.str();
+}
+
+// Returns a statement that writes the argument values to the stream.
+static string writeStatement(const idl_argument& argument, size_t index) {
+    ostringstream result;
+    const idl_type& type = m_types[argument.type];
+    if (argument.length == 0) {
+        result << "stream.write" << type.method << "(*(" << argument.type << "*) args[" << index << "]);";
+    }
+    else {
+        result << "stream.write" << type.method << "((" << argument.type << "*) args[" << index << "], " << argument.length << ");";
+    }
+    return result.str();
+}
+
+// Returns a statement that reads the argument values from the stream.
+static string readStatement(const idl_argument& argument, size_t index) {
+    ostringstream result;
+    const idl_type& type = m_types[argument.type];
+    if (argument.length == 0) {
+        result << "*(" << argument.type << "*) args[" << index << "] = stream.read" << type.method << "();";
+    }
+    else {
+        result << "stream.read" << type.method << "((" << argument.type << "*) args[" << index << "], " << argument.length << ");";
+    }
+    return result.str();
+}
+
+// Returns a statement that reads past the argument values in the stream.
+static string skipStatement(const idl_argument& argument) {
+    ostringstream result;
+    const idl_type& type = m_types[argument.type];
+    if (type.fixed) {
+        result << "stream.seek(stream.position() + " << countOf(argument) * type.size << ");";
+    }
+    else if (argument.length == 0) {
+        result << "stream.read" << type.method << "();";
+    }
+    else {
+        result << "std::vector<" << argument.type << "> skipped(" << argument.length << "); "
+               << "stream.read" << type.method << "(&skipped.front(), " << argument.length << ");";
+    }
+    return result.str();
+}
+
+// A statement of a marshalling function, and whether it only runs for versions that transfer
+// every argument (PROTOCOL_V1).
+typedef pair<string, bool> statement;
+
+// Writes the statements, grouping runs of them that only run for PROTOCOL_V1 under a single check.
+static void writeStatements(ostream& out, const vector<statement>& statements) {
+    for (size_t i = 0; i < statements.size(); i++) {
+        if (!statements[i].second) {
+            out << "        " << statements[i].first << "\n";
+            continue;
+        }
+
+        out << "        if (version < PROTOCOL_V2) {\n";
+        for (; i < statements.size() && statements[i].second; i++) {
+            out << "            " << statements[i].first << "\n";
+        }
+        out << "        }\n";
+        i--;
+    }
+}
+
+// Writes the argument types, marshaller and client stub of the command.
+static void writeClient(ostream& out, const idl_function& function) {
+    const vector<idl_argument>& arguments = function.arguments;
+    const string& name = function.name;
+
+    out << "    //--------------------------------------------------------------------------------------\n";
+    out << "    // " << declarationOf(function) << "\n\n";
+
+    out << "    static const int " << name << "_argTypes[] = {\n";
+    for (size_t i = 0; i < arguments.size(); i++) {
+        out << "        " << argTypeOf(arguments[i]) << ",\n";
+    }
+    out << "        0\n";
+    out << "    };\n\n";
+
+    // Requests carry the inputs, and the outputs too for PROTOCOL_V1
+    vector<statement> statements;
+    for (size_t i = 0; i < arguments.size(); i++) {
+        statements.push_back(statement(writeStatement(arguments[i], i), !arguments[i].input));
+    }
+    out << "    inline void " << name << "_writeRequest(BinaryStream& stream, void** args, unsigned int version) {\n";
+    writeStatements(out, statements);
+    out << "    }\n\n";
+
+    out << "    inline void " << name << "_readRequest(BinaryStream& stream, void** args, char* storage, unsigned int version) {\n";
+    unsigned int offset = 0;
+    for (size_t i = 0; i < arguments.size(); i++) {
+        out << "        args[" << i << "] = storage + " << offset << ";\n";
+        offset += storageOf(arguments[i]);
+    }
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (arguments[i].input) {
+            out << "        " << readStatement(arguments[i], i) << "\n";
+        }
+        else {
+            out << "        if (version < PROTOCOL_V2) {\n";
+            out << "            " << readStatement(arguments[i], i) << "\n";
+            out << "        }\n";
+            out << "        else {\n";
+            out << "            memset(args[" << i << "], 0, " << countOf(arguments[i]) * m_types[arguments[i].type].size << ");\n";
+            out << "        }\n";
+        }
+    }
+    out << "    }\n\n";
+
+    // Responses carry the outputs, and the inputs too for PROTOCOL_V1 (which the client reads past)
+    statements.clear();
+    for (size_t i = 0; i < arguments.size(); i++) {
+        statements.push_back(statement(writeStatement(arguments[i], i), !arguments[i].output));
+    }
+    out << "    inline void " << name << "_writeResponse(BinaryStream& stream, void** args, unsigned int version) {\n";
+    writeStatements(out, statements);
+    out << "    }\n\n";
+
+    statements.clear();
+    for (size_t i = 0; i < arguments.size(); i++) {
+        statements.push_back(arguments[i].output ? statement(readStatement(arguments[i], i), false) : statement(skipStatement(arguments[i]), true));
+    }
+    out << "    inline void " << name << "_readResponse(BinaryStream& stream, void** args, unsigned int version) {\n";
+    writeStatements(out, statements);
+    out << "    }\n\n";
+
+    out << "    static const rpc_marshaller " << name << "_marshaller = {\n";
+    out << "        &" << name << "_writeRequest, &" << name << "_readRequest, &" << name << "_writeResponse, &" << name << "_readResponse, " << offset << "\n";
+    out << "    };\n\n";
+
+    out << "    // Calls " << name << " on a server that registered it (see rpcCall).\n";
+    out << "    inline int " << name << "(" << parametersOf(function) << ") {\n";
+    out << "        // The library may rewrite the argument types, so it gets a copy\n";
+    out << "        int argTypes[sizeof(" << name << "_argTypes) / sizeof(int)];\n";
+    out << "        memcpy(argTypes, " << name << "_argTypes, sizeof(argTypes));\n";
+    out << "        void* args[] = { ";
+    for (size_t i = 0; i < arguments.size(); i++) {
+        out << "(void*) " << (arguments[i].length == 0 ? "&" : "") << arguments[i].name << ", ";
+    }
+    out << "NULL };\n";
+    out << "        return rpcCallMarshalled((char*) \"" << name << "\", argTypes, args, &" << name << "_marshaller);\n";
+    out << "    }\n\n";
+}
+
+// Writes the header of the module.
+static void writeHeader(ostream& out, const string& idl, const string& module, const vector<idl_function>& functions) {
+    out << "#pragma once\n\n";
+    out << "/*\n";
+    out << module << "_rpc.h\n\n";
+    out << "Generated by rpcgen from " << idl << ", do not edit.\n";
+    out << "*/\n\n";
+    out << "#include \"rpccall.h\"\n\n";
+    out << "#include <cstring>\n";
+    out << "#include <vector>\n\n";
+    out << "namespace " << module << " {\n\n";
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        writeClient(out, functions[i]);
+    }
+
+    out << "    //--------------------------------------------------------------------------------------\n";
+    out << "    // Provided by the server\n\n";
+    out << "    namespace server {\n";
+    for (size_t i = 0; i < functions.size(); i++) {
+        out << "        // Implements " << functions[i].name << ", returning zero on success (or a reason code).\n";
+        out << "        int " << functions[i].name << "(" << parametersOf(functions[i]) << ");\n\n";
+    }
+    out << "        // Registers every command of the module with the binder (see rpcRegister).\n";
+    out << "        int registerAll();\n";
+    out << "    }\n";
+    out << "}\n";
+}
+
+// Writes the skeletons and registration of the module.
+static void writeSource(ostream& out, const string& idl, const string& module, const vector<idl_function>& functions) {
+    out << "/*\n";
+    out << " * " << module << "_rpc.cpp\n";
+    out << " *\n";
+    out << " * Generated by rpcgen from " << idl << ", do not edit.\n";
+    out << " */\n";
+    out << "#include \"" << module << "_rpc.h\"\n\n";
+    out << "namespace " << module << " {\n\n";
+
+    out << "    // Determines if a request has the layout of the signature.  Requests with exactly the signature\n";
+    out << "    // are read by its marshaller, others may still have packed or in-place arguments.\n";
+    out << "    static bool sameLayout(int* argTypes, const int* expected) {\n";
+    out << "        const int mask = ~((1 << ARG_PACKED) | (1 << ARG_INPLACE));\n";
+    out << "        for (; *expected != 0; argTypes++, expected++) {\n";
+    out << "            if ((*argTypes & mask) != *expected) {\n";
+    out << "                return false;\n";
+    out << "            }\n";
+    out << "        }\n";
+    out << "        return *argTypes == 0;\n";
+    out << "    }\n";
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        const idl_function& function = functions[i];
+        out << "\n";
+        out << "    static int " << function.name << "_skeleton(int* argTypes, void** args) {\n";
+        out << "        if (!sameLayout(argTypes, " << function.name << "_argTypes)) {\n";
+        out << "            return EXECUTE_UNSUPPORTED_ARGUMENT;\n";
+        out << "        }\n\n";
+        out << "        return server::" << function.name << "(";
+        for (size_t j = 0; j < function.arguments.size(); j++) {
+            const idl_argument& argument = function.arguments[j];
+            out << (j == 0 ? "" : ", ");
+            if (argument.length == 0) {
+                out << "*(" << argument.type << "*) args[" << j << "]";
+            }
+            else {
+                out << "*(" << argument.type << " (*)[" << argument.length << "]) args[" << j << "]";
+            }
+        }
+        out << ");\n";
+        out << "    }\n";
+    }
+
+    out << "\n";
+    out << "    int server::registerAll() {\n";
+    out << "        int result = 0;\n";
+    out << "        int status;\n";
+    for (size_t i = 0; i < functions.size(); i++) {
+        const string& name = functions[i].name;
+        out << "\n";
+        out << "        status = rpcRegisterMarshalled((char*) \"" << name << "\", const_cast<int*>(" << name << "_argTypes), &" << name << "_skeleton, &" << name << "_marshaller);\n";
+        out << "        if (status < 0) {\n";
+        out << "            return status;\n";
+        out << "        }\n";
+        out << "        result = status > 0 ? status : result;\n";
+    }
+    out << "\n";
+    out << "        return result;\n";
+    out << "    }\n";
+    out << "}\n";
+}
+
+//--------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        cerr << "usage: rpcgen <module.idl> [output directory]" << endl;
+        return 1;
+    }
+
+    string idl = argv[1];
+    ifstream input(idl.c_str());
+    if (!input) {
+        cerr << idl << ": error: cannot open the interface definition" << endl;
+        return 1;
+    }
+
+    stringstream text;
+    text << input.rdbuf();
+
+    // The module is named after the file
+    string base = idl.substr(idl.find_last_of('/') == string::npos ? 0 : idl.find_last_of('/') + 1);
+    string module = base.substr(0, base.find('.'));
+    if (!isIdentifier(module)) {
+        cerr << idl << ": error: the file name must be a valid module name" << endl;
+        return 1;
+    }
+
+    initTypes();
+    vector<idl_function> functions = parse(idl, text.str());
+
+    string directory = argc == 3 ? string(argv[2]) + "/" : "";
+    ofstream header((directory + module + "_rpc.h").c_str());
+    ofstream source((directory + module + "_rpc.cpp").c_str());
+    if (!header || !source) {
+        cerr << directory << ": error: cannot write the generated files" << endl;
+        return 1;
+    }
+
+    writeHeader(header, base, module, functions);
+    writeSource(source, base, module, functions);
+    return 0;
+}
@@ -80,15 +80,12 @@ bool operator <(const rpc_info &rpc1, const rpc_info &rpc2) {
             continue;
         }
         
-        int size1 = getArgTypeArrayLength(argTypes1[i]);
-        int size2 = getArgTypeArrayLength(argTypes2[i]);
-        if (size1 != size2) {
-
-            // We do not care for length of array (as it can change), only if it is
-            // SCALAR vs ARRAY.  (again array is dynamic length, so we only care if scalar or not)
-            if ((size1 == 0 && size2 != 0) || (size1 != 0 && size2 == 0)) {
-                return argTypes1[i] < argTypes2[i];
-            }
+        // We do not care for length of array (as it can change), only if it is
+        // SCALAR vs ARRAY.  (again array is dynamic length, so we only care if scalar or not)
+        bool array1 = isArgTypeArray(argTypes1[i]);
+        bool array2 = isArgTypeArray(argTypes2[i]);
+        if (array1 != array2) {
+            return array2;
         }
     }
 
@@ -8,6 +8,8 @@
 
 #include <string>
 
+#include "constants.h"
+
 //--------------------------------------------------------------------------------------
 // Provides a container class for socket host address information.
 struct server_info {
@@ -18,9 +20,12 @@ struct server_info {
     // Gets the port number of the socket file descriptor.
     unsigned short port;
 
-    // Creates an instance of the server_info class with the specified server_identifier and port
-    server_info(std::string server_identifier, unsigned short port)
-        : server_identifier(server_identifier), port(port) {}
+    // Gets the highest protocol version understood by the server.
+    unsigned int version;
+
+    // Creates an instance of the server_info class with the specified server_identifier, port and protocol version
+    server_info(std::string server_identifier, unsigned short port, unsigned int version = PROTOCOL_V1)
+        : server_identifier(server_identifier), port(port), version(version) {}
 
 };
 
@@ -37,9 +42,15 @@ struct function_info {
     // The remote protocol command (RPC) definition
     struct rpc_info *rpcdef;
 
-    // Creates an instance of the function_info class with the specified server_identifier, port and rpc function
-    function_info(std::string server_identifier, unsigned short port,  struct rpc_info *rpcdef)
-        : server_identifier(server_identifier), port(port), rpcdef(rpcdef) {}
+    // Gets the highest protocol version understood by the server.
+    unsigned int version;
+
+    // Gets the milliseconds the results of the function may be reused for (zero unless it is pure, see rpcRegisterPure).
+    unsigned int ttl;
+
+    // Creates an instance of the function_info class with the specified server_identifier, port, rpc function, protocol version and time to live
+    function_info(std::string server_identifier, unsigned short port,  struct rpc_info *rpcdef, unsigned int version = PROTOCOL_V1, unsigned int ttl = 0)
+        : server_identifier(server_identifier), port(port), rpcdef(rpcdef), version(version), ttl(ttl) {}
 };
 
 //--------------------------------------------------------------------------------------
@@ -9,6 +9,13 @@
 #include "bstream.h"
 #include "conversion.h"
 #include "protocol.h"
+#include "arena.h"
+#include "rpcstream.h"
+#include "packing.h"
+#include "rpccall.h"
+#include "plan.h"
+#include "dispatch.h"
+#include "memo.h"
 
 #include <string.h>
 #include <string>
@@ -19,8 +26,14 @@
 #include <limits.h>
 #include <math.h>
 #include <cstring>
+#include <list>
 #include <map>
+#include <set>
 #include <signal.h>
+#include <stdexcept>
+#include <cstdint>
+#include <ctime>
+#include <vector>
 
 using namespace std;
 
@@ -28,10 +41,65 @@ using namespace std;
 static pthread_mutex_t* m_listLock;
 static map<pthread_t, int> m_threadPool;
 
+// Connections closed by their client while a thread was still handling a request on them.  They are
+// closed once the thread is done, so the descriptor cannot be reused by a new connection that would
+// get its response.
+static set<int> m_orphanedConnections;
+
+// A registered skeleton, along with the exact signature it was registered with, the
+// marshaller of that signature (if it has one, see rpcRegisterMarshalled) and the plan
+// compiled for it (if the signature can be planned, see plan.h).  Pure functions (see
+// rpcRegisterPure) have the milliseconds their results may be reused for by clients, and
+// those registered cached (see rpcRegisterCached) the milliseconds the server reuses them for.
+struct registered_function {
+    skeleton f;
+    vector<int> argTypes;
+    const rpc_marshaller* marshaller;
+    bool planned;
+    marshalling_plan plan;
+    unsigned int ttl;
+    unsigned int cacheTtl;
+};
+
 // List of functions that are registered with the server
 // We exploit the fact that we make an operator< for the rpc_info
 // thus allowing us to use an rpc_info as a key in a bunch of differing structs
-static map<rpc_info, skeleton> m_registeredRpc;
+static map<rpc_info, registered_function> m_registeredRpc;
+
+// The registered functions, frozen into a perfect hash table when rpcExecute starts (see dispatch.h).
+// Workers only read the table, which is built before any of them starts, so lookups take no lock.
+static dispatch_table m_dispatch;
+static vector<registered_function*> m_dispatched;
+static bool m_frozen = false;
+
+// The result cache: the responses to requests of functions registered cached, keyed by the name, the
+// argument types and the protocol version of the request (see resultSignature), and the bytes of its
+// argument values.  The cache is split into shards by the hash of the key, each behind its own lock,
+// so workers only contend on requests that land in the same shard.
+#define RESULT_CACHE_SHARDS 16
+#define RESULT_CACHE_CAPACITY (16 << 20)
+
+struct result_shard {
+    pthread_mutex_t lock;
+    MemoCache cache;
+
+    result_shard() : cache(RESULT_CACHE_CAPACITY / RESULT_CACHE_SHARDS) {
+        pthread_mutex_init(&lock, NULL);
+    }
+};
+static result_shard m_resultShards[RESULT_CACHE_SHARDS];
+
+// The state (framing and codecs) of each client connection, as it outlives a single request
+static map<int, Protocol> m_connections;
+
+// Function handles handed out on compact connections. Each names the exact signature (name and
+// argument types) of an earlier request, so later requests can leave it out.  Handles are only
+// valid within the epoch of this server process, and start at one (zero is no handle).
+#define MAX_FUNCTION_HANDLES 65536
+static pthread_mutex_t m_handleLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int m_handleEpoch = 0;
+static vector<pair<string, vector<int>>> m_handles;
+static map<pair<string, vector<int>>, unsigned int> m_handleIds;
 
 //global variables
 int serverPort = 0;
@@ -43,38 +111,6 @@ int binderfd = -1;
 //make joinable
 pthread_attr_t attr;
 
-//int is socket fd,thread is pthread
-static map<int,pthread_t> th;
-
-//node structure for linked list
-struct node {
-    char *name;
-    int *argTypes;
-    skeleton f;
-    node *next;
-};
-
-//function list to have head and tail of nodes
-struct funcList {
-    node* head;
-    node* tail;
-    int numFun = 0;
-};
-//structure to store information about message to
-//store as void * for threads
-struct msgInfo {
-    int msgSize;
-    int idthr;
-};
-
-//as SOMAXCONN clients and some fds not used at all
-//call msgInfo based on connected socketfd for thread
-//+ 10 just to be safe
-struct msgInfo msgLst[SOMAXCONN + 10];
-
-//has list of all the functions
-struct funcList *lst = new funcList;
-
 //creates the server
 int rpcInit() {
     serverfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -106,28 +142,19 @@ int rpcInit() {
     m_listLock = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(m_listLock, NULL);
 
+    // Handles of an earlier process on the same port must not be mistaken for ours
+    m_handleEpoch = ((unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16)) | 1;
+
     return 0;
 }
 
-int rpcRegister(char* name, int* argTypes, skeleton fnc_skeleton) {
-    Protocol handler(binderfd);
-    int status = 0;
-
-    //sending data for register
-    status = handler.sendRegister(servname, serverPort, name, argTypes);
-    if (status < 0) {
-        return status;
-    }
-
-    // --------
-    // Prepare to receive the register response
+// Receives the response of the binder to a registration request.
+int receiveRegisterResponse(Protocol& handler, MessageType& type, vector<char>& response) {
     // By specification: LENGTH, TYPE, MESSAGE (contents)
-
-    MessageType type;
     unsigned int msgSize;
 
     // Getting type and size
-    status = handler.receiveMessageSize(msgSize);
+    int status = handler.receiveMessageSize(msgSize);
     if (status < 0) {
         return status;
     }
@@ -138,21 +165,48 @@ int rpcRegister(char* name, int* argTypes, skeleton fnc_skeleton) {
     }
 
     // Allocate buffer for message
-    char msg[msgSize];
-    status = handler.receiveMessage(msgSize, msg);
+    response.resize(msgSize);
+    return handler.receiveMessage(msgSize, response.data());
+}
+
+// Keeps the skeleton registered with the binder, so the server can dispatch requests to it.
+void addFunction(char* name, int* argTypes, skeleton fnc_skeleton, const rpc_marshaller* marshaller, unsigned int ttl, unsigned int cacheTtl) {
+    struct rpc_info rpc(string(name), argTypes);
+    registered_function& function = m_registeredRpc[rpc];
+    function.f = fnc_skeleton;
+    function.argTypes.assign(argTypes, argTypes + getArgTypesLength(argTypes));
+    function.marshaller = marshaller;
+    function.planned = plan_compile(argTypes, function.plan);
+    function.ttl = ttl;
+    function.cacheTtl = cacheTtl;
+}
+
+// Registers the skeleton with the binder, along with the marshaller of its signature (if any), the
+// milliseconds its results may be reused for by clients (zero unless it is pure) and by the server.
+int registerFunction(char* name, int* argTypes, skeleton fnc_skeleton, const rpc_marshaller* marshaller, unsigned int ttl, unsigned int cacheTtl) {
+    Protocol handler(binderfd);
+    int status = 0;
+
+    //sending data for register
+    status = handler.sendRegister(servname, serverPort, name, argTypes, ttl);
+    if (status < 0) {
+        return status;
+    }
+
+    // Prepare to receive the register response
+    MessageType type;
+    vector<char> response;
+    status = receiveRegisterResponse(handler, type, response);
     if (status < 0) {
         return status;
     }
 
     // Wrapper over the stream
-    BinaryStream stream(msg, msgSize);
+    BinaryStream stream(response.data(), response.size());
 
     if (type == REGISTER_SUCCESS) {
        int reasonCode = stream.readInt32();
-
-       struct rpc_info rpc(string(name), argTypes);
-       m_registeredRpc[rpc] = fnc_skeleton;
-
+       addFunction(name, argTypes, fnc_skeleton, marshaller, ttl, cacheTtl);
        return reasonCode;
     }
     else if (type == REGISTER_FAILURE) {
@@ -166,162 +220,323 @@ int rpcRegister(char* name, int* argTypes, skeleton fnc_skeleton) {
     return 0;
 }
 
-//deleting function list on termination
-//as well as closing threads
-void rem_lst() {
-    //deleting lst if no nodes
-    if (lst->numFun == 0) {
-        delete lst;
+// Registers the skeletons with the binder in a single request, setting the result of each of them.
+int rpcRegisterBatch(rpc_registration* functions, unsigned int count) {
+    if (count == 0) {
+        return 0;
     }
-    //deleting lst if >=1 node
-    else {
-        struct node *remNode = lst->head;
-        for (int i =0; i < lst->numFun; i++) {
-            struct node *nextNode = remNode->next;
-            delete remNode;
-            remNode = nextNode;
-        }
-        delete lst;
+
+    Protocol handler(binderfd);
+    int status = 0;
+
+    // The definitions outlive the request, as the functions only point at them
+    vector<rpc_info> definitions;
+    definitions.reserve(count);
+    list<function_info> registered;
+    for (unsigned int i = 0; i < count; i++) {
+        definitions.push_back(rpc_info(string(functions[i].name), functions[i].argTypes));
+        registered.push_back(function_info(servname, serverPort, &definitions.back(), PROTOCOL_CURRENT, functions[i].ttl));
     }
 
-    //deleting threads
-    //loop through threads and call thread_join
-    for (auto const thItem : th) {
+    //sending data for register
+    status = handler.sendRegisterBatch(servname, serverPort, registered);
+    if (status < 0) {
+        return status;
+    }
 
-        pthread_t cur = thItem.second;
-        pthread_join(cur, NULL);
+    // Prepare to receive the register response
+    MessageType type;
+    vector<char> response;
+    status = receiveRegisterResponse(handler, type, response);
+    if (status < 0) {
+        return status;
+    }
+
+    // Wrapper over the stream
+    BinaryStream stream(response.data(), response.size());
+
+    if (type == REGISTER_BATCH_SUCCESS) {
+        // The whole response is read before any function is added, so a short one adds none of them
+        vector<int> results(count);
+        try {
+            if (stream.readUInt32() != count) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+            stream.readInt32(&results.front(), count);
+        }
+        catch (const out_of_range& e) {
+            return RECEIVE_INVALID_MESSAGE;
+        }
+
+        // Only the functions the binder registered are served
+        for (unsigned int i = 0; i < count; i++) {
+            rpc_registration& function = functions[i];
+            function.result = results[i];
+            if (function.result >= 0) {
+                addFunction(function.name, function.argTypes, function.f, NULL, function.ttl, function.ttl);
+            }
+        }
+        return 0;
+    }
+    else if (type == REGISTER_FAILURE) {
+        int reasonCode = stream.readInt32();
+        return reasonCode;
+    }
+    else {
+        return RECEIVE_INVALID_MESSAGE_TYPE;
     }
 }
 
-int execute_request(int msgSize, Protocol handle) {
-    //creating message variable and reading from it
-    char msg[msgSize];
-    int status = handle.receiveMessage(msgSize, msg);
+int rpcRegister(char* name, int* argTypes, skeleton fnc_skeleton) {
+    return registerFunction(name, argTypes, fnc_skeleton, NULL, 0, 0);
+}
 
-    //checking if error in receiving message
-    if (status != 0) {
-        return status;
+int rpcRegisterPure(char* name, int* argTypes, skeleton fnc_skeleton, unsigned int ttl) {
+    return registerFunction(name, argTypes, fnc_skeleton, NULL, ttl, ttl);
+}
+
+int rpcRegisterCached(char* name, int* argTypes, skeleton fnc_skeleton, unsigned int ttl) {
+    return registerFunction(name, argTypes, fnc_skeleton, NULL, 0, ttl);
+}
+
+int rpcRegisterMarshalled(char* name, int* argTypes, skeleton fnc_skeleton, const rpc_marshaller* marshaller) {
+    return registerFunction(name, argTypes, fnc_skeleton, marshaller, 0, 0);
+}
+
+//--------------------------------------------------------------------------------------
+
+// Returns the key of the responses to requests with the name and argument types in the protocol version.
+string resultSignature(const string& name, const vector<int>& argTypes, unsigned int version) {
+    string key(name.c_str());
+    key.push_back('\0');
+    key.append((const char*) &argTypes.front(), argTypes.size() * sizeof(int));
+    key.append((const char*) &version, sizeof(version));
+    return key;
+}
+
+// Returns the shard of the result cache that holds the key with the hash.
+result_shard& resultShard(uint64_t hash) {
+    return m_resultShards[(hash >> 32) % RESULT_CACHE_SHARDS];
+}
+
+void rpcResultCacheStats(rpc_memo_stats* stats) {
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->evictions = 0;
+    for (unsigned int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&m_resultShards[i].lock);
+        rpc_memo_stats shard = m_resultShards[i].cache.stats();
+        pthread_mutex_unlock(&m_resultShards[i].lock);
+
+        stats->hits += shard.hits;
+        stats->misses += shard.misses;
+        stats->evictions += shard.evictions;
     }
+}
 
-    //reading data
-    BinaryStream stream(msg, msgSize);
-    string name = stream.readString();
-    unsigned int argLen = stream.readUInt32();
-    int argTypes[argLen];
-    stream.readInt32(argTypes, argLen);
-    void *args[argLen];
+void rpcSetResultCacheCapacity(unsigned long bytes) {
+    for (unsigned int i = 0; i < RESULT_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&m_resultShards[i].lock);
+        m_resultShards[i].cache.setCapacity(bytes / RESULT_CACHE_SHARDS);
+        pthread_mutex_unlock(&m_resultShards[i].lock);
+    }
+}
 
-    //getting argument with loop based on argtype
-    for (int i = 0; i < argLen-1; i++) {
+// The most bytes the capacity of a variable-length array may take (larger arrays are streamed), so a
+// request cannot make the server allocate more than it would ever need.
+#define MAX_VARIABLE_ARRAY_SIZE (64 << 20)
+
+// Reads the argument values from the stream into storage allocated from the arena.
+// Every argument (including scalars) is stored as a cache line aligned array, except
+// in-place inputs which are bound to the stream buffer (so it must outlive the arguments).
+// Directed (PROTOCOL_V2) requests do not carry outputs, so they are given zeroed storage.
+// Variable-length arrays are given an rpc_array whose storage holds the declared capacity.
+// Streamed arrays are given an rpc_stream over the connection (see linkStreams).
+int readArguments(BinaryStream& stream, int argTypes[], void* args[], Arena& arena, unsigned int version, Protocol& connection) {
+    unsigned int argLen = getArgTypesLength(argTypes);
+
+    for (unsigned int i = 0; i < argLen - 1; i++) {
         int argType = argTypes[i];
         int ctype = getArgType(argType);
-        int length = getArgTypeArrayLength(argType);
+        unsigned int length = getArgTypeArrayLength(argType);
         if (length == 0) {
             length = 1;
         }
 
-        switch(ctype) {
-            case ARG_CHAR: {
-                    char* charVal = new char[length];
-                    stream.readChar(charVal, length);
-                    args[i] = (void *) charVal;
-                    break;
-                }
-            case ARG_SHORT: {
-                    short* shortVal = new short[length];
-                    stream.readInt16( shortVal, length);
-                    args[i] = (void *) shortVal;
-                    break;
-                }
-            case ARG_INT: {
-                    int* intVal = new int[length];
-                    stream.readInt32( intVal, length);
-                    args[i] = (void *) intVal;
-                    break;
-                }
-            case ARG_LONG: {
-                    long* longVal = new long[length];
-                    stream.readInt64( longVal, length);
-                    args[i] = (void *) longVal;
-                    break;
-                }
-            case ARG_DOUBLE: {
-                    double* dbVal = new double[length];
-                    stream.readDouble( dbVal, length);
-                    args[i] = (void *) dbVal;
-                    break;
-                }
-            case ARG_FLOAT:      {
-                    float* fltVal = new float[length];
-                    stream.readFloat( fltVal, length);
-                    args[i] = (void *) fltVal;
-                    break;
+        // Unknown types have no storage
+        int size = type_sizeof(ctype);
+        if (size < 0) {
+            args[i] = NULL;
+            continue;
+        }
+
+        // Streamed arrays declare their length (or capacity), and their elements follow the message
+        if (isArgTypeStream(argType)) {
+            if (version < PROTOCOL_V4 || isArgTypeInput(argType) == isArgTypeOutput(argType)) {
+                return EXECUTE_UNSUPPORTED_ARGUMENT;
+            }
+
+            args[i] = (void*) new rpc_stream(connection, argType, stream.readUInt32());
+            continue;
+        }
+
+        // Pure outputs are not sent in directed requests
+        bool transmitted = version < PROTOCOL_V2 || isArgTypeInput(argType);
+
+        // Variable-length arrays carry their capacity, and the number of elements in use when transmitted
+        unsigned int capacity = length;
+        rpc_array* array = NULL;
+        if (isArgTypeVariable(argType)) {
+            capacity = stream.readUInt32();
+            length = transmitted ? stream.readUInt32() : 0;
+            if (length > capacity || (unsigned long long) capacity * size > MAX_VARIABLE_ARRAY_SIZE) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+
+            array = (rpc_array*) arena.allocate(sizeof(rpc_array));
+            if (array == NULL) {
+                return ERROR;
+            }
+            array->capacity = capacity;
+            array->length = length;
+        }
+
+        void* storage = NULL;
+
+        // In-place arguments are aligned on the wire. If it is a read-only input whose
+        // wire representation matches the host layout, point straight into the frame.
+        bool packed = isArgTypePacked(argType);
+        if (transmitted && !packed && isArgTypeInPlace(argType) && type_is_native(ctype)) {
+            stream.readPadding(size);
+
+            // The values are read where they are, so they have to be in the frame
+            if (stream.position() > stream.size() || (size_t) length * size > (size_t) (stream.size() - stream.position())) {
+                return RECEIVE_INVALID_MESSAGE;
+            }
+
+            char* inplace = stream.buffer() + stream.position();
+            if (!isArgTypeOutput(argType) && ((uintptr_t) inplace) % size == 0) {
+                storage = (void*) inplace;
+                stream.seek(stream.position() + length * size);
+
+                // The frame only holds the elements that were sent
+                if (array != NULL) {
+                    array->capacity = length;
                 }
-            default:
-                break;
+            }
         }
-    }
 
-    //find function in list
-    int numFunc = lst->numFun;
-    struct node *curNode = lst->head;
-    //substring as strings normally include '\0' character causing the compare to fail
-    name = name.substr(0, name.length()-1);
+        if (storage == NULL) {
+            storage = arena.allocate((size_t) capacity * size);
+            if (storage == NULL) {
+                return ERROR;
+            }
 
-    //seeing if function exists in list
-    while (curNode != NULL) {
-        string curNodeName = curNode->name;
+            // The skeleton fills the outputs, so start them zeroed
+            if (!transmitted) {
+                memset(storage, 0, (size_t) capacity * size);
+            }
+            else if (packed) {
+                int status = packing_decode(stream, ctype, storage, length);
+                if (status != 0) {
+                    return status;
+                }
+            }
+            else {
+                switch(ctype) {
+                    case ARG_CHAR:
+                        stream.readChar((char*) storage, length);
+                        break;
+                    case ARG_SHORT:
+                        stream.readInt16((short*) storage, length);
+                        break;
+                    case ARG_INT:
+                        stream.readInt32((int*) storage, length);
+                        break;
+                    case ARG_LONG:
+                        stream.readInt64((long*) storage, length);
+                        break;
+                    case ARG_DOUBLE:
+                        stream.readDouble((double*) storage, length);
+                        break;
+                    case ARG_FLOAT:
+                        stream.readFloat((float*) storage, length);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
 
-        if ((!name.compare(curNodeName)) &&
-                (same_int_arr(argTypes,curNode->argTypes) ==0 )) {
-            break;
+        // Skeletons receive the descriptor for variable-length arrays, and the storage otherwise
+        if (array != NULL) {
+            array->data = storage;
+            args[i] = (void*) array;
+        }
+        else {
+            args[i] = storage;
         }
-        curNode = curNode->next;
     }
-    if (curNode == NULL) {
-        return FUNCTION_NOT_AVAILABLE;
+    return 0;
+}
+
+// Freezes the registered functions into the dispatch table.  Falls back to the registration map in the
+// (unlikely) event that two of them hash the same.
+void freezeDispatch() {
+    vector<dispatch_key> keys;
+    m_dispatched.clear();
+    for (map<rpc_info, registered_function>::iterator i = m_registeredRpc.begin(); i != m_registeredRpc.end(); ++i) {
+        dispatch_key key = { i->first.name, i->second.argTypes };
+        keys.push_back(key);
+        m_dispatched.push_back(&i->second);
+    }
+    m_frozen = dispatch_build(keys, m_dispatch);
+}
+
+// Finds the function registered for the name and argument types, or NULL if there is none.
+const registered_function* findFunction(const string& name, int* argTypes) {
+    if (m_frozen) {
+        int index = dispatch_find(m_dispatch, name.c_str(), argTypes);
+        return index < 0 ? NULL : m_dispatched[index];
     }
 
+    map<rpc_info, registered_function>::iterator position = m_registeredRpc.find(rpc_info(name, argTypes));
+    return position == m_registeredRpc.end() ? NULL : &position->second;
+}
 
-    //calling skeleton
-    skeleton curFunc = curNode->f;
-    int exeResult = (*curFunc) (argTypes, args);
+// Returns the handle of the signature, assigning the next one on first use (zero once they run out).
+unsigned int assignHandle(const string& name, int argTypes[]) {
+    pair<string, vector<int>> signature(name, vector<int>(argTypes, argTypes + getArgTypesLength(argTypes)));
+    unsigned int handle = 0;
 
-    //returning error if function doesn't execute properly
-    if (exeResult != 0) {
-        handle.sendExecuteError(FUNCTION_EXECUTION_ERROR);
+    pthread_mutex_lock(&m_handleLock);
+    map<pair<string, vector<int>>, unsigned int>::iterator found = m_handleIds.find(signature);
+    if (found != m_handleIds.end()) {
+        handle = found->second;
     }
-    //sending scucess message to user
-    else {
-        handle.sendExecuteResponse(curNode->name, argTypes, args);
+    else if (m_handles.size() < MAX_FUNCTION_HANDLES) {
+        m_handles.push_back(signature);
+        handle = m_handles.size();
+        m_handleIds[signature] = handle;
     }
+    pthread_mutex_unlock(&m_handleLock);
 
-    return exeResult;
+    return handle;
 }
 
-void *th_ex_req(void *buf) {
-    struct msgInfo *mInfo;
-    int thID;
-    int msgSize;
-
-    //getting variables
-    mInfo = (struct msgInfo *) buf;
-    msgSize = mInfo->msgSize;
-    thID = mInfo->idthr;
-    Protocol proto(thID);
+// Resolves the handle handed out in the epoch to its signature. Returns false if it is not one of ours.
+bool resolveHandle(unsigned int epoch, unsigned int handle, string& name, vector<int>& argTypes) {
+    bool found = false;
 
-    //seeing if execute_request is called properly
-    int result = execute_request(msgSize, proto);
-
-    if (result != 0) {
-        ReasonCode rsCode = static_cast<ReasonCode>(result);
-        proto.sendExecuteError(rsCode);
+    pthread_mutex_lock(&m_handleLock);
+    if (epoch == m_handleEpoch && handle >= 1 && handle <= m_handles.size()) {
+        name = m_handles[handle - 1].first;
+        argTypes = m_handles[handle - 1].second;
+        found = true;
     }
+    pthread_mutex_unlock(&m_handleLock);
 
-    //removing thID from map
-    th.erase(thID);
-    //ending thread as it has done what it needs to
-    pthread_exit(NULL);
+    return found;
 }
 
 // Threading 
@@ -332,117 +547,239 @@ void* thread_exec(void* arguments) {
     int* socketfd = (int*)array[0];
     unsigned int* sizeArg = (unsigned int*)array[1];
     unsigned int msgSize = *sizeArg;
-    char* buffer = (char*)array[2];
+    BinaryStream* frame = (BinaryStream*)array[2];
+    MessageType* typeArg = (MessageType*)array[3];
+    Protocol* connection = (Protocol*)array[4];
+
+    // The client tells us which version of the protocol it is speaking by the message type
+    bool streamed = (*typeArg == EXECUTE_STREAMED);
+    unsigned int version = PROTOCOL_V1;
+    if (*typeArg == EXECUTE_DIRECTED) {
+        version = PROTOCOL_V3;
+    }
+    else if (streamed) {
+        version = PROTOCOL_V4;
+    }
+    else if (*typeArg == EXECUTE_HANDLE) {
+        version = PROTOCOL_V7;
+    }
 
-    Protocol handler(*socketfd);
+    // Reply over the connection the request came in on (with its framing and codecs)
+    Protocol handler = *connection;
 
-    //reading data
-    BinaryStream stream(buffer, msgSize);
-    string name = stream.readString();
-    unsigned int argLen = stream.readUInt32();
-    int argTypes[argLen];
-    stream.readInt32(argTypes, argLen);
+    //reading data (directly from the received frame, in-place arguments point into it)
+    BinaryStream& stream = *frame;
+    string name;
+    vector<int> signature;
+    int status = 0;
+
+    // Requests by handle leave out the name and argument types
+    if (*typeArg == EXECUTE_HANDLE) {
+        unsigned int epoch = stream.readUInt32();
+        unsigned int handle = stream.readVarUInt32();
+        if (!resolveHandle(epoch, handle, name, signature)) {
+            signature.assign(1, 0);
+            status = EXECUTE_UNKNOWN_HANDLE;
+        }
+    }
+    else {
+        name = stream.readString();
+        signature.resize(stream.readUInt32());
+        stream.readInt32(&signature.front(), signature.size());
+    }
+
+    int* argTypes = &signature.front();
+    unsigned int argLen = signature.size();
     void *args[argLen];
+    memset(args, 0, sizeof(args));
+
+    // All argument storage for this request lives in a single arena sized from the frame.
+    // Arguments are never larger in memory than on the wire, so one block is enough, once
+    // we account for the outputs that directed requests leave out.  (Variable-length arrays
+    // may declare more capacity than they send, in which case the arena grows on demand.)
+    size_t capacity = msgSize + argLen * ARENA_ALIGNMENT;
+    for (unsigned int i = 0; version >= PROTOCOL_V2 && i < argLen - 1; i++) {
+        if (!isArgTypeInput(argTypes[i]) && !isArgTypeVariable(argTypes[i]) && !isArgTypeStream(argTypes[i]) && type_sizeof(getArgType(argTypes[i])) > 0) {
+            int length = getArgTypeArrayLength(argTypes[i]);
+            capacity += (length == 0 ? 1 : length) * type_sizeof(getArgType(argTypes[i]));
+        }
+    }
+    Arena arena(capacity);
 
-    //getting argument with loop based on argtype
-    for (int i = 0; i < argLen-1; i++) {
-        int argType = argTypes[i];
-        int ctype = getArgType(argType);
-        int length = getArgTypeArrayLength(argType);
-        if (length == 0) {
-            length = 1;
+    // Get the registered function
+    const registered_function* function = findFunction(name, argTypes);
+
+    // Requests with exactly the registered signature are marshalled by its plan or marshaller
+    const rpc_marshaller* marshaller = NULL;
+    const marshalling_plan* plan = NULL;
+    if (function != NULL && function->argTypes == signature) {
+        marshaller = function->marshaller;
+        if (function->planned) {
+            plan = &function->plan;
         }
+    }
 
-        switch(ctype) {
-            case ARG_CHAR: {
-                    char* charVal = new char[length];
-                    stream.readChar(charVal, length);
-                    args[i] = (void *) charVal;
-                    break;
-                }
-            case ARG_SHORT: {
-                    short* shortVal = new short[length];
-                    stream.readInt16( shortVal, length);
-                    args[i] = (void *) shortVal;
-                    break;
-                }
-            case ARG_INT: {
-                    int* intVal = new int[length];
-                    stream.readInt32( intVal, length);
-                    args[i] = (void *) intVal;
-                    break;
-                }
-            case ARG_LONG: {
-                    long* longVal = new long[length];
-                    stream.readInt64( longVal, length);
-                    args[i] = (void *) longVal;
-                    break;
-                }
-            case ARG_DOUBLE: {
-                    double* dbVal = new double[length];
-                    stream.readDouble( dbVal, length);
-                    args[i] = (void *) dbVal;
-                    break;
-                }
-            case ARG_FLOAT:      {
-                    float* fltVal = new float[length];
-                    stream.readFloat( fltVal, length);
-                    args[i] = (void *) fltVal;
-                    break;
-                }
-            default:
-                break;
+    // Plans copy integers in bulk, so they beat the marshaller on frames made only of integers
+    bool planned = plan != NULL && (marshaller == NULL || plan->requests[plan_layout(version)].fixed);
+
+    // Functions registered cached are answered with the response to an earlier request with the same
+    // argument values (the rest of the frame), without reading the arguments or calling the skeleton
+    bool cached = status == 0 && !streamed && function != NULL && function->cacheTtl > 0;
+    bool hit = false;
+    string resultKey, inputs, response;
+    uint64_t resultHash = 0;
+    if (cached) {
+        resultKey = resultSignature(name, signature, version);
+        inputs.assign(stream.buffer() + stream.position(), stream.size() - stream.position());
+        resultHash = MemoCache::hash(resultKey, inputs);
+
+        result_shard& shard = resultShard(resultHash);
+        pthread_mutex_lock(&shard.lock);
+        hit = shard.cache.find(resultHash, resultKey, inputs, response);
+        pthread_mutex_unlock(&shard.lock);
+    }
+
+    //getting argument with loop based on argtype
+    if (hit) {
+        // Answered from the result cache
+    }
+    else if (status == 0 && planned) {
+        char* storage = (char*) arena.allocate(plan->storage);
+        status = (storage == NULL) ? ERROR : plan_readRequest(*plan, stream, args, storage, version);
+    }
+    else if (status == 0 && marshaller != NULL) {
+        char* storage = (char*) arena.allocate(marshaller->storage);
+        if (storage == NULL) {
+            status = ERROR;
+        }
+        else {
+            marshaller->readRequest(stream, args, storage, version);
         }
     }
-    
-    // Get the rpc information
-    struct rpc_info rpc(name, argTypes);
-    map<rpc_info, skeleton>::iterator skel_pos = m_registeredRpc.find(rpc);
+    else if (status == 0) {
+        status = readArguments(stream, argTypes, args, arena, version, *connection);
+    }
+
+    // Streamed arguments are transferred in order after the frame (if decoding failed, only those it reached
+    // are linked, so they are finished and freed before the error is sent)
+    rpc_stream* streams = linkStreams(argTypes, args);
 
     ReasonCode reasonCode = SUCCESS;
 
     // For testing early termination
     //sleep(2);
 
+    // Failed to unmarshal the arguments
+    if (status != 0) {
+        reasonCode = static_cast<ReasonCode>(status);
+    }
     // Unknown rpc
-    if(skel_pos == m_registeredRpc.end()) {        
+    else if(function == NULL) {
         reasonCode = EXECUTE_UNKNOWN_SKELETON;
     }
-    else {
-        skeleton func_skeleton = skel_pos->second;
+    else if (!hit) {
+        skeleton func_skeleton = function->f;
 
         // call the skeleton
         int result = func_skeleton(argTypes, args);
-        if (result == 0) {           
-            result = handler.sendExecuteResponse(name, argTypes, args);
-        }
-        else {
+        if (result != 0) {
             // set failure response
             reasonCode = static_cast<ReasonCode>(result);
         }
     }
 
+    // Whatever the outcome, the streams must be finished before replying: the client
+    // does not listen until it has sent every input, and expects every output first
+    int streamStatus = finishStream(streams);
+    if (reasonCode == SUCCESS && streamStatus != 0) {
+        reasonCode = static_cast<ReasonCode>(streamStatus);
+    }
+
+    if (reasonCode == SUCCESS) {
+        // Clients on compact connections are handed a handle for later requests by name
+        unsigned int handle = 0;
+        if (handler.isCompact() && *typeArg == EXECUTE_DIRECTED) {
+            handle = assignHandle(name, argTypes);
+        }
+
+        // Successful responses of functions registered cached are kept for later requests
+        if (!hit) {
+            BinaryStream payload;
+            writeExecuteResponse(payload, name, argTypes, args, version, marshaller, plan);
+            response.assign(payload.buffer(), payload.size());
+
+            if (cached) {
+                result_shard& shard = resultShard(resultHash);
+                pthread_mutex_lock(&shard.lock);
+                shard.cache.store(resultHash, resultKey, inputs, response, function->cacheTtl);
+                pthread_mutex_unlock(&shard.lock);
+            }
+        }
+
+        handler.sendExecutePayload(response.data(), response.size(), version, m_handleEpoch, handle);
+    }
+
     // if it is not success, then send execute error
     if(reasonCode != SUCCESS) {
         int result = handler.sendExecuteError(reasonCode);
     }
 
-    // TODO: Delete all the arrays from above
+    // The response has been sent, so release all argument storage in one step
+    arena.release();
+    while (streams != NULL) {
+        rpc_stream* previous = streams->previous;
+        delete streams;
+        streams = previous;
+    }
 
-    delete socketfd;
     delete sizeArg;
-    delete [] buffer;
+    delete typeArg;
+    delete connection;
+    delete frame;
+    delete [] array;
 
-    // Remove from threadpool
+    // Remove from threadpool.  Streamed connections were handed over to this thread, so it closes them
+    // (as it does those their client closed meanwhile).
     pthread_mutex_lock(m_listLock);
     m_threadPool.erase(pthread_self());
+    if (m_orphanedConnections.erase(*socketfd) != 0 || streamed) {
+        close(*socketfd);
+    }
     pthread_mutex_unlock(m_listLock);    
 
+    delete socketfd;
+
     return NULL;
 }
 
+// Closes the client connection, forgetting its state.  Connections a thread is still handling a request on are
+// closed by the thread once it is done.
+void closeConnection(int j, fd_set* master_set) {
+    FD_CLR(j, master_set);
+    m_connections.erase(j);
+
+    pthread_mutex_lock(m_listLock);
+    bool busy = false;
+    for (auto const& pair : m_threadPool) {
+        busy = busy || pair.second == j;
+    }
+    if (busy) {
+        m_orphanedConnections.insert(j);
+    }
+    else {
+        close(j);
+    }
+    pthread_mutex_unlock(m_listLock);
+}
+
 int handleRequest(int j, fd_set* master_set) {
-    Protocol proto(j);
+    // Client connections keep their state between requests
+    map<int, Protocol>::iterator state = m_connections.find(j);
+    if (state == m_connections.end()) {
+        state = m_connections.insert(make_pair(j, Protocol(j))).first;
+    }
+
+    Protocol& proto = state->second;
     bool success = false;
     int status = 0;
 
@@ -452,15 +789,13 @@ int handleRequest(int j, fd_set* master_set) {
     //types to receive data for requests
     status = proto.receiveMessageSize(msgSize);
     if (status != 0) {
-        FD_CLR(j, master_set);
-        close(j);
+        closeConnection(j, master_set);
         return 0;
     }
 
     status = proto.receiveMessageType(type);
     if (status != 0) {
-        FD_CLR(j, master_set);
-        close(j);
+        closeConnection(j, master_set);
         return 0;
     }
 
@@ -469,38 +804,48 @@ int handleRequest(int j, fd_set* master_set) {
         return -1;
     }
 
-    if (type != EXECUTE) {
-        FD_CLR(j, master_set);
-        close(j);
+    if (type != EXECUTE && type != EXECUTE_DIRECTED && type != EXECUTE_STREAMED && type != EXECUTE_HANDLE) {
+        closeConnection(j, master_set);
         return 0;
     }
 
-    char buffer[msgSize];
-    status = proto.receiveMessage(msgSize, buffer);
+
+    // Receive the message straight into a heap stream, as the thread takes ownership of it
+    BinaryStream * frame = new BinaryStream(msgSize);
+    status = proto.receiveMessage(msgSize, frame->buffer());
     if (status != 0) {
-        FD_CLR(j, master_set);
-        close(j);
+        delete frame;
+        closeConnection(j, master_set);
         return 0;
     }
 
+    // Streamed arguments follow the frame, so the worker thread takes over the connection
+    if (type == EXECUTE_STREAMED) {
+        FD_CLR(j, master_set);
+    }
+
     // Prepare arguments for the thread
     pthread_t rthread;
-    void ** arguments = new void*[3];
+    void ** arguments = new void*[5];
 
     // Create copies of arguments on heap
     int * copy_socketfd = new int(j);
     unsigned int * copy_msgSize = new unsigned int(msgSize);
-    char * copy_buffer = new char[msgSize];
-    memcpy (copy_buffer, buffer, msgSize);
+    MessageType * copy_type = new MessageType(type);
+    Protocol * copy_connection = new Protocol(proto);
     
     // add to arguments
     arguments[0] = (void *)copy_socketfd;
     arguments[1] = (void *)copy_msgSize;
-    arguments[2] = (void *)copy_buffer;
+    arguments[2] = (void *)frame;
+    arguments[3] = (void *)copy_type;
+    arguments[4] = (void *)copy_connection;
 
-    // Start thread                    
+    // Start thread (it removes itself from the pool, so only once it is in there)
+    pthread_mutex_lock(m_listLock);
     pthread_create(&rthread, NULL, &thread_exec, (void *)arguments);
     m_threadPool[rthread] = j;
+    pthread_mutex_unlock(m_listLock);
 
     return 0;
 }
@@ -515,6 +860,9 @@ int rpcExecute() {
         return SOCKET_RECEIVE_ERROR;
     }
 
+    // No more functions are registered from here on, so they are frozen for the workers
+    freezeDispatch();
+
     // Establishes the file descriptor (is binder as binder is registered second)
     int max = binderfd;
     fd_set master, read_fds;
@@ -565,6 +913,9 @@ int rpcExecute() {
                         max = newfd;
                     }
 
+                    // The descriptor may be reused, so start with fresh state
+                    m_connections.erase(newfd);
+
                     FD_SET(newfd, &master);
                 }
                 else {
@@ -586,8 +937,12 @@ int rpcExecute() {
         // kill thread
         pthread_cancel(pair.first);
 
-        // talk to client, tell it we are done
+        // talk to client (in the framing it uses), tell it we are done
         Protocol handler(pair.second);
+        map<int, Protocol>::iterator state = m_connections.find(pair.second);
+        if (state != m_connections.end()) {
+            handler = state->second;
+        }
         handler.sendExecuteError(ReasonCode::RECEIVED_TERMINATED);
         
         // close the pair
@@ -0,0 +1,264 @@
+#include "rpcstream.h"
+#include "rpc.h"
+#include "helpers.h"
+#include "protocol.h"
+#include "constants.h"
+#include "packing.h"
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+// The most bytes a value takes in a chunk: floating point values are written as text, which for the largest
+// doubles is over three hundred digits.
+#define MAX_TEXT_VALUE_SIZE 320
+
+// The bytes of a chunk besides its values: the number of elements, and the encoding of packed ones.
+#define CHUNK_OVERHEAD 16
+
+//--------------------------------------------------------------------------------------
+
+// Gets the most elements of the type a chunk holds (senders split their elements into chunks of this many).
+static unsigned int chunkElements(int ctype) {
+    return STREAM_CHUNK_SIZE / type_sizeof(ctype);
+}
+
+// Receives the next message of an input stream, either loading the next chunk or marking the end of the stream.
+static int loadChunk(rpc_stream* stream) {
+    Protocol& handler = stream->connection;
+    int status = 0;
+
+    unsigned int messageSize;
+    MessageType type;
+
+    status = handler.receiveMessageSize(messageSize);
+    if (status != 0) {
+        return status;
+    }
+
+    status = handler.receiveMessageType(type);
+    if (status != 0) {
+        return status;
+    }
+
+    if (type == STREAM_END && messageSize == 0) {
+        stream->ended = true;
+        return 0;
+    }
+
+    if (type != STREAM_CHUNK || messageSize < SIZEOF_INTEGER) {
+        return RECEIVE_INVALID_MESSAGE_TYPE;
+    }
+
+    // Chunks are never larger than a full chunk of values, so the memory a stream takes stays bounded
+    int ctype = getArgType(stream->argType);
+    unsigned int valueSize = type_is_native(ctype) ? type_sizeof(ctype) : MAX_TEXT_VALUE_SIZE;
+    if (messageSize > CHUNK_OVERHEAD + chunkElements(ctype) * valueSize) {
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    // Receive the chunk, it replaces the (fully read) previous one
+    stream->chunk = BinaryStream(messageSize);
+    status = handler.receiveMessage(messageSize, stream->chunk.buffer());
+    if (status != 0) {
+        return status;
+    }
+
+    stream->available = stream->chunk.readUInt32();
+
+    // The caller can never send more than it declared
+    if (stream->available > stream->length - stream->transferred) {
+        stream->available = 0;
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    // Values written as they are in memory have to be in the chunk (text is checked as it is read)
+    bool packed = isArgTypePacked(stream->argType);
+    if (!packed && type_is_native(ctype) && (size_t) stream->available * type_sizeof(ctype) > messageSize - SIZEOF_INTEGER) {
+        stream->available = 0;
+        return RECEIVE_INVALID_MESSAGE;
+    }
+
+    // Packed chunks are unpacked up front, as skeletons can read any part of a chunk (their values may take far fewer
+    // bytes than in memory, so their storage is bounded by the elements a chunk holds instead)
+    if (packed) {
+        if (stream->available > chunkElements(ctype)) {
+            stream->available = 0;
+            return RECEIVE_INVALID_MESSAGE;
+        }
+
+        vector<char> values((size_t) stream->available * type_sizeof(ctype) + 1);
+        status = packing_decode(stream->chunk, ctype, &values.front(), stream->available);
+        if (status != 0) {
+            stream->available = 0;
+            return status;
+        }
+
+        stream->chunk = BinaryStream();
+        writeValues(stream->chunk, ctype, &values.front(), stream->available);
+        stream->chunk.seek(0);
+    }
+    return 0;
+}
+
+// Receives the next message of an input stream (see loadChunk), failing the stream if it cannot be read.
+static int receiveChunk(rpc_stream* stream) {
+    if (stream->failure == 0) {
+        stream->failure = loadChunk(stream);
+    }
+    return stream->failure;
+}
+
+//--------------------------------------------------------------------------------------
+
+rpc_stream* linkStreams(int argTypes[], void* args[]) {
+    rpc_stream* last = NULL;
+
+    // Inputs are transferred first, then outputs
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned int i = 0; argTypes[i] != 0; i++) {
+            if (!isArgTypeStream(argTypes[i]) || isArgTypeInput(argTypes[i]) != (pass == 0)) {
+                continue;
+            }
+
+            // Requests that failed to decode leave the streams after the failure unset
+            rpc_stream* stream = (rpc_stream*) args[i];
+            if (stream == NULL) {
+                continue;
+            }
+            stream->previous = last;
+            last = stream;
+        }
+    }
+    return last;
+}
+
+int finishStream(rpc_stream* stream) {
+    if (stream == NULL) {
+        return 0;
+    }
+
+    // Earlier streams have to be finished before this one
+    int status = finishStream(stream->previous);
+    if (status != 0) {
+        return status;
+    }
+
+    if (stream->ended) {
+        return 0;
+    }
+
+    // Outputs are finished by telling the caller there is nothing more
+    if (isArgTypeOutput(stream->argType)) {
+        stream->ended = true;
+        return stream->connection.sendChunkEnd();
+    }
+
+    // Inputs are finished by skipping everything that is left
+    while (!stream->ended) {
+        status = receiveChunk(stream);
+        if (status != 0) {
+            return status;
+        }
+        stream->transferred += stream->available;
+        stream->available = 0;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+
+int rpcStreamRead(rpc_stream* stream, void* data, unsigned int count) {
+    if (stream == NULL || !isArgTypeInput(stream->argType)) {
+        return ERROR;
+    }
+
+    // Streams arrive one after another, so any earlier stream must be finished first
+    int status = finishStream(stream->previous);
+    if (status != 0) {
+        return status;
+    }
+
+    int ctype = getArgType(stream->argType);
+    int size = type_sizeof(ctype);
+    unsigned int read = 0;
+
+    // Read chunks until we have as many elements as requested, or the stream ends
+    while (read < count) {
+        if (stream->available == 0) {
+            if (stream->ended) {
+                break;
+            }
+
+            status = receiveChunk(stream);
+            if (status != 0) {
+                return status;
+            }
+            continue;
+        }
+
+        // Values written as text may not parse, or run past the chunk
+        unsigned int n = count - read < stream->available ? count - read : stream->available;
+        try {
+            readValues(stream->chunk, ctype, (char*) data + (size_t) read * size, n);
+        }
+        catch (const exception& e) {
+            stream->available = 0;
+            stream->failure = RECEIVE_INVALID_MESSAGE;
+            return stream->failure;
+        }
+
+        read += n;
+        stream->available -= n;
+        stream->transferred += n;
+    }
+
+    return read;
+}
+
+int rpcStreamWrite(rpc_stream* stream, void* data, unsigned int count) {
+    if (stream == NULL || !isArgTypeOutput(stream->argType) || stream->ended) {
+        return ERROR;
+    }
+
+    // The caller has no room for more than its capacity
+    if (stream->transferred + count > stream->length) {
+        return ERROR;
+    }
+
+    // Outputs follow every input and earlier output
+    int status = finishStream(stream->previous);
+    if (status != 0) {
+        return status;
+    }
+
+    int ctype = getArgType(stream->argType);
+    int size = type_sizeof(ctype);
+    unsigned int perChunk = STREAM_CHUNK_SIZE / size;
+    Protocol& handler = stream->connection;
+
+    // Send the elements in chunks
+    unsigned int written = 0;
+    while (written < count) {
+        unsigned int n = count - written < perChunk ? count - written : perChunk;
+
+        status = handler.sendChunk(stream->argType, (char*) data + (size_t) written * size, n);
+        if (status != 0) {
+            return SOCKET_SEND_ERROR;
+        }
+
+        written += n;
+        stream->transferred += n;
+    }
+
+    return written;
+}
+
+unsigned int rpcStreamLength(rpc_stream* stream) {
+    if (stream == NULL) {
+        return 0;
+    }
+    return stream->length;
+}
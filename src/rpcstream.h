@@ -0,0 +1,56 @@
+#pragma once
+
+/*
+rpcstream.h
+
+Server-side state of a streamed (ARG_STREAM) argument.
+
+The elements of streamed arguments follow the execute message in STREAM_CHUNK messages, so a skeleton
+can start working on the first chunk while the rest is still in flight. Streams are transferred one after
+another (inputs in argument order, then outputs in argument order), so each stream is linked to the one
+before it, and finishing a stream finishes every stream before it.
+*/
+
+#include "bstream.h"
+#include "protocol.h"
+
+// Provides the state of a streamed argument handed to a skeleton (see rpc.h).
+struct rpc_stream {
+    // The connection the stream is transferred over (with the framing and codecs of the caller).
+    Protocol connection;
+
+    // The argument type of the streamed argument.
+    int argType;
+
+    // The number of elements declared by the caller (inputs), or the capacity of the caller (outputs).
+    unsigned int length;
+
+    // The number of elements read or written so far.
+    unsigned int transferred;
+
+    // Determines if the STREAM_END of this stream has been received (inputs) or sent (outputs).
+    bool ended;
+
+    // The stream transferred before this one (NULL if it is the first).
+    rpc_stream* previous;
+
+    // The chunk currently being read, and the number of its elements not yet read.
+    BinaryStream chunk;
+    unsigned int available;
+
+    // The error receiving the stream failed with (zero if none).  Nothing more is read from a failed stream, as the
+    // connection is no longer in step with the caller.
+    int failure;
+
+    // Creates an instance of the rpc_stream struct for the argument transferred over the connection.
+    rpc_stream(const Protocol& connection, int argType, unsigned int length)
+        : connection(connection), argType(argType), length(length), transferred(0),
+          ended(false), previous(NULL), available(0), failure(0) {}
+};
+
+// Links the streamed arguments in the order they are transferred, returning the last of them (or NULL if there are none).
+// Arguments with no stream (as when the request failed to decode) are skipped.
+rpc_stream* linkStreams(int argTypes[], void* args[]);
+
+// Finishes the stream and every stream before it, skipping any unread input and ending any unfinished output.
+int finishStream(rpc_stream* stream);
@@ -0,0 +1,118 @@
+#include "servicecache.h"
+
+#include <functional>
+
+using namespace std;
+
+//--------------------------------------------------------------------------------------
+
+ServiceCache::ServiceCache() {
+}
+
+ServiceCache::Shard& ServiceCache::shard(const string& signature) {
+    return m_shards[hash<string>()(signature) % SERVICE_CACHE_SHARDS];
+}
+
+service_list ServiceCache::find(const string& signature, unsigned int& generation, chrono::steady_clock::time_point& revalidate) {
+    shared_ptr<const Table> table = atomic_load(&shard(signature).table);
+
+    Table::const_iterator found = table->find(signature);
+    if (found == table->end()) {
+        return service_list();
+    }
+    generation = found->second.generation;
+    revalidate = found->second.revalidate;
+    return found->second.services;
+}
+
+service_list ServiceCache::store(const string& signature, const list<function_info>& services, unsigned int generation,
+                                 chrono::steady_clock::time_point revalidate) {
+    Shard& signatureShard = shard(signature);
+    service_list stored = make_shared<const list<function_info>>(services);
+    bool subscribed = (revalidate == chrono::steady_clock::time_point::max());
+
+    pthread_mutex_lock(&signatureShard.writeLock);
+    shared_ptr<const Table> current = atomic_load(&signatureShard.table);
+    Table::const_iterator found = current->find(signature);
+    if (found == current->end() || !subscribed || found->second.generation <= generation) {
+        shared_ptr<Table> table = make_shared<Table>(*current);
+        Entry& entry = (*table)[signature];
+        entry.services = stored;
+        entry.generation = generation;
+        entry.revalidate = revalidate;
+        atomic_store(&signatureShard.table, shared_ptr<const Table>(table));
+    }
+    pthread_mutex_unlock(&signatureShard.writeLock);
+
+    return stored;
+}
+
+void ServiceCache::renew(const string& signature, const service_list& services, chrono::steady_clock::time_point revalidate) {
+    Shard& signatureShard = shard(signature);
+
+    pthread_mutex_lock(&signatureShard.writeLock);
+    shared_ptr<const Table> current = atomic_load(&signatureShard.table);
+    Table::const_iterator found = current->find(signature);
+    if (found != current->end() && found->second.services == services) {
+        shared_ptr<Table> table = make_shared<Table>(*current);
+        (*table)[signature].revalidate = revalidate;
+        atomic_store(&signatureShard.table, shared_ptr<const Table>(table));
+    }
+    pthread_mutex_unlock(&signatureShard.writeLock);
+}
+
+void ServiceCache::remove(const string& signature, const service_list& services) {
+    Shard& signatureShard = shard(signature);
+
+    pthread_mutex_lock(&signatureShard.writeLock);
+    shared_ptr<const Table> current = atomic_load(&signatureShard.table);
+    Table::const_iterator found = current->find(signature);
+    if (found != current->end() && found->second.services == services) {
+        shared_ptr<Table> table = make_shared<Table>(*current);
+        table->erase(signature);
+        atomic_store(&signatureShard.table, shared_ptr<const Table>(table));
+    }
+    pthread_mutex_unlock(&signatureShard.writeLock);
+}
+
+void ServiceCache::apply(const string& signature, unsigned int generation, const service_change& change) {
+    Shard& signatureShard = shard(signature);
+
+    pthread_mutex_lock(&signatureShard.writeLock);
+    shared_ptr<const Table> current = atomic_load(&signatureShard.table);
+    shared_ptr<Table> table = make_shared<Table>(*current);
+    Entry& entry = (*table)[signature];
+
+    // The change follows the list we have, so change a copy of it
+    if (entry.services && entry.generation + 1 == generation) {
+        list<function_info> services(*entry.services);
+        change(services);
+        entry.services = make_shared<const list<function_info>>(services);
+    }
+    else {
+        entry.services.reset();
+    }
+    entry.generation = generation;
+
+    atomic_store(&signatureShard.table, shared_ptr<const Table>(table));
+    pthread_mutex_unlock(&signatureShard.writeLock);
+}
+
+void ServiceCache::clear() {
+    for (unsigned int i = 0; i < SERVICE_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&m_shards[i].writeLock);
+        atomic_store(&m_shards[i].table, shared_ptr<const Table>(make_shared<Table>()));
+        pthread_mutex_unlock(&m_shards[i].writeLock);
+    }
+}
+
+void ServiceCache::visit(const service_visit& visitor) {
+    for (unsigned int i = 0; i < SERVICE_CACHE_SHARDS; i++) {
+        shared_ptr<const Table> table = atomic_load(&m_shards[i].table);
+        for (Table::const_iterator it = table->begin(); it != table->end(); ++it) {
+            if (it->second.services) {
+                visitor(it->first, it->second.services, it->second.generation);
+            }
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+/*
+servicecache.h
+
+The servers a client knows to support each signature (see rpcCacheCall), read by every cached call and
+only changed when the binder is asked again.
+
+The cache is split in shards by the hash of the signature.  Each shard is an immutable table that is
+replaced as a whole on every change, in the manner of read-copy-update: readers take a reference to the
+current table, and to the list of servers in it, without a lock and without copying the list, while
+writers (one at a time per shard) copy the table, change the copy and publish it.  Readers still holding
+an earlier table keep it alive until they are done with it.
+
+Every list carries the generation the binder gave it.  Lists fetched over a subscription (see rpcSubscribe)
+are never revalidated, as the changes the binder pushes afterwards are applied to them in order.  A list
+that missed a change is dropped, and its generation kept, so a response older than the change cannot
+bring it back.  Other lists are due for revalidation after a while, when the binder is asked whether
+their generation is still current (see rpcSetRevalidation).
+*/
+
+#include "rpcinfo.h"
+
+#include <pthread.h>
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+// The shards of the cache.
+#define SERVICE_CACHE_SHARDS 16
+
+// A list of servers, shared by the cache and the calls reading it.
+typedef std::shared_ptr<const std::list<function_info>> service_list;
+
+// Changes a list of servers.
+typedef std::function<void(std::list<function_info>&)> service_change;
+
+// Visits the servers of a signature, along with their generation.
+typedef std::function<void(const std::string&, const service_list&, unsigned int)> service_visit;
+
+// Caches the servers of the signatures called.
+class ServiceCache {
+  public:
+    // Initializes a new instance of the ServiceCache class with no servers.
+    ServiceCache();
+
+    // Finds the servers of the signature (keyed as by signatureKey), along with their generation and when they are due for
+    // revalidation.  Returns an empty list pointer if there are none cached.
+    service_list find(const std::string& signature, unsigned int& generation, std::chrono::steady_clock::time_point& revalidate);
+
+    // Stores the servers of the signature with their generation, and when they are due for revalidation (never, for lists
+    // kept up to date by a subscription), returning the list.  Subscribed lists are not stored if the cache saw a later generation.
+    service_list store(const std::string& signature, const std::list<function_info>& services, unsigned int generation,
+                       std::chrono::steady_clock::time_point revalidate);
+
+    // Sets when the servers of the signature are next due for revalidation, unless they were replaced since they were found.
+    void renew(const std::string& signature, const service_list& services, std::chrono::steady_clock::time_point revalidate);
+
+    // Removes the servers of the signature, unless they were replaced since they were found.
+    void remove(const std::string& signature, const service_list& services);
+
+    // Applies the change that brought the servers of the signature to the generation, dropping them if they missed an earlier one.
+    void apply(const std::string& signature, unsigned int generation, const service_change& change);
+
+    // Removes the servers of every signature.
+    void clear();
+
+    // Visits the servers of every signature cached.
+    void visit(const service_visit& visitor);
+
+  private:
+    // The servers of a signature (none once dropped), their generation, and when they are due for revalidation.
+    struct Entry {
+        service_list services;
+        unsigned int generation;
+        std::chrono::steady_clock::time_point revalidate;
+
+        Entry() : generation(0), revalidate(std::chrono::steady_clock::time_point::max()) {}
+    };
+    typedef std::map<std::string, Entry> Table;
+
+    struct Shard {
+        pthread_mutex_t writeLock;
+        std::shared_ptr<const Table> table;
+
+        Shard() : table(std::make_shared<Table>()) {
+            pthread_mutex_init(&writeLock, NULL);
+        }
+    };
+
+    // Gets the shard of the signature.
+    Shard& shard(const std::string& signature);
+
+    Shard m_shards[SERVICE_CACHE_SHARDS];
+
+    // The cache is shared by address, so copying is not permitted
+    ServiceCache(const ServiceCache&);
+    ServiceCache& operator =(const ServiceCache&);
+};
@@ -0,0 +1,270 @@
+#include "snapshot.h"
+#include "bstream.h"
+#include "constants.h"
+#include "conversion.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+// The magic the file starts with, and the size of the header (the magic, the number of entries and the time written)
+#define SNAPSHOT_MAGIC "RPCSNAP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_HEADER_SIZE 20
+#define SIZEOF_INTEGER 4
+
+//--------------------------------------------------------------------------------------
+
+// Writes the length and bytes of a string (which, unlike writeString, reads back the same).
+void writeText(BinaryStream& stream, const string& text) {
+    stream.writeUInt32(text.size());
+    stream.writeBytes(text.data(), text.size());
+}
+
+// Reads a string written by writeText.
+string readText(BinaryStream& stream) {
+    unsigned int length = stream.readUInt32();
+    if (length > (unsigned int) (stream.size() - stream.position())) {
+        throw out_of_range("readText");
+    }
+
+    string text(length, '\0');
+    stream.readBytes(&text[0], length);
+    return text;
+}
+
+//--------------------------------------------------------------------------------------
+
+// Gets the number of entries of the image, along with the time it was written.  Returns false if it is not a snapshot,
+// or its index does not fit.
+bool snapshot_header(const char* image, size_t size, unsigned int& count, time_t& written) {
+    if (image == NULL || size < SNAPSHOT_HEADER_SIZE || memcmp(image, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    count = Convert::parseUInt32(image + SNAPSHOT_MAGIC_SIZE);
+    written = (time_t) Convert::parseUInt64(image + SNAPSHOT_MAGIC_SIZE + SIZEOF_INTEGER);
+    return count <= (size - SNAPSHOT_HEADER_SIZE) / SIZEOF_INTEGER;
+}
+
+// Gets the offset of the entry of the signature in the image with the number of entries, or zero if there is none.
+unsigned int snapshot_search(const char* image, size_t size, unsigned int count, const string& signature) {
+    unsigned int low = 0, high = count;
+    while (low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        unsigned int offset = Convert::parseUInt32(image + SNAPSHOT_HEADER_SIZE + middle * SIZEOF_INTEGER);
+
+        // The entry starts with its length, followed by the length of the signature and the signature itself
+        if (offset < SNAPSHOT_HEADER_SIZE || offset > size - 2 * SIZEOF_INTEGER) {
+            return 0;
+        }
+        unsigned int length = Convert::parseUInt32(image + offset + SIZEOF_INTEGER);
+        if (length > size - offset - 2 * SIZEOF_INTEGER) {
+            return 0;
+        }
+
+        int order = signature.compare(0, string::npos, image + offset + 2 * SIZEOF_INTEGER, length);
+        if (order == 0) {
+            return offset;
+        }
+        else if (order < 0) {
+            high = middle;
+        }
+        else {
+            low = middle + 1;
+        }
+    }
+    return 0;
+}
+
+// Reads the entry at the offset of the image.  Returns false if it is invalid.
+bool snapshot_read(const char* image, size_t size, unsigned int offset, string& signature, list<function_info>& services, unsigned int& generation) {
+    if (offset < SNAPSHOT_HEADER_SIZE || offset > size - SIZEOF_INTEGER) {
+        return false;
+    }
+    unsigned int length = Convert::parseUInt32(image + offset);
+    if (length > size - offset - SIZEOF_INTEGER) {
+        return false;
+    }
+
+    // Entries that run past their length are invalid
+    BinaryStream stream(const_cast<char*>(image) + offset + SIZEOF_INTEGER, length);
+    try {
+        signature = readText(stream);
+        generation = stream.readUInt32();
+        unsigned int count = stream.readUInt32();
+        if (count > length) {
+            return false;
+        }
+
+        services.clear();
+        for (unsigned int i = 0; i < count; i++) {
+            string server_identifier = readText(stream);
+            unsigned short port = stream.readUInt16();
+            unsigned int version = stream.readUInt32();
+            unsigned int ttl = stream.readUInt32();
+            services.push_back(function_info(server_identifier, port, NULL, version, ttl));
+        }
+    }
+    catch (const exception& e) {
+        return false;
+    }
+    return true;
+}
+
+void snapshot_encode(const snapshot_entries& entries, string& image) {
+    // The entries follow the header and the index, in the order of their signatures
+    BinaryStream header;
+    header.writeBytes(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    header.writeUInt32(entries.size());
+    header.writeUInt64((uint64_t) time(NULL));
+
+    BinaryStream body;
+    unsigned int start = SNAPSHOT_HEADER_SIZE + entries.size() * SIZEOF_INTEGER;
+    for (snapshot_entries::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        header.writeUInt32(start + body.size());
+
+        BinaryStream entry;
+        writeText(entry, it->first);
+        entry.writeUInt32(it->second.second);
+        entry.writeUInt32(it->second.first->size());
+        for (const function_info& service : *it->second.first) {
+            writeText(entry, service.server_identifier);
+            entry.writeUInt16(service.port);
+            entry.writeUInt32(service.version);
+            entry.writeUInt32(service.ttl);
+        }
+
+        body.writeUInt32(entry.size());
+        body.writeBytes(entry.str(), entry.size());
+    }
+
+    image.assign(header.str(), header.size());
+    if (body.size() > 0) {
+        image.append(body.str(), body.size());
+    }
+}
+
+bool snapshot_find(const char* image, size_t size, const string& signature, list<function_info>& services, unsigned int& generation) {
+    unsigned int count = 0;
+    time_t written = 0;
+    if (!snapshot_header(image, size, count, written)) {
+        return false;
+    }
+
+    string found;
+    unsigned int offset = snapshot_search(image, size, count, signature);
+    return offset != 0 && snapshot_read(image, size, offset, found, services, generation) && found == signature;
+}
+
+//--------------------------------------------------------------------------------------
+
+ServiceSnapshot::ServiceSnapshot() : m_data(NULL), m_size(0), m_count(0), m_written(0) {
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+ServiceSnapshot::~ServiceSnapshot() {
+    unmap();
+}
+
+void ServiceSnapshot::unmap() {
+    if (m_data != NULL) {
+        munmap(m_data, m_size);
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_count = 0;
+    m_taken.clear();
+}
+
+void ServiceSnapshot::open(const string& path) {
+    pthread_mutex_lock(&m_lock);
+    unmap();
+    m_path = path;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size >= SNAPSHOT_HEADER_SIZE) {
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            m_data = (char*) data;
+            m_size = info.st_size;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // Files that are not snapshots, or whose index does not fit, hold no entries
+    if (m_data != NULL && !snapshot_header(m_data, m_size, m_count, m_written)) {
+        unmap();
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+bool ServiceSnapshot::take(const string& signature, list<function_info>& services, unsigned int& generation, time_t& age) {
+    bool taken = false;
+
+    pthread_mutex_lock(&m_lock);
+    if (m_data != NULL && m_taken.find(signature) == m_taken.end()) {
+        string found;
+        unsigned int offset = snapshot_search(m_data, m_size, m_count, signature);
+        if (offset != 0 && snapshot_read(m_data, m_size, offset, found, services, generation) && found == signature && !services.empty()) {
+            m_taken.insert(signature);
+            time_t now = time(NULL);
+            age = now > m_written ? now - m_written : 0;
+            taken = true;
+        }
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return taken;
+}
+
+int ServiceSnapshot::write(const snapshot_entries& entries) {
+    pthread_mutex_lock(&m_lock);
+    if (m_path.empty()) {
+        pthread_mutex_unlock(&m_lock);
+        return 0;
+    }
+
+    // Entries never taken are kept, for the runs that call their functions
+    snapshot_entries merged(entries);
+    for (unsigned int i = 0; m_data != NULL && i < m_count; i++) {
+        string signature;
+        list<function_info> services;
+        unsigned int generation = 0;
+        unsigned int offset = Convert::parseUInt32(m_data + SNAPSHOT_HEADER_SIZE + i * SIZEOF_INTEGER);
+        if (snapshot_read(m_data, m_size, offset, signature, services, generation) && m_taken.find(signature) == m_taken.end() && merged.find(signature) == merged.end()) {
+            merged[signature] = make_pair(make_shared<const list<function_info>>(services), generation);
+        }
+    }
+
+    string image;
+    snapshot_encode(merged, image);
+
+    // Written to a file of our own first, so readers see either the old snapshot or the new one
+    string temporary = m_path + ".tmp." + to_string((long long) getpid());
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd >= 0 && ::write(fd, image.data(), image.size()) == (ssize_t) image.size() && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    int status = SUCCESS;
+    if (!written || rename(temporary.c_str(), m_path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        status = ERROR;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return status;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+snapshot.h
+
+A file holding the servers a client knew for each signature when it last exited (see rpcSetCacheSnapshot),
+so short-lived clients that call the same functions run after run do not ask the binder for all of them
+every time.
+
+The file is mapped into memory when it is opened, and an entry is only read the first time its signature
+misses the service cache.  Entries are sorted by signature behind an index of their offsets, so finding one
+is a binary search over the mapping.  Each entry is taken at most once: the list it holds is stored in the
+service cache with its generation, and from then on revalidated with the binder like any other (so a list
+that changed, or a binder that restarted, is caught by its generation).
+
+On exit, the lists of the service cache are written to a temporary file along with the entries that were
+never taken, and the file is renamed over the snapshot, so a reader never sees a partial one.
+
+File format: the magic "RPCSNAP1", the number of entries, the time the file was written (seconds since the
+epoch) and the offset of each entry, then the entries themselves: the length of the entry, the signature,
+the generation and the number of servers, and the identifier, port, protocol version and time to live of
+each of the servers.
+*/
+
+#include "servicecache.h"
+
+#include <pthread.h>
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+// The servers of each signature, with their generation, to be written to a snapshot.
+typedef std::map<std::string, std::pair<service_list, unsigned int>> snapshot_entries;
+
+// Encodes the entries in the layout of a snapshot file (the image).
+void snapshot_encode(const snapshot_entries& entries, std::string& image);
+
+// Finds the servers of the signature in the image of the size, along with their generation.  Returns false if there are
+// none, or the image is invalid (it is never read past its size).
+bool snapshot_find(const char* image, size_t size, const std::string& signature, std::list<function_info>& services, unsigned int& generation);
+
+// The snapshot of the service cache of a client.
+class ServiceSnapshot {
+  public:
+    // Initializes a new instance of the ServiceSnapshot class with no file.
+    ServiceSnapshot();
+    ~ServiceSnapshot();
+
+    // Maps the snapshot at the path, which is written to on exit.  A missing or invalid file holds no entries.
+    void open(const std::string& path);
+
+    // Takes the servers of the signature (keyed as by signatureKey), along with their generation and the seconds since the
+    // snapshot was written.  Returns false if the snapshot has none, or they were taken already.
+    bool take(const std::string& signature, std::list<function_info>& services, unsigned int& generation, time_t& age);
+
+    // Replaces the snapshot with the entries, and those of the current snapshot that were never taken.
+    int write(const snapshot_entries& entries);
+
+  private:
+    // Unmaps the current snapshot.
+    void unmap();
+
+    pthread_mutex_t m_lock;
+    std::string m_path;
+    char* m_data;
+    size_t m_size;
+    unsigned int m_count;
+    time_t m_written;
+    std::set<std::string> m_taken;
+
+    // The snapshot is shared by address, so copying is not permitted
+    ServiceSnapshot(const ServiceSnapshot&);
+    ServiceSnapshot& operator =(const ServiceSnapshot&);
+};